@@ -14,6 +14,12 @@ public:
     BRDF(const BRDF& other) = default;
     BRDF& operator=(const BRDF& rhs) = default;
 
+    inline bool operator==(const BRDF& rhs) const
+    {
+        return mKd == rhs.mKd && mKa == rhs.mKa && mKe == rhs.mKe && mKt == rhs.mKt
+            && mKr == rhs.mKr && mIOR == rhs.mIOR && mRoughness == rhs.mRoughness;
+    }
+
     inline const glm::vec3& Kd() const { return mKd; }
     inline const glm::vec3& Ka() const { return mKa; }
     inline const glm::vec3& Ke() const { return mKe; }
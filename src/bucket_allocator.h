@@ -9,5 +9,73 @@
 #ifndef trichoplax_BucketAllocator_h
 #define trichoplax_BucketAllocator_h
 
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include "common.h"
+
+
+// Hands out fixed size slots from buckets of slotsPerBucket slots each, in
+// the order they are asked for. Consecutive slots are adjacent in memory
+// and nothing is kept per slot, slots are only ever freed all at once.
+class BucketAllocator
+{
+public:
+    explicit BucketAllocator(size_t slotSize, size_t slotsPerBucket)
+        : mSlotSize(slotSize)
+        , mSlotsPerBucket(slotsPerBucket)
+        , mBuckets()
+        , mSlotsUsed(0)
+    {
+        TP_ASSERT(slotSize > 0 && slotsPerBucket > 0);
+    }
+
+    ~BucketAllocator()
+    {
+        for (char* bucket : mBuckets)
+        {
+            ::operator delete(bucket);
+        }
+    }
+
+    void* allocate()
+    {
+        const size_t slot = mSlotsUsed % mSlotsPerBucket;
+        if (slot == 0)
+        {
+            mBuckets.push_back(static_cast<char*>(::operator new(mSlotSize * mSlotsPerBucket)));
+        }
+
+        ++mSlotsUsed;
+        return mBuckets.back() + slot * mSlotSize;
+    }
+
+    void* slot(size_t idx) const
+    {
+        TP_ASSERT(idx < mSlotsUsed);
+        return mBuckets[idx / mSlotsPerBucket] + (idx % mSlotsPerBucket) * mSlotSize;
+    }
+
+    size_t slotsUsed() const { return mSlotsUsed; }
+    size_t numBuckets() const { return mBuckets.size(); }
+
+    // Memory held including the unused slots of the last bucket and the
+    // bucket list, vs. what the slots in use take
+    size_t bytesReserved() const
+    {
+        return mBuckets.size() * mSlotSize * mSlotsPerBucket + mBuckets.capacity() * sizeof(char*);
+    }
+    size_t bytesUsed() const { return mSlotsUsed * mSlotSize; }
+
+private:
+    BucketAllocator(const BucketAllocator&) = delete;
+    BucketAllocator& operator=(const BucketAllocator&) = delete;
+
+    const size_t        mSlotSize;
+    const size_t        mSlotsPerBucket;
+    std::vector<char*>  mBuckets;
+    size_t              mSlotsUsed;
+};
 
 #endif
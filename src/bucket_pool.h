@@ -9,6 +9,57 @@
 #ifndef __trichoplax__bucket_pool__
 #define __trichoplax__bucket_pool__
 
-#include <stdio.h>
+#include <cstddef>
+#include <utility>
+
+#include "bucket_allocator.h"
+
+// Objects per bucket for pools that don't know how many they'll hold
+#define BUCKET_POOL_DEFAULT_SIZE (4096)
+
+
+// Objects of one type constructed in a BucketAllocator's slots, so they
+// are laid out in construction order. They are all destroyed with the
+// pool. Pools that are sized to what they'll hold keep it in one bucket.
+template <typename T>
+class BucketPool
+{
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "Buckets are only aligned like any new'd memory");
+
+public:
+    explicit BucketPool(size_t objectsPerBucket = BUCKET_POOL_DEFAULT_SIZE)
+        : mAllocator(sizeof(T), objectsPerBucket > 0 ? objectsPerBucket : BUCKET_POOL_DEFAULT_SIZE)
+    {
+    }
+
+    ~BucketPool()
+    {
+        for (size_t i = 0; i < mAllocator.slotsUsed(); ++i)
+        {
+            (*this)[i].~T();
+        }
+    }
+
+    template <typename... Args>
+    T* create(Args&&... args)
+    {
+        return new (mAllocator.allocate()) T(std::forward<Args>(args)...);
+    }
+
+    size_t size() const { return mAllocator.slotsUsed(); }
+    const BucketAllocator& allocator() const { return mAllocator; }
+
+    T& operator[](size_t idx) const
+    {
+        return *static_cast<T*>(mAllocator.slot(idx));
+    }
+
+private:
+    BucketPool(const BucketPool&) = delete;
+    BucketPool& operator=(const BucketPool&) = delete;
+
+    BucketAllocator mAllocator;
+};
 
 #endif /* defined(__trichoplax__bucket_pool__) */
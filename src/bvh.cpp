@@ -0,0 +1,320 @@
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <algorithm>
+
+#include "bvh.h"
+#include "aabbox.h"
+#include "common.h"
+#include "triangle.h"
+#include "ray.h"
+#include "timer.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+// Same relative costs as the kd-tree so their SAH cost estimates compare
+#define TRAVERSAL_COST (15.f)
+#define INTERSECTION_COST (20.f)
+
+// Number of centroid bins per axis, there are SAH_BINS - 1 candidate splits
+#define SAH_BINS (16)
+
+// Nodes with more primitives than this are always split, WideBVH can't
+// reference larger leaves
+#define MAX_LEAF_PRIMITIVES (16)
+
+// Nodes with fewer primitives than this are always built on the calling thread
+#define PARALLEL_BUILD_MIN_PRIMITIVES (4096)
+
+namespace
+{
+// A box that any join() grows to exactly the joined box
+inline AABBox emptyBox()
+{
+    return AABBox(glm::vec3(std::numeric_limits<float>::max()),
+                  glm::vec3(-std::numeric_limits<float>::max()));
+}
+
+inline uint32_t centroidBin(float centroid, float binMin, float binScale)
+{
+    return std::min((uint32_t)std::max((centroid - binMin) * binScale, 0.f),
+                    (uint32_t)SAH_BINS - 1);
+}
+} // anonymous namespace
+
+BVH::BVH()
+    : mNodes()
+    , mMaxDepth(0)
+    , mLeafNodes(0)
+    , mMaxPrimsPerNode(0)
+    , mParallelDepth(0)
+    , mSAHCost(0.f)
+{
+}
+
+BVH::~BVH()
+{
+}
+
+std::unique_ptr<IAccelerator::TraversalContext> BVH::allocateTraversalContext() const
+{
+    return std::make_unique<BVHTraversalContext>(mMaxDepth);
+}
+
+bool BVH::traceClosest(Ray& ray, TraversalContext& ctx, Stats& threadStats) const
+{
+    return traverse<false>(ray, static_cast<BVHTraversalContext&>(ctx).stack, threadStats);
+}
+
+bool BVH::traceVisibility(Ray& ray, TraversalContext& ctx, Stats& threadStats) const
+{
+    return traverse<true>(ray, static_cast<BVHTraversalContext&>(ctx).stack, threadStats);
+}
+
+void BVH::build(uint32_t numThreads)
+{
+    HighResTimer t;
+    t.start();
+
+    // See KdTree::build()
+    mParallelDepth = 0;
+    while (numThreads > 1 && (1u << mParallelDepth) < numThreads * 2)
+    {
+        ++mParallelDepth;
+    }
+
+    BuildPrimitiveVector buildPrims(mPrimVector.size());
+    for (size_t i = 0; i < mPrimVector.size(); ++i)
+    {
+        BuildPrimitive& prim = buildPrims[i];
+        prim.bounds = mPrimVector[i]->bounds();
+        prim.centroid = (prim.bounds.ll() + prim.bounds.ur()) * 0.5f;
+        prim.primitive = mPrimVector[i];
+    }
+
+    BuildContext ctx;
+    build(ctx.allocNode(), buildPrims.data(), 0, (uint32_t)buildPrims.size(), 0, ctx);
+
+    // Leaves index into the primitives in the order the build left them
+    for (size_t i = 0; i < buildPrims.size(); ++i)
+    {
+        mPrimVector[i] = buildPrims[i].primitive;
+    }
+
+    ctx.nodes.shrink_to_fit();
+    mNodes.swap(ctx.nodes);
+
+    AABBox rootBounds = emptyBox();
+    for (const BuildPrimitive& prim : buildPrims)
+    {
+        rootBounds = rootBounds.join(prim.bounds);
+    }
+
+    mMaxDepth = ctx.maxDepth;
+    mLeafNodes = ctx.leafNodes;
+    mMaxPrimsPerNode = ctx.maxPrimsPerNode;
+    mSAHCost = buildPrims.empty() ? 0.f : (float)(ctx.sahCost / rootBounds.surfaceArea());
+
+    std::cout << "BVH Build Stats:" << std::endl;
+    std::cout << std::left << std::setw(30) << "  Max depth:" << mMaxDepth << std::endl;
+    std::cout << std::left << std::setw(30) << "  Max primitives per node:" << mMaxPrimsPerNode << std::endl;
+    std::cout << std::left << std::setw(30) << "  Total nodes:" << mNodes.size() << std::endl;
+    std::cout << std::left << std::setw(30) << "  Leaf nodes:" << mLeafNodes << std::endl;
+    std::cout << std::left << std::setw(30) << "  Total primitives:" << mPrimVector.size() << std::endl;
+    std::cout << std::left << std::setw(30) << "  Estimated SAH cost:" << mSAHCost << std::endl;
+    std::cout << std::left << std::setw(30) << "  Build threads:" << numThreads << std::endl;
+    std::cout << std::left << std::setw(30) << "  Build time:" << t.elapsedToString(t.elapsed()) << std::endl;
+}
+
+bool BVH::isParallelTask(uint32_t depth, uint32_t numPrimitives) const
+{
+    return depth < mParallelDepth && numPrimitives >= PARALLEL_BUILD_MIN_PRIMITIVES;
+}
+
+void BVH::build(uint32_t nodeIdx, BuildPrimitive* prims, uint32_t begin, uint32_t end,
+                uint32_t depth, BuildContext& ctx) const
+{
+    const uint32_t numPrimitives = end - begin;
+
+    AABBox bounds = emptyBox();
+    AABBox centroidBounds = emptyBox();
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        bounds = bounds.join(prims[i].bounds);
+        centroidBounds.encompass(prims[i].centroid);
+    }
+
+    const float leafCost = INTERSECTION_COST * numPrimitives;
+    SplitCandidate split;
+    if (numPrimitives > 1)
+    {
+        split = findSplit(prims, begin, end, bounds, centroidBounds);
+    }
+
+    // Base case
+    if (numPrimitives <= 1 ||
+        (numPrimitives <= MAX_LEAF_PRIMITIVES && leafCost <= split.cost))
+    {
+        ctx.nodes[nodeIdx].initLeaf(bounds, begin, numPrimitives);
+
+        ctx.maxDepth = std::max(depth, ctx.maxDepth);
+        ctx.maxPrimsPerNode = std::max(numPrimitives, ctx.maxPrimsPerNode);
+        ctx.sahCost += leafCost * bounds.surfaceArea();
+        ++ctx.leafNodes;
+        return;
+    }
+
+    ctx.sahCost += TRAVERSAL_COST * bounds.surfaceArea();
+
+    uint32_t middle;
+    uint32_t axis = split.axis;
+    if (split.cost < std::numeric_limits<float>::max())
+    {
+        const float binMin = centroidBounds.ll()[axis];
+        const float binScale = (float)SAH_BINS / (centroidBounds.ur()[axis] - binMin);
+        const uint32_t splitBin = split.bin;
+
+        BuildPrimitive* mid = std::partition(prims + begin, prims + end,
+            [axis, binMin, binScale, splitBin](const BuildPrimitive& prim)
+            {
+                return centroidBin(prim.centroid[axis], binMin, binScale) < splitBin;
+            });
+        middle = (uint32_t)(mid - prims);
+    }
+    else
+    {
+        // All centroids coincide, any split is as good as another
+        middle = begin + numPrimitives / 2;
+        axis = (uint32_t)bounds.longestAxis();
+    }
+    TP_ASSERT(middle > begin && middle < end);
+
+    uint32_t rightChildIdx;
+    if (isParallelTask(depth, numPrimitives))
+    {
+        // Same scheme as the kd-tree, the left subtree is built as a new
+        // task and both are appended in order once they're done.
+        BuildContext leftCtx;
+        BuildContext rightCtx;
+
+        TaskGroup tasks;
+        tasks.run([&]()
+        {
+            build(leftCtx.allocNode(), prims, begin, middle, depth + 1, leftCtx);
+        });
+
+        build(rightCtx.allocNode(), prims, middle, end, depth + 1, rightCtx);
+        tasks.wait();
+
+        ctx.append(leftCtx);
+        rightChildIdx = ctx.append(rightCtx);
+    }
+    else
+    {
+        build(ctx.allocNode(), prims, begin, middle, depth + 1, ctx);
+
+        rightChildIdx = ctx.allocNode();
+        build(rightChildIdx, prims, middle, end, depth + 1, ctx);
+    }
+
+    ctx.nodes[nodeIdx].initInner(bounds, rightChildIdx, axis);
+}
+
+BVH::SplitCandidate BVH::findSplit(const BuildPrimitive* prims, uint32_t begin, uint32_t end,
+                                   const AABBox& bounds, const AABBox& centroidBounds) const
+{
+    SplitCandidate bestSplit;
+    const float invArea = 1.f / bounds.surfaceArea();
+
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        const float binMin = centroidBounds.ll()[axis];
+        const float extent = centroidBounds.ur()[axis] - binMin;
+        if (!(extent > 0.f))
+        {
+            continue;
+        }
+
+        const float binScale = (float)SAH_BINS / extent;
+        AABBox binBounds[SAH_BINS];
+        uint32_t binCounts[SAH_BINS] = {0};
+        std::fill(binBounds, binBounds + SAH_BINS, emptyBox());
+
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            const uint32_t bin = centroidBin(prims[i].centroid[axis], binMin, binScale);
+            binBounds[bin] = binBounds[bin].join(prims[i].bounds);
+            ++binCounts[bin];
+        }
+
+        // Sweep from the right to get the area and count above every
+        // candidate, then from the left evaluating the cost of each.
+        float rightAreas[SAH_BINS];
+        uint32_t rightCounts[SAH_BINS];
+        AABBox rightBounds = emptyBox();
+        uint32_t numRight = 0;
+        for (uint32_t bin = SAH_BINS - 1; bin > 0; --bin)
+        {
+            rightBounds = rightBounds.join(binBounds[bin]);
+            numRight += binCounts[bin];
+            rightAreas[bin] = rightBounds.surfaceArea();
+            rightCounts[bin] = numRight;
+        }
+
+        AABBox leftBounds = emptyBox();
+        uint32_t numLeft = 0;
+        for (uint32_t bin = 1; bin < SAH_BINS; ++bin)
+        {
+            leftBounds = leftBounds.join(binBounds[bin - 1]);
+            numLeft += binCounts[bin - 1];
+            if (numLeft == 0 || rightCounts[bin] == 0)
+            {
+                continue;
+            }
+
+            const float cost = TRAVERSAL_COST + INTERSECTION_COST * invArea *
+                (leftBounds.surfaceArea() * numLeft + rightAreas[bin] * rightCounts[bin]);
+            if (cost < bestSplit.cost)
+            {
+                bestSplit.cost = cost;
+                bestSplit.axis = axis;
+                bestSplit.bin = bin;
+            }
+        }
+    }
+
+    return bestSplit;
+}
+
+BVH::SplitCandidate::SplitCandidate()
+    : cost(std::numeric_limits<float>::max())
+    , axis(0)
+    , bin(0)
+{
+}
+
+BVH::BuildContext::BuildContext()
+    : nodes()
+    , maxDepth(0)
+    , leafNodes(0)
+    , maxPrimsPerNode(0)
+    , sahCost(0.0)
+{
+}
+
+uint32_t BVH::BuildContext::append(BuildContext& other)
+{
+    const uint32_t offset = (uint32_t)nodes.size();
+    nodes.insert(nodes.end(), other.nodes.begin(), other.nodes.end());
+    for (uint32_t i = offset; i < nodes.size(); ++i)
+    {
+        nodes[i].relocate(offset);
+    }
+
+    maxDepth = std::max(other.maxDepth, maxDepth);
+    leafNodes += other.leafNodes;
+    maxPrimsPerNode = std::max(other.maxPrimsPerNode, maxPrimsPerNode);
+    sahCost += other.sahCost;
+
+    return offset;
+}
@@ -0,0 +1,257 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+#include <cstdint>
+
+#include "aligned_allocator.h"
+#include "aabbox.h"
+#include "common.h"
+#include "stats.h"
+#include "iaccelerator.h"
+
+
+class Triangle;
+class Ray;
+
+
+// Binary bounding volume hierarchy built with a binned SAH. Every primitive
+// is referenced by exactly one leaf so, unlike the kd-tree, traversal
+// doesn't need mailboxes.
+class BVH : public IAccelerator
+{
+protected:
+    using PrimitiveVector = std::vector<const Triangle*, AlignedAllocator<const Triangle*> >;
+
+    // 32 bytes, two nodes per cache line. Nodes are stored depth first so
+    // the left child of an inner node always directly follows its parent.
+    class Node
+    {
+    private:
+        enum Flags : uint32_t
+        {
+            XAXIS = 0x0,
+            YAXIS = 0x1,
+            ZAXIS = 0x2,
+            LEAF = 0x3,
+            MASK = 0x3
+        };
+
+    public:
+        void initInner(const AABBox& bounds, uint32_t rightChild, uint32_t axis);
+        void initLeaf(const AABBox& bounds, uint32_t firstPrimitive, uint32_t numPrimitives);
+        void relocate(uint32_t offset);
+
+        bool intersect(const glm::vec3& origin, const glm::vec3& invDir, float minT, float maxT) const;
+
+        AABBox bounds() const { return AABBox(mLL, mUR); }
+        bool isLeaf() const { return (mFlags & MASK) == LEAF; }
+        uint32_t splitAxis() const { return (mFlags & MASK); }
+        uint32_t rightChildIdx() const { return mOffset; }
+        uint32_t firstPrimitive() const { return mOffset; }
+        uint32_t primitiveCount() const { return mFlags >> 2; }
+
+    private:
+        glm::vec3   mLL;
+        uint32_t    mOffset;    // Right child of inner nodes, first primitive of leaves
+        glm::vec3   mUR;
+        uint32_t    mFlags;     // Split axis or LEAF, primitive count in the upper bits
+    };
+    using NodeBuffer = std::vector<Node, AlignedAllocator<Node> >;
+
+private:
+    struct BuildPrimitive
+    {
+        AABBox          bounds;
+        glm::vec3       centroid;
+        const Triangle* primitive;
+    };
+    using BuildPrimitiveVector = std::vector<BuildPrimitive>;
+
+    struct SplitCandidate
+    {
+        SplitCandidate();
+
+        float cost;
+        uint32_t axis;
+        uint32_t bin;
+    };
+
+    // State of one build task, see KdTree::BuildContext
+    struct BuildContext
+    {
+        explicit BuildContext();
+
+        uint32_t allocNode();
+        uint32_t append(BuildContext& other);
+
+        NodeBuffer  nodes;
+        uint32_t    maxDepth;
+        size_t      leafNodes;
+        uint32_t    maxPrimsPerNode;
+        double      sahCost;
+    };
+
+    using TraversalBuffer = std::vector<uint32_t, AlignedAllocator<uint32_t> >;
+
+    class BVHTraversalContext : public TraversalContext
+    {
+    public:
+        explicit BVHTraversalContext(uint32_t maxDepth)
+            : stack(maxDepth + 1) { }
+
+        TraversalBuffer stack;
+    };
+
+public:
+    explicit BVH();
+    ~BVH();
+
+    void build(uint32_t numThreads) override;
+
+    void addPrimitive(const Triangle* p) override;
+    size_t numberOfPrimitives() const override { return mPrimVector.size(); }
+    std::unique_ptr<TraversalContext> allocateTraversalContext() const override;
+
+protected:
+    bool traceClosest(Ray& ray, TraversalContext& ctx, Stats& threadStats) const override;
+    bool traceVisibility(Ray& ray, TraversalContext& ctx, Stats& threadStats) const override;
+
+private:
+    template <bool visibilityTest>
+    bool traverse(Ray& ray, TraversalBuffer& traversalStack, Stats& threadStats) const;
+
+    void build(uint32_t nodeIdx, BuildPrimitive* prims, uint32_t begin, uint32_t end,
+               uint32_t depth, BuildContext& ctx) const;
+    SplitCandidate findSplit(const BuildPrimitive* prims, uint32_t begin, uint32_t end,
+                             const AABBox& bounds, const AABBox& centroidBounds) const;
+    bool isParallelTask(uint32_t depth, uint32_t numPrimitives) const;
+
+protected:
+    NodeBuffer          mNodes;
+    uint32_t            mMaxDepth;
+    size_t              mLeafNodes;
+    uint32_t            mMaxPrimsPerNode;
+    uint32_t            mParallelDepth;
+    float               mSAHCost;
+    PrimitiveVector     mPrimVector;
+};
+
+
+inline void BVH::addPrimitive(const Triangle* p)
+{
+    mPrimVector.emplace_back(p);
+}
+
+inline uint32_t BVH::BuildContext::allocNode()
+{
+    nodes.emplace_back();
+    return (uint32_t)nodes.size() - 1;
+}
+
+inline void BVH::Node::initInner(const AABBox& bounds, uint32_t rightChild, uint32_t axis)
+{
+    TP_ASSERT(axis < LEAF);
+
+    mLL = bounds.ll();
+    mUR = bounds.ur();
+    mOffset = rightChild;
+    mFlags = axis;
+}
+
+inline void BVH::Node::initLeaf(const AABBox& bounds, uint32_t firstPrimitive, uint32_t numPrimitives)
+{
+    mLL = bounds.ll();
+    mUR = bounds.ur();
+    mOffset = firstPrimitive;
+    mFlags = (numPrimitives << 2) | LEAF;
+}
+
+inline void BVH::Node::relocate(uint32_t offset)
+{
+    if (!isLeaf())
+    {
+        mOffset += offset;
+    }
+}
+
+inline bool BVH::Node::intersect(const glm::vec3& origin, const glm::vec3& invDir, float minT, float maxT) const
+{
+    const glm::vec3 nearTs = (mLL - origin) * invDir;
+    const glm::vec3 farTs = (mUR - origin) * invDir;
+    const glm::vec3 minTs = glm::min(nearTs, farTs);
+    const glm::vec3 maxTs = glm::max(nearTs, farTs);
+
+    // A ray parallel to a slab and starting on one of its planes gives
+    // NaNs, keeping the running t first drops them so the slab is ignored.
+    for (int i = 0; i < 3; ++i)
+    {
+        minT = std::max(minT, minTs[i]);
+        maxT = std::min(maxT, maxTs[i]);
+    }
+
+    return minT <= maxT;
+}
+
+template <bool visibilityTest>
+bool BVH::traverse(Ray& ray, TraversalBuffer& traversalStack, Stats& threadStats) const
+{
+    const glm::vec3 invDir = 1.f / ray.dir();
+    const glm::vec3 rayOrigin = ray.origin();
+    bool hitPrimitive = false;
+    uint32_t nodeIdx = 0;
+    uint32_t traversalStackIdx = 0;
+
+    for (;;)
+    {
+        const Node& node = mNodes[nodeIdx];
+
+        threadStats.boxTests++;
+        if (node.intersect(rayOrigin, invDir, ray.minT(), ray.maxT()))
+        {
+            if (!node.isLeaf())
+            {
+                // Visit the child on the ray's side of the split first so
+                // the far one can be culled by the closest hit so far.
+                if (invDir[node.splitAxis()] < 0.f)
+                {
+                    traversalStack[traversalStackIdx++] = nodeIdx + 1;
+                    nodeIdx = node.rightChildIdx();
+                }
+                else
+                {
+                    traversalStack[traversalStackIdx++] = node.rightChildIdx();
+                    nodeIdx = nodeIdx + 1;
+                }
+                continue;
+            }
+
+            PrimitiveVector::const_iterator it = mPrimVector.begin() + node.firstPrimitive();
+            PrimitiveVector::const_iterator end = it + node.primitiveCount();
+            for (; it != end; ++it)
+            {
+                threadStats.primitiveTests++;
+                if ((*it)->intersect(ray))
+                {
+                    if (visibilityTest)
+                    {
+                        return true;
+                    }
+
+                    hitPrimitive = true;
+                }
+            }
+        }
+
+        // Pop node from traversal stack
+        if (traversalStackIdx == 0)
+        {
+            break;
+        }
+        nodeIdx = traversalStack[--traversalStackIdx];
+    }
+
+    return hitPrimitive;
+}
+
+#endif
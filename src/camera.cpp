@@ -4,6 +4,7 @@
 #include "camera.h"
 #include "sample.h"
 #include "ray.h"
+#include "frustum.h"
 
 Camera::Camera(const float fov, const glm::vec3& pos, const glm::vec3& lookAt, const glm::vec3& up, const unsigned width, const unsigned height)
     : mPos(pos)
@@ -39,3 +40,19 @@ void Camera::generateRay(const Sample& s, Ray* ray) const
     ray->setDir(glm::normalize(mU*alpha + mV*beta - mW));
 }
 
+
+Frustum Camera::generateFrustum(float x0, float y0, float x1, float y1) const
+{
+    // Ray directions are linear in the sample position before they're
+    // normalized, the corner rays span all the others
+    const Sample corners[4] = { Sample(x0, y0), Sample(x1, y0), Sample(x1, y1), Sample(x0, y1) };
+    glm::vec3 cornerDirs[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        Ray ray(Ray::PRIMARY);
+        generateRay(corners[i], &ray);
+        cornerDirs[i] = ray.dir();
+    }
+
+    return Frustum(mPos, cornerDirs);
+}
@@ -5,6 +5,7 @@
 
 struct Sample;
 class Ray;
+class Frustum;
 
 class Camera
 {
@@ -15,6 +16,10 @@ public:
     void setWidthHeight(unsigned width, unsigned height);
 
     void generateRay(const Sample& s, Ray* ray) const;
+
+    // Holds the primary ray of every sample in [x0, x1) x [y0, y1)
+    Frustum generateFrustum(float x0, float y0, float x1, float y1) const;
+
     unsigned width() const { return mWidth; }
     unsigned height() const { return mHeight; }
 
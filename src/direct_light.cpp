@@ -1,8 +1,35 @@
 #include "direct_light.h"
 #include "multi_sample_ray.h"
+#include "aabbox.h"
+#include "noise.h"
+#include "sampler_utils.h"
 
 DirectLight::DirectLight(const glm::vec3& dir, const glm::vec3& kd, float bias)
     : ILight(kd, 0.f, bias)
     , mDir(glm::normalize(dir))
+    , mShadowRays(1)
 {
 }
+
+glm::vec3 DirectLight::power(const AABBox& sceneBounds) const
+{
+    const float radius = glm::length(sceneBounds.ur() - sceneBounds.ll()) * .5f;
+    return mKd * (PI * radius * radius);
+}
+
+void DirectLight::emitPhoton(Noise& noise, const AABBox& sceneBounds, Ray& photonRay) const
+{
+    // Photons start on a disk facing the light that covers the whole scene
+    const glm::vec3 center = (sceneBounds.ll() + sceneBounds.ur()) * .5f;
+    const float radius = glm::length(sceneBounds.ur() - sceneBounds.ll()) * .5f;
+
+    const glm::vec3 up = fabsf(mDir.y) < .9f ? glm::vec3(0.f, 1.f, 0.f) : glm::vec3(1.f, 0.f, 0.f);
+    const glm::vec3 tangent = glm::normalize(glm::cross(up, mDir));
+    const glm::vec3 bitangent = glm::cross(mDir, tangent);
+
+    glm::vec2 sample(noise.generateNormalizedFloat(), noise.generateNormalizedFloat());
+    mapSquareToDisk(sample);
+
+    photonRay.setOrigin(center + (mDir + tangent * sample.x + bitangent * sample.y) * radius);
+    photonRay.setDir(-mDir);
+}
@@ -6,6 +6,7 @@
 
 #include "multi_sample_ray.h"
 #include "ilight.h"
+#include "scratch_arena.h"
 #include "point_sampler.h"
 
 
@@ -17,9 +18,11 @@ public:
     // ILight
     glm::vec3 directionToLight(const glm::vec3& p) const override;
     void attenuate(const glm::vec3& P, glm::vec3& result) const override;
-    ISampler* generateSamplerForPoint(const glm::vec3& samplePoint) const override;
+    ISampler* generateSamplerForPoint(const glm::vec3& samplePoint, ScratchArena& arena) const override;
     void setShadowRays(unsigned numRays) override;
     unsigned shadowRays() const override;
+    glm::vec3 power(const AABBox& sceneBounds) const override;
+    void emitPhoton(Noise& noise, const AABBox& sceneBounds, Ray& photonRay) const override;
     
 private:
     glm::vec3   mDir;
@@ -37,9 +40,9 @@ inline void DirectLight::attenuate(const glm::vec3& P, glm::vec3& result) const
     return;
 }
 
-inline ISampler* DirectLight::generateSamplerForPoint(const glm::vec3& samplePoint) const
+inline ISampler* DirectLight::generateSamplerForPoint(const glm::vec3& samplePoint, ScratchArena& arena) const
 {
-    return new PointSampler(directionToLight(samplePoint), std::numeric_limits<float>::max());
+    return arena.create<PointSampler>(directionToLight(samplePoint), std::numeric_limits<float>::max());
 }
 
 inline void DirectLight::setShadowRays(unsigned numRays)
@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <cmath>
+
+#include "emissive_lights.h"
+#include "triangle.h"
+#include "vertex.h"
+#include "material.h"
+#include "noise.h"
+#include "common.h"
+
+
+namespace
+{
+
+inline float area(const Triangle& triangle)
+{
+    const glm::vec3& a = triangle.vertexA().position;
+    return .5f * glm::length(glm::cross(triangle.vertexB().position - a,
+                                        triangle.vertexC().position - a));
+}
+
+} // anonymous namespace
+
+
+EmissiveLights::EmissiveLights()
+    : mTriangles()
+    , mCdf()
+    , mPdfs()
+    , mEmitters()
+{
+}
+
+void EmissiveLights::addTriangle(const Triangle* triangle)
+{
+    // Degenerate triangles can't be sampled by area
+    if (area(*triangle) > 0.f)
+    {
+        mTriangles.push_back(triangle);
+    }
+}
+
+void EmissiveLights::build()
+{
+    mCdf.resize(mTriangles.size());
+
+    float totalPower = 0.f;
+    for (size_t i = 0; i < mTriangles.size(); ++i)
+    {
+        totalPower += area(*mTriangles[i]) * luminance(mTriangles[i]->material().emissive());
+        mCdf[i] = totalPower;
+    }
+
+    if (totalPower <= 0.f)
+    {
+        mTriangles.clear();
+        mCdf.clear();
+        return;
+    }
+
+    mPdfs.resize(mTriangles.size());
+    mEmitters.reserve(mTriangles.size());
+    for (size_t i = 0; i < mTriangles.size(); ++i)
+    {
+        mCdf[i] /= totalPower;
+
+        // Picked with probability power / totalPower, then uniformly by area
+        const Triangle& triangle = *mTriangles[i];
+        mPdfs[i] = luminance(triangle.material().emissive()) / totalPower;
+        mEmitters[triangle.id()] = (uint32_t)i;
+    }
+}
+
+void EmissiveLights::sample(Noise& noise, Sample& sample) const
+{
+    TP_ASSERT(!mTriangles.empty());
+
+    const float u = noise.generateNormalizedFloat();
+    const size_t idx = std::min((size_t)(std::upper_bound(mCdf.begin(), mCdf.end(), u) - mCdf.begin()),
+                                mTriangles.size() - 1);
+    const Triangle& triangle = *mTriangles[idx];
+
+    // Uniform barycentrics
+    const float su = sqrtf(noise.generateNormalizedFloat());
+    const float b0 = 1.f - su;
+    const float b1 = noise.generateNormalizedFloat() * su;
+
+    sample.P = b0 * triangle.vertexA().position + b1 * triangle.vertexB().position +
+        (1.f - b0 - b1) * triangle.vertexC().position;
+    sample.Ke = triangle.material().emissive();
+    sample.triangle = &triangle;
+    sample.pdf = mPdfs[idx];
+}
+
+float EmissiveLights::pdf(const Triangle& triangle) const
+{
+    auto it = mEmitters.find(triangle.id());
+    return it != mEmitters.end() ? mPdfs[it->second] : 0.f;
+}
@@ -0,0 +1,54 @@
+#ifndef __EMISSIVE_LIGHTS_H__
+#define __EMISSIVE_LIGHTS_H__
+
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class Triangle;
+class Noise;
+
+
+// All triangles with an emissive material, sampled as area lights. A
+// triangle is picked with a probability that follows its power, and a
+// point on it uniformly by area.
+class EmissiveLights
+{
+public:
+    struct Sample
+    {
+        glm::vec3       P;
+        glm::vec3       Ke;
+        const Triangle* triangle;
+        float           pdf;    // Per unit area
+    };
+
+    explicit EmissiveLights();
+
+    void addTriangle(const Triangle* triangle);
+
+    // Call once all triangles are added and have their ids
+    void build();
+
+    bool empty() const { return mTriangles.empty(); }
+    size_t size() const { return mTriangles.size(); }
+
+    void sample(Noise& noise, Sample& sample) const;
+
+    // Density sample() picks points on the triangle with, per unit area.
+    // 0 for triangles that aren't emissive.
+    float pdf(const Triangle& triangle) const;
+
+private:
+    EmissiveLights(const EmissiveLights&) = delete;
+    EmissiveLights& operator=(const EmissiveLights&) = delete;
+
+    std::vector<const Triangle*>            mTriangles;
+    std::vector<float>                      mCdf;
+    std::vector<float>                      mPdfs;      // Parallel to mTriangles
+    std::unordered_map<size_t, uint32_t>    mEmitters;  // Triangle id to index in mTriangles
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include "env_sphere.h"
 #include "ray.h"
 #include "common.h"
+#include "thread_pool.h"
 
 
 EnvSphere::EnvSphere(const std::string& file)
@@ -36,18 +37,21 @@ EnvSphere::EnvSphere(const std::string& file)
         mWidth = FreeImage_GetWidth(fiImage);
 
         mImg = new glm::vec3[mWidth * mHeight];
-        for (unsigned y = 0; y < mHeight; ++y)
+        ThreadPool::instance().parallelFor(mHeight, [&](uint32_t begin, uint32_t end)
         {
-            for (unsigned x = 0; x < mWidth; ++x)
+            for (unsigned y = begin; y < end; ++y)
             {
-                RGBQUAD color;
-                FreeImage_GetPixelColor(fiImage, x, y, &color);
+                for (unsigned x = 0; x < mWidth; ++x)
+                {
+                    RGBQUAD color;
+                    FreeImage_GetPixelColor(fiImage, x, y, &color);
 
-                mImg[y * mWidth + x].r = color.rgbRed / 255.f;
-                mImg[y * mWidth + x].g = color.rgbGreen / 255.f;
-                mImg[y * mWidth + x].b = color.rgbBlue / 255.f;
+                    mImg[y * mWidth + x].r = color.rgbRed / 255.f;
+                    mImg[y * mWidth + x].g = color.rgbGreen / 255.f;
+                    mImg[y * mWidth + x].b = color.rgbBlue / 255.f;
+                }
             }
-        }
+        });
 
         FreeImage_Unload(fiImage);
     }
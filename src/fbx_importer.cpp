@@ -105,7 +105,8 @@ void loadMesh(fbxsdk::FbxNode& node, Scene& scene, FBXTPMaterialMap& materialsMa
         }
     }
 
-    Mesh& tpMesh = scene.allocateMesh(allAttributesByControlPoint ? mesh->GetControlPointsCount() : mesh->GetPolygonVertexCount());
+    Mesh& tpMesh = scene.allocateMesh(allAttributesByControlPoint ? mesh->GetControlPointsCount() : mesh->GetPolygonVertexCount(),
+                                      mesh->GetPolygonCount());
 
     const fbxsdk::FbxGeometryElement::EMappingMode fbxMaterialMapping =
         mesh->GetElementMaterial()->GetMappingMode();
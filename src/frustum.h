@@ -0,0 +1,61 @@
+#ifndef __FRUSTUM_H__
+#define __FRUSTUM_H__
+
+#include <glm/glm.hpp>
+
+#include "aabbox.h"
+
+
+// Every ray starting at a common origin whose direction lies in the cone
+// spanned by four corner directions, e.g. the primary rays of an image tile.
+// The cone is bounded by the four planes through the origin and two
+// neighbouring corners.
+class Frustum
+{
+public:
+    // The corners are given in order around the cone
+    explicit Frustum(const glm::vec3& origin, const glm::vec3 corners[4]);
+
+    const glm::vec3& origin() const { return mOrigin; }
+
+    // Conservative, false only if the box is fully outside one of the planes
+    bool intersects(const AABBox& box) const;
+
+private:
+    glm::vec3 mOrigin;
+    glm::vec3 mNormals[4]; // Pointing into the frustum
+};
+
+
+inline Frustum::Frustum(const glm::vec3& origin, const glm::vec3 corners[4])
+    : mOrigin(origin)
+{
+    const glm::vec3 center = corners[0] + corners[1] + corners[2] + corners[3];
+    for (int i = 0; i < 4; ++i)
+    {
+        mNormals[i] = glm::cross(corners[i], corners[(i + 1) % 4]);
+        if (glm::dot(mNormals[i], center) < 0.f)
+        {
+            mNormals[i] = -mNormals[i];
+        }
+    }
+}
+
+inline bool Frustum::intersects(const AABBox& box) const
+{
+    for (const glm::vec3& normal : mNormals)
+    {
+        // The box corner furthest along the normal
+        const glm::vec3 corner(normal.x >= 0.f ? box.ur().x : box.ll().x,
+                               normal.y >= 0.f ? box.ur().y : box.ll().y,
+                               normal.z >= 0.f ? box.ur().z : box.ll().z);
+        if (glm::dot(normal, corner - mOrigin) < 0.f)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif
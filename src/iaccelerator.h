@@ -0,0 +1,176 @@
+#ifndef __IACCELERATOR_H__
+#define __IACCELERATOR_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <glm/glm.hpp>
+
+#include "common.h"
+#include "ray_packet.h"
+
+class Triangle;
+class Ray;
+class Stats;
+class Frustum;
+
+class IAccelerator
+{
+public:
+    // Per thread scratch state of an accelerator's traversal, e.g. its
+    // stack. Every tracing thread allocates its own.
+    class TraversalContext
+    {
+    public:
+        virtual ~TraversalContext() { }
+    };
+
+    virtual ~IAccelerator() { }
+    virtual void addPrimitive(const Triangle* p) = 0;
+    virtual void build(uint32_t numThreads) = 0;
+    virtual size_t numberOfPrimitives() const = 0;
+    virtual std::unique_ptr<TraversalContext> allocateTraversalContext() const = 0;
+
+    // Finds the closest hit along the ray, or any hit at all for visibility
+    // tests, updating the ray with the hit if there is one.
+    template <bool visibilityTest>
+    bool trace(Ray& ray, TraversalContext& ctx, Stats& threadStats) const;
+
+    // Same for every ray of a packet, returns a mask with bit i set if ray
+    // i hit something.
+    template <bool visibilityTest>
+    uint32_t trace(RayPacket& packet, TraversalContext& ctx, Stats& threadStats) const;
+
+    // Where the traversal of the rays inside a frustum can start, found once
+    // per frustum by cullFrustum(). FRUSTUM_EMPTY if none of them can hit
+    // anything.
+    enum FrustumEntry : uint32_t
+    {
+        FRUSTUM_ROOT = 0,
+        FRUSTUM_EMPTY = 0xffffffff
+    };
+
+    // Accelerators without a frustum traversal start every ray at the root
+    virtual FrustumEntry cullFrustum(const Frustum& frustum, Stats& threadStats) const;
+
+    // Same as tracing the packet, every ray of it must lie inside the
+    // frustum entry was culled for.
+    template <bool visibilityTest>
+    uint32_t trace(RayPacket& packet, FrustumEntry entry, TraversalContext& ctx, Stats& threadStats) const;
+
+    // Where an occluder was hit, e.g. the leaf holding the hit point. Shadow
+    // rays toward the same light test what's there before they're traced,
+    // nearby rays are usually blocked by the same geometry. OCCLUDER_NONE
+    // if there's nothing to test.
+    enum OccluderHint : uint32_t
+    {
+        OCCLUDER_NONE = 0xffffffff
+    };
+
+    // Accelerators without hints never have anything to test
+    virtual OccluderHint occluderHint(const glm::vec3& P) const;
+
+    // Visibility test of the ray against only the primitives at the hint
+    virtual bool traceOccluderHint(Ray& ray, OccluderHint hint, TraversalContext& ctx, Stats& threadStats) const;
+
+protected:
+    IAccelerator() { }
+
+    virtual bool traceClosest(Ray& ray, TraversalContext& ctx, Stats& threadStats) const = 0;
+    virtual bool traceVisibility(Ray& ray, TraversalContext& ctx, Stats& threadStats) const = 0;
+
+    // Accelerators without a packet traversal trace the rays one by one
+    virtual uint32_t traceClosestPacket(RayPacket& packet, FrustumEntry entry,
+                                        TraversalContext& ctx, Stats& threadStats) const;
+    virtual uint32_t traceVisibilityPacket(RayPacket& packet, FrustumEntry entry,
+                                           TraversalContext& ctx, Stats& threadStats) const;
+
+    IAccelerator(const IAccelerator&) = delete;
+    IAccelerator& operator=(const IAccelerator&) = delete;
+};
+
+
+template <bool visibilityTest>
+inline bool IAccelerator::trace(Ray& ray, TraversalContext& ctx, Stats& threadStats) const
+{
+    if (visibilityTest)
+    {
+        return traceVisibility(ray, ctx, threadStats);
+    }
+    return traceClosest(ray, ctx, threadStats);
+}
+
+template <bool visibilityTest>
+inline uint32_t IAccelerator::trace(RayPacket& packet, TraversalContext& ctx, Stats& threadStats) const
+{
+    return trace<visibilityTest>(packet, FRUSTUM_ROOT, ctx, threadStats);
+}
+
+template <bool visibilityTest>
+inline uint32_t IAccelerator::trace(RayPacket& packet, FrustumEntry entry, TraversalContext& ctx, Stats& threadStats) const
+{
+    if (entry == FRUSTUM_EMPTY)
+    {
+        return 0;
+    }
+
+    if (visibilityTest)
+    {
+        return traceVisibilityPacket(packet, entry, ctx, threadStats);
+    }
+    return traceClosestPacket(packet, entry, ctx, threadStats);
+}
+
+inline IAccelerator::FrustumEntry IAccelerator::cullFrustum(const Frustum& frustum, Stats& threadStats) const
+{
+    TP_UNUSED(frustum);
+    TP_UNUSED(threadStats);
+    return FRUSTUM_ROOT;
+}
+
+inline IAccelerator::OccluderHint IAccelerator::occluderHint(const glm::vec3& P) const
+{
+    TP_UNUSED(P);
+    return OCCLUDER_NONE;
+}
+
+inline bool IAccelerator::traceOccluderHint(Ray& ray, OccluderHint hint, TraversalContext& ctx, Stats& threadStats) const
+{
+    TP_UNUSED(ray);
+    TP_UNUSED(hint);
+    TP_UNUSED(ctx);
+    TP_UNUSED(threadStats);
+    return false;
+}
+
+inline uint32_t IAccelerator::traceClosestPacket(RayPacket& packet, FrustumEntry entry,
+                                                 TraversalContext& ctx, Stats& threadStats) const
+{
+    TP_UNUSED(entry);
+    uint32_t hitMask = 0;
+    for (uint32_t i = 0; i < packet.size(); ++i)
+    {
+        if (traceClosest(packet[i], ctx, threadStats))
+        {
+            hitMask |= 1 << i;
+        }
+    }
+    return hitMask;
+}
+
+inline uint32_t IAccelerator::traceVisibilityPacket(RayPacket& packet, FrustumEntry entry,
+                                                    TraversalContext& ctx, Stats& threadStats) const
+{
+    TP_UNUSED(entry);
+    uint32_t hitMask = 0;
+    for (uint32_t i = 0; i < packet.size(); ++i)
+    {
+        if (traceVisibility(packet[i], ctx, threadStats))
+        {
+            hitMask |= 1 << i;
+        }
+    }
+    return hitMask;
+}
+
+#endif
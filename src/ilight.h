@@ -7,6 +7,9 @@
 class MultiSampleRay;
 class Noise;
 class ISampler;
+class Ray;
+class AABBox;
+class ScratchArena;
 
 class ILight
 {
@@ -14,12 +17,30 @@ public:
     virtual ~ILight() { }
     virtual glm::vec3 directionToLight(const glm::vec3& p) const = 0;
     virtual void attenuate(const glm::vec3& P, glm::vec3& result) const = 0;
-    virtual ISampler* generateSamplerForPoint(const glm::vec3& samplePoint) const = 0;
+    // The sampler lives in the arena, until it's reset
+    virtual ISampler* generateSamplerForPoint(const glm::vec3& samplePoint, ScratchArena& arena) const = 0;
     virtual void setShadowRays(unsigned numRays) = 0;
     virtual unsigned shadowRays() const = 0;
 
+    // Photon emission, see PhotonMap. Every photon emitted carries an
+    // equal share of the light's total power.
+    virtual glm::vec3 power(const AABBox& sceneBounds) const = 0;
+    virtual void emitPhoton(Noise& noise, const AABBox& sceneBounds, Ray& photonRay) const = 0;
+
+    // Scales the power of a photon arriving at P straight from the light
+    // the way the light's direct illumination falls off
+    virtual void attenuatePhoton(const glm::vec3& /*P*/, glm::vec3& /*power*/) const { }
+
+    // Lights with a position are clustered in the LightTree, the others
+    // are sampled at every hit. Attenuation is the constant, linear and
+    // quadratic terms the light falls off with.
+    virtual bool isLocal() const { return false; }
+    virtual glm::vec3 position() const { return glm::vec3(0.f); }
+    virtual glm::vec3 attenuation() const { return glm::vec3(1.f, 0.f, 0.f); }
+
     const glm::vec3& color() const { return mKd; }
     float bias() const { return mBias; }
+    float radius() const { return mRadius; }
     unsigned firstPassShadowRays() const;
     unsigned secondPassShadowRays() const;
 
@@ -44,7 +65,7 @@ inline unsigned ILight::firstPassShadowRays() const
 
 inline unsigned ILight::secondPassShadowRays() const
 {
-    if (shadowRays() < firstPassShadowRays())
+    if (shadowRays() > firstPassShadowRays())
     {
         return shadowRays() - firstPassShadowRays();
     }
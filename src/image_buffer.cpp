@@ -1,41 +1,120 @@
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <FreeImage.h>
 
 #include "image_buffer.h"
 #include "sample.h"
 #include "common.h"
+#include "thread_pool.h"
+
+// Dark pixels are compared against this luminance instead so their
+// relative error doesn't keep them sampling forever
+#define ADAPTIVE_MIN_LUMINANCE (0.01f)
 
 ImageBuffer::ImageBuffer(unsigned width, unsigned height)
     : mPixels(nullptr)
+    , mSampleCounts(nullptr)
+    , mLuminanceMeans(nullptr)
+    , mLuminanceM2s(nullptr)
     , mWidth(width)
     , mHeight(height)
 {
     mPixels = new float[mWidth*mHeight*4];
     memset(mPixels, 0, sizeof(float) * mWidth * mHeight * 4);
+
+    mSampleCounts = new unsigned[mWidth*mHeight];
+    memset(mSampleCounts, 0, sizeof(unsigned) * mWidth * mHeight);
+
+    mLuminanceMeans = new float[mWidth*mHeight];
+    memset(mLuminanceMeans, 0, sizeof(float) * mWidth * mHeight);
+
+    mLuminanceM2s = new float[mWidth*mHeight];
+    memset(mLuminanceM2s, 0, sizeof(float) * mWidth * mHeight);
 }
 
 ImageBuffer::~ImageBuffer()
 {
     delete [] mPixels;
     mPixels = nullptr;
+
+    delete [] mSampleCounts;
+    mSampleCounts = nullptr;
+
+    delete [] mLuminanceMeans;
+    mLuminanceMeans = nullptr;
+
+    delete [] mLuminanceM2s;
+    mLuminanceM2s = nullptr;
 }
 
-void ImageBuffer::commit(const Sample& sample, const glm::vec4& color)
+void ImageBuffer::commit(const Sample& sample, const glm::vec4* colors, unsigned numSamples)
 {
-    const unsigned int offset = 
-        (static_cast<int>(sample.y) * mWidth + static_cast<int>(sample.x)) * 4;
+    const unsigned int pixel = static_cast<int>(sample.y) * mWidth + static_cast<int>(sample.x);
+    const unsigned int offset = pixel * 4;
     
-    // Note: No thread locking needed here since each thread executes and commits
-    // a unique pixel as controlled via sampler in Sampler::buildSamplePacket
-    TP_ASSERT(color.a <= 1.f);
-    TP_ASSERT(mPixels[offset] == 0.f &&
-           mPixels[offset+2] == 0.f &&
-           mPixels[offset+3] == 0.f);
-    mPixels[offset+3] = color.a;
-    mPixels[offset+2] = linearToGamma(color.r);
-    mPixels[offset+1] = linearToGamma(color.g);
-    mPixels[offset] = linearToGamma(color.b);
+    // Note: No thread locking needed here since every pixel belongs to exactly
+    // one tile and each tile is rendered by a single task per pass
+    for (unsigned i = 0; i < numSamples; ++i)
+    {
+        const glm::vec4& color = colors[i];
+        TP_ASSERT(color.a <= 1.f);
+        mPixels[offset+3] += color.a;
+        mPixels[offset+2] += color.r;
+        mPixels[offset+1] += color.g;
+        mPixels[offset] += color.b;
+
+        const float sampleLuminance = luminance(glm::vec3(color));
+        const unsigned count = ++mSampleCounts[pixel];
+        const float delta = sampleLuminance - mLuminanceMeans[pixel];
+        mLuminanceMeans[pixel] += delta / count;
+        mLuminanceM2s[pixel] += delta * (sampleLuminance - mLuminanceMeans[pixel]);
+    }
+}
+
+bool ImageBuffer::needsSamples(unsigned x, unsigned y, unsigned minSamples, unsigned maxSamples, float threshold) const
+{
+    const unsigned pixel = y * mWidth + x;
+    const unsigned count = mSampleCounts[pixel];
+    if (count < std::max(minSamples, 2u))
+    {
+        return true;
+    }
+    else if (count >= maxSamples)
+    {
+        return false;
+    }
+
+    const float variance = mLuminanceM2s[pixel] / (count - 1);
+    const float standardError = sqrtf(variance / count);
+    return standardError > threshold * std::max(mLuminanceMeans[pixel], ADAPTIVE_MIN_LUMINANCE);
+}
+
+unsigned ImageBuffer::countPixelsNeedingSamples(unsigned minSamples, unsigned maxSamples, float threshold) const
+{
+    std::atomic_uint count(0);
+    ThreadPool::instance().parallelFor(mHeight, [&](uint32_t begin, uint32_t end) {
+        unsigned rangeCount = 0;
+        for (unsigned y = begin; y < end; ++y) {
+            for (unsigned x = 0; x < mWidth; ++x) {
+                rangeCount += needsSamples(x, y, minSamples, maxSamples, threshold) ? 1 : 0;
+            }
+        }
+        count.fetch_add(rangeCount, std::memory_order_relaxed);
+    });
+
+    return count.load();
+}
+
+double ImageBuffer::averageSamplesPerPixel() const
+{
+    uint64_t total = 0;
+    for (unsigned pixel = 0; pixel < mWidth * mHeight; ++pixel) {
+        total += mSampleCounts[pixel];
+    }
+
+    return (double)total / (double)(mWidth * mHeight);
 }
 
 void ImageBuffer::write(const std::string& filename) const
@@ -46,18 +125,23 @@ void ImageBuffer::write(const std::string& filename) const
     const int bytespp = FreeImage_GetLine(img) / mWidth;
     std::cout << "Saving image: " << filename << std::endl;
     
-    for (unsigned int y = 0; y < mHeight; ++y) {
-        BYTE* bits = FreeImage_GetScanLine(img, y);
-        for (unsigned int x = 0; x < mWidth; ++x) {
-            const unsigned int offset = (y * mWidth + x) * 4;
-            bits[FI_RGBA_ALPHA] = static_cast<unsigned char>(std::min(mPixels[offset+3], 1.0f) * 255);
-            bits[FI_RGBA_RED] = static_cast<unsigned char>(std::min(mPixels[offset+2], 1.0f) * 255);
-            bits[FI_RGBA_GREEN] = static_cast<unsigned char>(std::min(mPixels[offset+1], 1.0f) * 255);
-            bits[FI_RGBA_BLUE] = static_cast<unsigned char>(std::min(mPixels[offset], 1.0f) * 255);
-            
-            bits += bytespp;
+    // Scanlines are converted independently of each other
+    ThreadPool::instance().parallelFor(mHeight, [&](uint32_t begin, uint32_t end) {
+        for (unsigned int y = begin; y < end; ++y) {
+            BYTE* bits = FreeImage_GetScanLine(img, y);
+            for (unsigned int x = 0; x < mWidth; ++x) {
+                const unsigned int pixel = y * mWidth + x;
+                const unsigned int offset = pixel * 4;
+                const float scale = mSampleCounts[pixel] > 0 ? 1.f / mSampleCounts[pixel] : 0.f;
+                bits[FI_RGBA_ALPHA] = static_cast<unsigned char>(std::min(mPixels[offset+3] * scale, 1.0f) * 255);
+                bits[FI_RGBA_RED] = static_cast<unsigned char>(std::min(linearToGamma(mPixels[offset+2] * scale), 1.0f) * 255);
+                bits[FI_RGBA_GREEN] = static_cast<unsigned char>(std::min(linearToGamma(mPixels[offset+1] * scale), 1.0f) * 255);
+                bits[FI_RGBA_BLUE] = static_cast<unsigned char>(std::min(linearToGamma(mPixels[offset] * scale), 1.0f) * 255);
+                
+                bits += bytespp;
+            }
         }
-    }
+    });
 
     FreeImage_Save(FIF_PNG, img, filename.c_str(), 0);
     FreeImage_Unload(img);
@@ -12,11 +12,26 @@ public:
     explicit ImageBuffer(unsigned width, unsigned height);
     ~ImageBuffer();
 
-    void commit(const Sample& sample, const glm::vec4& color);
+    // Adds numSamples samples to the pixel the sample is in, pixels are
+    // written as the average of everything committed to them
+    void commit(const Sample& sample, const glm::vec4* colors, unsigned numSamples);
     void write(const std::string& filename) const;
 
+    // False once the pixel has maxSamples, or at least minSamples and the
+    // standard error of its mean luminance is below threshold relative to
+    // the mean
+    bool needsSamples(unsigned x, unsigned y, unsigned minSamples, unsigned maxSamples, float threshold) const;
+    unsigned countPixelsNeedingSamples(unsigned minSamples, unsigned maxSamples, float threshold) const;
+    double averageSamplesPerPixel() const;
+
 private:
     float* mPixels;
+    unsigned* mSampleCounts;
+
+    // Running mean and sum of squared deviations of every pixel's sample
+    // luminance (Welford)
+    float* mLuminanceMeans;
+    float* mLuminanceM2s;
     const unsigned mWidth, mHeight;
 };
 
@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+#include "irradiance_cache.h"
+#include "raytracer.h"
+#include "ray.h"
+#include "hit.h"
+#include "noise.h"
+#include "scene.h"
+#include "stats.h"
+#include "common.h"
+
+
+namespace
+{
+
+inline float diagonal(const AABBox& bounds)
+{
+    return glm::length(bounds.ur() - bounds.ll());
+}
+
+} // anonymous namespace
+
+
+IrradianceCache::IrradianceCache(const AABBox& sceneBounds, float maxError, unsigned numSamples)
+    // Padded so hits on the scene's boundary are safely inside
+    : mBounds(sceneBounds.ll() - diagonal(sceneBounds) * .01f,
+              sceneBounds.ur() + diagonal(sceneBounds) * .01f)
+    , mMaxError(maxError)
+    , mMinSpacing(IRRADIANCE_CACHE_MIN_SPACING * diagonal(sceneBounds))
+    , mMaxSpacing(IRRADIANCE_CACHE_MAX_SPACING * diagonal(sceneBounds))
+    // Ward's M x N strata with N = PI * M
+    , mThetaStrata(std::max(1u, (unsigned)roundf(sqrtf((float)numSamples / PI))))
+    , mPhiStrata(std::max(1u, (unsigned)roundf((float)numSamples / (float)mThetaStrata)))
+    , mLock()
+    , mRecords()
+    , mRoot()
+{
+}
+
+IrradianceCache::~IrradianceCache()
+{
+}
+
+glm::vec3 IrradianceCache::irradiance(const Raytracer& tracer, const Hit& hit, unsigned rayDepth,
+                                      Stats& threadStats)
+{
+    ++threadStats.irradianceLookups;
+
+    glm::vec3 E;
+    if (interpolate(hit.P, hit.N, E))
+    {
+        return E;
+    }
+
+    // Computed outside the lock, two threads may add records for nearby
+    // hits at the same time but that only costs a few rays
+    Record record;
+    sampleRecord(tracer, hit, rayDepth, record);
+    insert(record);
+
+    ++threadStats.irradianceRecords;
+    return record.E;
+}
+
+size_t IrradianceCache::numRecords() const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mLock);
+    return mRecords.size();
+}
+
+bool IrradianceCache::interpolate(const glm::vec3& P, const glm::vec3& N, glm::vec3& E) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mLock);
+
+    glm::vec3 sum(0.f);
+    float weightSum = 0.f;
+
+    // Records are stored in every node of their level they overlap, the
+    // nodes on the way down to P hold all that may be valid at P
+    const Node* node = &mRoot;
+    AABBox bounds = mBounds;
+    while (node != nullptr)
+    {
+        for (uint32_t recordIdx : node->records)
+        {
+            const Record& record = mRecords[recordIdx];
+            const float w = weight(record, P, N);
+            if (w <= 0.f)
+            {
+                continue;
+            }
+
+            const glm::vec3 rotation = glm::cross(record.N, N);
+            const glm::vec3 offset = P - record.P;
+            glm::vec3 extrapolated = record.E;
+            for (int c = 0; c < 3; ++c)
+            {
+                extrapolated[c] += glm::dot(rotation, record.rotGradient[c]) +
+                    glm::dot(offset, record.transGradient[c]);
+            }
+
+            sum += w * glm::max(extrapolated, glm::vec3(0.f));
+            weightSum += w;
+        }
+
+        const unsigned child = childIndex(bounds, P);
+        node = node->children[child].get();
+        bounds = childBounds(bounds, child);
+    }
+
+    if (weightSum <= 0.f)
+    {
+        return false;
+    }
+
+    E = sum / weightSum;
+    return true;
+}
+
+float IrradianceCache::weight(const Record& record, const glm::vec3& P, const glm::vec3& N) const
+{
+    const glm::vec3 offset = P - record.P;
+
+    // Points behind the record may see surfaces its hemisphere didn't
+    if (glm::dot(offset, (N + record.N) * .5f) < -.05f * record.R)
+    {
+        return 0.f;
+    }
+
+    const float error = glm::length(offset) / record.R +
+        sqrtf(std::max(0.f, 1.f - glm::dot(N, record.N)));
+    if (error >= mMaxError)
+    {
+        return 0.f;
+    }
+
+    // Falls off to 0 at the max error so records fade in and out smoothly
+    return 1.f / std::max(error, 1e-4f) - 1.f / mMaxError;
+}
+
+void IrradianceCache::sampleRecord(const Raytracer& tracer, const Hit& hit, unsigned rayDepth,
+                                   Record& record) const
+{
+    const Scene::RenderSettings& settings = Scene::instance().renderSettings();
+    Noise& noiseGen = tracer.getNoiseGenerator();
+
+    const unsigned M = mThetaStrata;
+    const unsigned N = mPhiStrata;
+    ScratchArena& scratch = tracer.scratch();
+    const ScratchArena::Marker scratchMarker = scratch.mark();
+    glm::vec3* radiance = scratch.allocateArray<glm::vec3>(M * N);
+    float* distance = scratch.allocateArray<float>(M * N);
+
+    Ray giRay(Ray::GI);
+    giRay.setDepth(rayDepth + 1);
+    giRay.setOrigin(hit.P);
+    giRay.bias(settings.bias);
+    giRay.shouldHitBackFaces(false);
+
+    // One cosine distributed sample per stratum, sin^2 theta is uniform
+    glm::vec3 sum(0.f);
+    float invDistanceSum = 0.f;
+    for (unsigned k = 0; k < N; ++k)
+    {
+        for (unsigned j = 0; j < M; ++j)
+        {
+            const float sin2Theta = ((float)j + noiseGen.generateNormalizedFloat()) / (float)M;
+            const float sinTheta = sqrtf(sin2Theta);
+            const float cosTheta = sqrtf(std::max(0.f, 1.f - sin2Theta));
+            const float phi = TWO_PI * ((float)k + noiseGen.generateNormalizedFloat()) / (float)N;
+
+            giRay.setDir(hit.toWorld(glm::vec3(cosf(phi) * sinTheta, sinf(phi) * sinTheta, cosTheta)));
+            giRay.setMaxDistance(std::numeric_limits<float>::max());
+            giRay.setSampleDensity((float)(M * N) * cosTheta * INV_PI);
+
+            glm::vec4 rayResult(0.f);
+            const bool didHit = tracer.traceAndShade(giRay, rayResult);
+
+            const unsigned idx = k * M + j;
+            radiance[idx] = glm::vec3(rayResult);
+            distance[idx] = didHit ? giRay.maxT() : std::numeric_limits<float>::infinity();
+            sum += radiance[idx];
+            invDistanceSum += 1.f / distance[idx];
+        }
+    }
+
+    record.P = hit.P;
+    record.N = hit.N;
+    record.E = sum * (PI / (float)(M * N));
+
+    // Ward and Heckbert's gradients, with the strata's centers standing in
+    // for the samples
+    for (int c = 0; c < 3; ++c)
+    {
+        record.rotGradient[c] = glm::vec3(0.f);
+        record.transGradient[c] = glm::vec3(0.f);
+    }
+
+    for (unsigned k = 0; k < N; ++k)
+    {
+        const float phi = TWO_PI * ((float)k + .5f) / (float)N;
+        const float phiMinus = TWO_PI * (float)k / (float)N;
+        const glm::vec3 u = hit.toWorld(glm::vec3(cosf(phi), sinf(phi), 0.f));
+        const glm::vec3 v = hit.toWorld(glm::vec3(-sinf(phi), cosf(phi), 0.f));
+        const glm::vec3 vMinus = hit.toWorld(glm::vec3(-sinf(phiMinus), cosf(phiMinus), 0.f));
+        const unsigned prevK = (k + N - 1) % N;
+
+        glm::vec3 rotSum(0.f);
+        glm::vec3 thetaSum(0.f);
+        glm::vec3 phiSum(0.f);
+        for (unsigned j = 0; j < M; ++j)
+        {
+            const unsigned idx = k * M + j;
+            const float sin2Center = ((float)j + .5f) / (float)M;
+            const float sinCenter = sqrtf(sin2Center);
+            const float cosCenter = sqrtf(1.f - sin2Center);
+            rotSum -= (sinCenter / cosCenter) * radiance[idx];
+
+            // Change across the boundary to the stratum below in theta...
+            const float sin2Minus = (float)j / (float)M;
+            if (j > 0)
+            {
+                const float minDistance = std::min(distance[idx], distance[idx - 1]);
+                thetaSum += (sqrtf(sin2Minus) * (1.f - sin2Minus) / minDistance) *
+                    (radiance[idx] - radiance[idx - 1]);
+            }
+
+            // ...and the previous one in phi
+            const float cosMinus = sqrtf(1.f - sin2Minus);
+            const float cosPlus = sqrtf(std::max(0.f, 1.f - ((float)j + 1.f) / (float)M));
+            const unsigned prevIdx = prevK * M + j;
+            const float minDistance = std::min(distance[idx], distance[prevIdx]);
+            phiSum += ((cosMinus - cosPlus) / (sinCenter * minDistance)) *
+                (radiance[idx] - radiance[prevIdx]);
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            record.rotGradient[c] += v * rotSum[c];
+            record.transGradient[c] += u * (TWO_PI / (float)N) * thetaSum[c] + vMinus * phiSum[c];
+        }
+    }
+
+    for (int c = 0; c < 3; ++c)
+    {
+        record.rotGradient[c] *= PI / (float)(M * N);
+    }
+
+    // Records near other surfaces, or where the irradiance changes quickly,
+    // only cover a small area
+    float R = invDistanceSum > 0.f ? (float)(M * N) / invDistanceSum : mMaxSpacing;
+    const glm::vec3 lumGradient = .2126f * record.transGradient[0] +
+        .7152f * record.transGradient[1] + .0722f * record.transGradient[2];
+    const float lumGradientLength = glm::length(lumGradient);
+    if (lumGradientLength > 0.f)
+    {
+        R = std::min(R, luminance(record.E) / lumGradientLength);
+    }
+    record.R = glm::clamp(R, mMinSpacing, mMaxSpacing);
+
+    scratch.release(scratchMarker);
+}
+
+void IrradianceCache::insert(const Record& record)
+{
+    // Past this distance the record's error exceeds the max on its own
+    const float radius = mMaxError * record.R;
+    const AABBox recordBounds(record.P - radius, record.P + radius);
+
+    std::unique_lock<std::shared_timed_mutex> lock(mLock);
+    mRecords.push_back(record);
+    insert(mRoot, mBounds, (uint32_t)(mRecords.size() - 1), recordBounds, 0);
+}
+
+void IrradianceCache::insert(Node& node, const AABBox& nodeBounds, uint32_t recordIdx,
+                             const AABBox& recordBounds, unsigned depth)
+{
+    // Stored in the nodes just smaller than the record's bounds
+    const glm::vec3 nodeDiagonal = nodeBounds.ur() - nodeBounds.ll();
+    const glm::vec3 recordDiagonal = recordBounds.ur() - recordBounds.ll();
+    if (depth == IRRADIANCE_CACHE_MAX_DEPTH ||
+        glm::dot(nodeDiagonal, nodeDiagonal) < glm::dot(recordDiagonal, recordDiagonal))
+    {
+        node.records.push_back(recordIdx);
+        return;
+    }
+
+    for (unsigned child = 0; child < 8; ++child)
+    {
+        const AABBox bounds = childBounds(nodeBounds, child);
+        if (glm::any(glm::greaterThan(bounds.ll(), recordBounds.ur())) ||
+            glm::any(glm::lessThan(bounds.ur(), recordBounds.ll())))
+        {
+            continue;
+        }
+
+        if (!node.children[child])
+        {
+            node.children[child] = std::make_unique<Node>();
+        }
+        insert(*node.children[child], bounds, recordIdx, recordBounds, depth + 1);
+    }
+}
+
+unsigned IrradianceCache::childIndex(const AABBox& bounds, const glm::vec3& P)
+{
+    const glm::vec3 center = (bounds.ll() + bounds.ur()) * .5f;
+    return (P.x >= center.x ? 1u : 0u) | (P.y >= center.y ? 2u : 0u) | (P.z >= center.z ? 4u : 0u);
+}
+
+AABBox IrradianceCache::childBounds(const AABBox& bounds, unsigned child)
+{
+    const glm::vec3 center = (bounds.ll() + bounds.ur()) * .5f;
+    glm::vec3 ll = bounds.ll();
+    glm::vec3 ur = center;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (child & (1u << axis))
+        {
+            ll[axis] = center[axis];
+            ur[axis] = bounds.ur()[axis];
+        }
+    }
+
+    return AABBox(ll, ur);
+}
@@ -0,0 +1,93 @@
+#ifndef __IRRADIANCE_CACHE_H__
+#define __IRRADIANCE_CACHE_H__
+
+#include <glm/glm.hpp>
+#include <deque>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+#include "aabbox.h"
+
+class Raytracer;
+class Hit;
+class Stats;
+
+// Records smaller or larger than these fractions of the scene's diagonal
+// are clamped
+#define IRRADIANCE_CACHE_MIN_SPACING (0.002f)
+#define IRRADIANCE_CACHE_MAX_SPACING (0.1f)
+
+// Deepest level of the octree holding the records
+#define IRRADIANCE_CACHE_MAX_DEPTH (16)
+
+
+// Ward style cache of the indirect irradiance at diffuse hits. A hit close
+// to existing records interpolates their irradiance, extrapolated with
+// their rotational and translational gradients, instead of sampling the
+// hemisphere again. Records are shared by all threads, lookups and
+// insertions may run concurrently.
+class IrradianceCache
+{
+public:
+    // Records are used as long as their error estimate stays below
+    // maxError, see weight()
+    explicit IrradianceCache(const AABBox& sceneBounds, float maxError, unsigned numSamples);
+    ~IrradianceCache();
+
+    // Irradiance at the hit, interpolated from the cached records or
+    // sampled and added to the cache if none of them is close enough
+    glm::vec3 irradiance(const Raytracer& tracer, const Hit& hit, unsigned rayDepth,
+                         Stats& threadStats);
+
+    size_t numRecords() const;
+
+    // Rays a record is sampled with, numSamples rounded to the strata
+    unsigned numSamples() const { return mThetaStrata * mPhiStrata; }
+
+private:
+    struct Record
+    {
+        glm::vec3   P;
+        glm::vec3   N;
+        glm::vec3   E;
+        float       R;                  // Harmonic mean distance to the surfaces seen
+        glm::vec3   rotGradient[3];     // Per color channel
+        glm::vec3   transGradient[3];
+    };
+
+    struct Node
+    {
+        std::vector<uint32_t>   records;
+        std::unique_ptr<Node>   children[8];
+    };
+
+    IrradianceCache(const IrradianceCache&) = delete;
+    IrradianceCache& operator=(const IrradianceCache&) = delete;
+
+    bool interpolate(const glm::vec3& P, const glm::vec3& N, glm::vec3& E) const;
+    void sampleRecord(const Raytracer& tracer, const Hit& hit, unsigned rayDepth,
+                      Record& record) const;
+    void insert(const Record& record);
+    void insert(Node& node, const AABBox& nodeBounds, uint32_t recordIdx,
+                const AABBox& recordBounds, unsigned depth);
+
+    // 0 if the record isn't valid at P
+    float weight(const Record& record, const glm::vec3& P, const glm::vec3& N) const;
+
+    static unsigned childIndex(const AABBox& bounds, const glm::vec3& P);
+    static AABBox childBounds(const AABBox& bounds, unsigned child);
+
+    const AABBox                    mBounds;
+    const float                     mMaxError;
+    const float                     mMinSpacing;
+    const float                     mMaxSpacing;
+    const unsigned                  mThetaStrata;
+    const unsigned                  mPhiStrata;
+
+    mutable std::shared_timed_mutex mLock;
+    std::deque<Record>              mRecords;   // Guarded by mLock
+    Node                            mRoot;      // Guarded by mLock
+};
+
+#endif
@@ -4,8 +4,7 @@
 #include <limits>
 #include <algorithm>
 #include <iterator>
-#include <unordered_map>
-#include <unordered_set>
+#include <cmath>
 
 #include "kdtree.h"
 #include "aabbox.h"
@@ -15,10 +14,22 @@
 #include "timer.h"
 #include "mailboxer.h"
 #include "stats.h"
+#include "frustum.h"
+#include "thread_pool.h"
 
 #define TRAVERSAL_COST (15.f)
 #define INTERSECTION_COST (20.f)
 
+// Number of candidate split planes per axis is SAH_BINS - 1 in binned mode
+#define SAH_BINS (32)
+
+// Nodes with fewer primitives than this are swept exactly in binned mode,
+// they have fewer distinct event planes than there are bins anyway.
+#define BINNED_SAH_MIN_PRIMITIVES (1024)
+
+// Nodes with fewer primitives than this are always built on the calling thread
+#define PARALLEL_BUILD_MIN_PRIMITIVES (4096)
+
 namespace
 {
 inline float calculateSplitCost(float probabilityHitLeft, float probabilityHitRight, uint32_t numPrimsLeft, uint32_t numPrimsRight)
@@ -31,6 +42,26 @@ inline float calculateSplitCost(float probabilityHitLeft, float probabilityHitRi
 
     return cost;
 }
+
+// Runs func(axis) for all three axes, as separate tasks if parallel is set
+template <typename Func>
+void forEachAxis(bool parallel, const Func& func)
+{
+    if (!parallel)
+    {
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            func(axis);
+        }
+        return;
+    }
+
+    TaskGroup tasks;
+    tasks.run([&func]() { func(1); });
+    tasks.run([&func]() { func(2); });
+    func(0);
+    tasks.wait();
+}
 } // anonymous namespace
 
 KdTree::KdTree()
@@ -40,6 +71,11 @@ KdTree::KdTree()
     , mLeafNodes(0)
     , mTotalNodes(0)
     , mMaxPrimsPerNode(0)
+    , mParallelDepth(0)
+    , mBuildMode(SAH_EXACT)
+    , mSAHCost(0.f)
+    , mCacheDirectory()
+    , mForceRebuild(false)
 {
 }
 
@@ -47,206 +83,517 @@ KdTree::~KdTree()
 {
 }
 
-KdTree::TraversalBuffer KdTree::allocateTraversalBuffer() const
+std::unique_ptr<IAccelerator::TraversalContext> KdTree::allocateTraversalContext() const
+{
+    return std::make_unique<KdTraversalContext>(mMaxDepth, mPrimVector.size());
+}
+
+bool KdTree::traceClosest(Ray& ray, TraversalContext& ctx, Stats& threadStats) const
+{
+    KdTraversalContext& kdCtx = static_cast<KdTraversalContext&>(ctx);
+    kdCtx.mailboxes.IncrementRayId();
+    return traverse<false>(ray, 0, kdCtx.stack, kdCtx.mailboxes, threadStats);
+}
+
+bool KdTree::traceVisibility(Ray& ray, TraversalContext& ctx, Stats& threadStats) const
+{
+    KdTraversalContext& kdCtx = static_cast<KdTraversalContext&>(ctx);
+    kdCtx.mailboxes.IncrementRayId();
+    return traverse<true>(ray, 0, kdCtx.stack, kdCtx.mailboxes, threadStats);
+}
+
+uint32_t KdTree::traceClosestPacket(RayPacket& packet, FrustumEntry entry,
+                                    TraversalContext& ctx, Stats& threadStats) const
+{
+    return tracePacket<false>(packet, entry, ctx, threadStats);
+}
+
+uint32_t KdTree::traceVisibilityPacket(RayPacket& packet, FrustumEntry entry,
+                                       TraversalContext& ctx, Stats& threadStats) const
+{
+    return tracePacket<true>(packet, entry, ctx, threadStats);
+}
+
+IAccelerator::FrustumEntry KdTree::cullFrustum(const Frustum& frustum, Stats& threadStats) const
+{
+    threadStats.boxTests++;
+    if (!frustum.intersects(mBounds))
+    {
+        return FRUSTUM_EMPTY;
+    }
+
+    // A ray only enters the cells the frustum overlaps, as long as that's
+    // only one child every ray goes the same way and skips the node.
+    AABBox bounds = mBounds;
+    uint32_t nodeIdx = 0;
+    while (!mNodes[nodeIdx].isLeaf())
+    {
+        const Node& node = mNodes[nodeIdx];
+        AABBox lowerBounds, upperBounds;
+        bounds.split(&lowerBounds, &upperBounds, node.splitAxis(), node.splitPlane());
+
+        threadStats.boxTests += 2;
+        const bool inLower = frustum.intersects(lowerBounds);
+        const bool inUpper = frustum.intersects(upperBounds);
+        if (inLower && inUpper)
+        {
+            break;
+        }
+        else if (inLower)
+        {
+            nodeIdx = nodeIdx + 1;
+            bounds = lowerBounds;
+        }
+        else if (inUpper)
+        {
+            nodeIdx = node.upperChildIdx();
+            bounds = upperBounds;
+        }
+        else
+        {
+            return FRUSTUM_EMPTY;
+        }
+    }
+
+    return static_cast<FrustumEntry>(nodeIdx);
+}
+
+IAccelerator::OccluderHint KdTree::occluderHint(const glm::vec3& P) const
+{
+    if (mNodes.empty())
+    {
+        return OCCLUDER_NONE;
+    }
+
+    uint32_t nodeIdx = 0;
+    while (!mNodes[nodeIdx].isLeaf())
+    {
+        const Node& node = mNodes[nodeIdx];
+        nodeIdx = P[node.splitAxis()] < node.splitPlane() ? nodeIdx + 1 : node.upperChildIdx();
+    }
+
+    return mNodes[nodeIdx].primitiveCount() > 0 ? static_cast<OccluderHint>(nodeIdx) : OCCLUDER_NONE;
+}
+
+bool KdTree::traceOccluderHint(Ray& ray, OccluderHint hint, TraversalContext& ctx, Stats& threadStats) const
+{
+    TP_UNUSED(ctx);
+    TP_ASSERT(hint < mNodes.size() && mNodes[hint].isLeaf());
+
+    // Not mailboxed, the rays are traced from the root afterwards if they
+    // miss and they'd only see these primitives again
+    const Node& leaf = mNodes[hint];
+    const uint32_t firstPrimitive = leaf.firstPrimitive();
+    const uint32_t numPrimitives = leaf.primitiveCount();
+    for (uint32_t group = 0; group < numPrimitives; group += KDTREE_TRIANGLE_GROUP_WIDTH)
+    {
+        const uint32_t numLanes = std::min(numPrimitives - group, (uint32_t)KDTREE_TRIANGLE_GROUP_WIDTH);
+        threadStats.primitiveTests += numLanes;
+
+        const LeafTriangleGroup& triangles =
+            mTriangleGroups[(firstPrimitive + group) / KDTREE_TRIANGLE_GROUP_WIDTH];
+        if (triangles.intersect(ray, (1u << numLanes) - 1))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool KdTree::isCoherent(const RayPacket& packet) const
+{
+    if (packet.size() == 0)
+    {
+        return false;
+    }
+
+    const glm::vec3& dir = packet[0].dir();
+    for (uint32_t i = 1; i < packet.size(); ++i)
+    {
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            if (std::signbit(packet[i].dir()[axis]) != std::signbit(dir[axis]))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void KdTree::setCache(const std::string& directory, bool forceRebuild)
 {
-    return TraversalBuffer(mMaxDepth);
+    mCacheDirectory = directory;
+    mForceRebuild = forceRebuild;
 }
 
-void KdTree::build()
+void KdTree::build(uint32_t numThreads)
 {
     HighResTimer t;
     t.start();
 
+    uint64_t hash = 0;
+    std::string cachedTree;
+    if (!mCacheDirectory.empty())
+    {
+        hash = geometryHash();
+        cachedTree = cacheFile(hash);
+
+        if (!mForceRebuild && loadCache(cachedTree, hash))
+        {
+            std::cout << "KdTree Cache Stats:" << std::endl;
+            std::cout << std::left << std::setw(30) << "  Loaded from:" << cachedTree << std::endl;
+            std::cout << std::left << std::setw(30) << "  Total nodes:" << mTotalNodes << std::endl;
+            std::cout << std::left << std::setw(30) << "  Total primitives:" << mPrimVector.size() << std::endl;
+            std::cout << std::left << std::setw(30) << "  Estimated SAH cost:" << mSAHCost << std::endl;
+            std::cout << std::left << std::setw(30) << "  Load time:" << t.elapsedToString(t.elapsed()) << std::endl;
+            return;
+        }
+    }
+
+    // Spawn subtree tasks until there are two per thread so the uneven
+    // sides of a split still keep every core busy.
+    mParallelDepth = 0;
+    while (numThreads > 1 && (1u << mParallelDepth) < numThreads * 2)
+    {
+        ++mParallelDepth;
+    }
+
     mBounds = mPrimVector[0]->bounds();
     for (const Triangle* tri : mPrimVector)
     {
         mBounds = mBounds.join(tri->bounds());
     }
     
-    SHAPlaneEventList initialEvents;
+    SHAPlaneEvents initialEvents;
     for (const Triangle* tri : mPrimVector)
     {
         generateEventsForPrimitive(tri, mBounds, initialEvents);
     }
-    initialEvents.sort();
 
-    uint32_t nextNodeIdx = 1; // idx 0 is root node
-    build(0, mBounds, initialEvents, (uint32_t)mPrimVector.size(), 0, &nextNodeIdx);
-    mNodes.shrink_to_fit();
+    // The binned sweep doesn't need the events in order
+    const uint32_t numPrimitives = (uint32_t)mPrimVector.size();
+    if (!isBinnedNode(numPrimitives))
+    {
+        forEachAxis(isParallelTask(0, numPrimitives), [&initialEvents](uint32_t axis)
+        {
+            std::sort(initialEvents.axis[axis].begin(), initialEvents.axis[axis].end());
+        });
+    }
+
+    BuildContext ctx;
+    build(0, mBounds, initialEvents, numPrimitives, 0, ctx);
+
+    mNodes.clear();
+    mNodes.reserve(ctx.nextNodeIdx);
+    mLeafPrimitives.clear();
+    relayout(ctx.nodes, ctx.leafPrimitives, 0);
+    BuildNodeBuffer().swap(ctx.nodes);
+    LeafPrimitiveBuffer().swap(ctx.leafPrimitives);
+    TP_ASSERT(mNodes.size() == ctx.nextNodeIdx);
+
+    mLeafPrimitives.shrink_to_fit();
+    packTriangles();
+
+    mMaxDepth = ctx.maxDepth;
+    mMinDepth = ctx.minDepth;
+    mLeafNodes = ctx.leafNodes;
+    mTotalNodes = mNodes.size();
+    mMaxPrimsPerNode = ctx.maxPrimsPerNode;
+    mSAHCost = (float)(ctx.sahCost / mBounds.surfaceArea());
+
+    if (!cachedTree.empty())
+    {
+        saveCache(cachedTree, hash);
+    }
 
     std::cout << "KdTree Build Stats:" << std::endl;
+    std::cout << std::left << std::setw(30) << "  Build mode:"
+        << (mBuildMode == SAH_EXACT ? "exact SAH" : "binned SAH") << std::endl;
     std::cout << std::left << std::setw(30) << "  Max depth:" << mMaxDepth << std::endl;
     std::cout << std::left << std::setw(30) << "  Min depth:" << mMinDepth << std::endl;
     std::cout << std::left << std::setw(30) << "  Max primitives per node:" << mMaxPrimsPerNode << std::endl;
     std::cout << std::left << std::setw(30) << "  Total nodes:" << mTotalNodes << std::endl;
     std::cout << std::left << std::setw(30) << "  Leaf nodes:" << mLeafNodes << std::endl;
     std::cout << std::left << std::setw(30) << "  Total primitives:" << mPrimVector.size() << std::endl;
+    std::cout << std::left << std::setw(30) << "  Leaf primitive references:" << mLeafPrimitives.size() << std::endl;
+    std::cout << std::left << std::setw(30) << "  Tree size (bytes):"
+        << mNodes.size() * sizeof(Node) + mLeafPrimitives.size() * sizeof(uint32_t) << std::endl;
+    std::cout << std::left << std::setw(30) << "  Packed triangles (bytes):"
+        << mTriangleGroups.size() * sizeof(LeafTriangleGroup) << std::endl;
+    std::cout << std::left << std::setw(30) << "  Node bytes per primitive:"
+        << (float)(mNodes.size() * sizeof(Node)) / (float)mPrimVector.size() << std::endl;
+    std::cout << std::left << std::setw(30) << "  Estimated SAH cost:" << mSAHCost << std::endl;
+    std::cout << std::left << std::setw(30) << "  Build threads:" << numThreads << std::endl;
     std::cout << std::left << std::setw(30) << "  Build time:" << t.elapsedToString(t.elapsed()) << std::endl;
 }
 
-void KdTree::build(uint32_t nodeIdx, const AABBox& bounds, SHAPlaneEventList& events, uint32_t numPrimitives, uint32_t depth, uint32_t* nextNodeIdx)
+void KdTree::relayout(const BuildNodeBuffer& buildNodes, const LeafPrimitiveBuffer& buildLeafPrimitives,
+                      uint32_t buildNodeIdx)
+{
+    const BuildNode& buildNode = buildNodes[buildNodeIdx];
+    const uint32_t nodeIdx = (uint32_t)mNodes.size();
+    mNodes.emplace_back();
+
+    if (buildNode.isLeaf())
+    {
+        // Leaf primitives are copied in traversal order too, padded with
+        // the leaf's first primitive so every leaf starts a triangle group.
+        const uint32_t firstPrimitive = (uint32_t)mLeafPrimitives.size();
+        const uint32_t numPrimitives = buildNode.primitiveCount();
+        const uint32_t* primitives = buildLeafPrimitives.data() + buildNode.firstPrimitive();
+        mLeafPrimitives.insert(mLeafPrimitives.end(), primitives, primitives + numPrimitives);
+        while (mLeafPrimitives.size() % KDTREE_TRIANGLE_GROUP_WIDTH != 0)
+        {
+            mLeafPrimitives.push_back(primitives[0]);
+        }
+
+        mNodes[nodeIdx].initLeaf(firstPrimitive, numPrimitives);
+        return;
+    }
+
+    relayout(buildNodes, buildLeafPrimitives, buildNode.lowerChildIdx());
+
+    const uint32_t upperChildIdx = (uint32_t)mNodes.size();
+    relayout(buildNodes, buildLeafPrimitives, buildNode.upperChildIdx());
+
+    mNodes[nodeIdx].initInner(upperChildIdx, buildNode.splitPlane(), buildNode.splitAxis());
+}
+
+void KdTree::packTriangles()
+{
+    TP_ASSERT(mLeafPrimitives.size() % KDTREE_TRIANGLE_GROUP_WIDTH == 0);
+
+    TriangleGroupBuffer groups(mLeafPrimitives.size() / KDTREE_TRIANGLE_GROUP_WIDTH);
+    for (size_t i = 0; i < mLeafPrimitives.size(); ++i)
+    {
+        groups[i / KDTREE_TRIANGLE_GROUP_WIDTH].set(i % KDTREE_TRIANGLE_GROUP_WIDTH,
+                                                    mPrimVector[mLeafPrimitives[i]]);
+    }
+
+    mTriangleGroups.swap(groups);
+}
+
+bool KdTree::isParallelTask(uint32_t depth, uint32_t numPrimitives) const
+{
+    return depth < mParallelDepth && numPrimitives >= PARALLEL_BUILD_MIN_PRIMITIVES;
+}
+
+bool KdTree::isBinnedNode(uint32_t numPrimitives) const
+{
+    return mBuildMode == SAH_BINNED && numPrimitives >= BINNED_SAH_MIN_PRIMITIVES;
+}
+
+void KdTree::build(uint32_t nodeIdx, const AABBox& bounds, SHAPlaneEvents& events, uint32_t numPrimitives, uint32_t depth, BuildContext& ctx) const
 {
     TP_ASSERT(events.size() <= numPrimitives * 2 * 3);
     TP_ASSERT(events.size() >= numPrimitives);
 
+    const bool parallel = isParallelTask(depth, numPrimitives);
     const float leafCost = INTERSECTION_COST * numPrimitives;
-    SHASplitPlane splitPlane = findSplitPlane(bounds, events, numPrimitives);
+    SHASplitPlane splitPlane;
+    if (numPrimitives > 1)
+    {
+        splitPlane = findSplitPlane(bounds, events, numPrimitives, parallel);
+    }
 
     // Base case
     if (leafCost < splitPlane.cost || numPrimitives <= 1)
     {
-        using PrimSet = std::unordered_set<const Triangle*>;
-        PrimSet uniquePrims;
+        BuildNode& node = ctx.nodes[nodeIdx];
+        node.initLeafNode((uint32_t)ctx.leafPrimitives.size(), numPrimitives);
 
-        Node& node = mNodes[nodeIdx];
-        node.initLeafNode(numPrimitives);
-        Node::PrimIterator curr = node.beginPrimitives();
-
-        for (SHAPlaneEvent event : events)
+        // Every primitive has exactly one START or PLANAR event per axis
+        for (const SHAPlaneEvent& event : events.axis[0])
         {
-            if (uniquePrims.insert(event.primitive).second)
+            if (event.type != END)
             {
-                TP_ASSERT(curr != node.endPrimitives());
-                *curr++ = event.primitive;
+                TP_ASSERT(mPrimVector[event.primitive->id()] == event.primitive);
+                ctx.leafPrimitives.push_back((uint32_t)event.primitive->id());
             }
         }
-        TP_ASSERT(curr == node.endPrimitives());
+        TP_ASSERT(ctx.leafPrimitives.size() == node.firstPrimitive() + numPrimitives);
 
-        mMaxDepth = std::max(depth, mMaxDepth);
-        mMinDepth = std::min(depth, mMinDepth);
-        mMaxPrimsPerNode = std::max(node.primitiveCount(), mMaxPrimsPerNode);
-        ++mLeafNodes;
+        ctx.maxDepth = std::max(depth, ctx.maxDepth);
+        ctx.minDepth = std::min(depth, ctx.minDepth);
+        ctx.maxPrimsPerNode = std::max(node.primitiveCount(), ctx.maxPrimsPerNode);
+        ctx.sahCost += leafCost * bounds.surfaceArea();
+        ++ctx.leafNodes;
     }
     else
     {
+        ctx.sahCost += TRAVERSAL_COST * bounds.surfaceArea();
+
         AABBox leftBounds, rightBounds;
         bounds.split(&leftBounds, &rightBounds, splitPlane.aaAxis, splitPlane.plane);
 
-        SHAPlaneEventList leftEvents, rightEvents;
-        split(leftEvents, rightEvents, leftBounds, rightBounds, splitPlane, events);
-        events.clear();
+        SHAPlaneEvents leftEvents, rightEvents;
+        split(leftEvents, rightEvents, leftBounds, rightBounds, splitPlane, events,
+              ctx.primSides, isBinnedNode(numPrimitives), parallel);
+        events.release();
+
+        uint32_t leftChildIdx;
+        uint32_t rightChildIdx;
+        if (parallel)
+        {
+            // Build the left subtree as a new task and the right one on
+            // this thread, each into its own node buffer. Appending them in
+            // order gives the same layout as the serial build. The right
+            // task borrows our classification flags since we're done with them.
+            BuildContext leftCtx;
+            BuildContext rightCtx;
+            rightCtx.primSides.swap(ctx.primSides);
+
+            TaskGroup tasks;
+            tasks.run([&]()
+            {
+                build(0, leftBounds, leftEvents,
+                      splitPlane.numPrimitivesLeft, depth + 1, leftCtx);
+            });
+
+            build(0, rightBounds, rightEvents,
+                  splitPlane.numPrimitivesRight, depth + 1, rightCtx);
+            tasks.wait();
+            rightCtx.primSides.swap(ctx.primSides);
 
-        uint32_t leftChildIdx = allocNode(nextNodeIdx);
-        build(leftChildIdx, leftBounds, leftEvents,
-              splitPlane.numPrimitivesLeft, depth + 1, nextNodeIdx);
+            leftChildIdx = ctx.append(leftCtx);
+            rightChildIdx = ctx.append(rightCtx);
+        }
+        else
+        {
+            leftChildIdx = ctx.allocNode();
+            build(leftChildIdx, leftBounds, leftEvents,
+                  splitPlane.numPrimitivesLeft, depth + 1, ctx);
 
-        uint32_t rightChildIdx = allocNode(nextNodeIdx);
-        build(rightChildIdx, rightBounds, rightEvents,
-              splitPlane.numPrimitivesRight, depth + 1, nextNodeIdx);
+            rightChildIdx = ctx.allocNode();
+            build(rightChildIdx, rightBounds, rightEvents,
+                  splitPlane.numPrimitivesRight, depth + 1, ctx);
+        }
 
-        Node& node = mNodes[nodeIdx];
+        BuildNode& node = ctx.nodes[nodeIdx];
         node.split(leftChildIdx, rightChildIdx, splitPlane.plane, splitPlane.aaAxis);
     }
 }
 
-void KdTree::split(SHAPlaneEventList& outLeftEvents, SHAPlaneEventList& outRightEvents,
+void KdTree::split(SHAPlaneEvents& outLeftEvents, SHAPlaneEvents& outRightEvents,
                    const AABBox& leftBounds, const AABBox& rightBounds,
-                   const SHASplitPlane& plane, SHAPlaneEventList& events)
+                   const SHASplitPlane& plane, const SHAPlaneEvents& events,
+                   PrimSideBuffer& primSides, bool binned, bool parallel) const
 {
-    enum PrimSide
+    const SHAPlaneEventList& splitAxisEvents = events.axis[plane.aaAxis];
+    if (primSides.empty())
     {
-        PS_LEFT = 0,
-        PS_RIGHT,
-        PS_BOTH
-    };
-    
-    typedef std::unordered_map<const Triangle*, PrimSide> PrimSideMap;
-    
-    /* Classify the primitives based on the split plane and the split events */
-    PrimSideMap primClassification;
-    for (SHAPlaneEventList::const_iterator it = events.begin(); it != events.end(); ++it)
+        primSides.resize(mPrimVector.size(), PS_BOTH);
+    }
+
+    /* Classify the primitives based on the events along the split axis */
+    for (const SHAPlaneEvent& event : splitAxisEvents)
     {
-        if (it->type == END && it->axis == plane.aaAxis && it->plane <= plane.plane)
+        primSides[event.primitive->id()] = PS_BOTH;
+    }
+
+    for (const SHAPlaneEvent& event : splitAxisEvents)
+    {
+        uint8_t& side = primSides[event.primitive->id()];
+        if (event.type == END && event.plane <= plane.plane)
         {
-            primClassification[it->primitive] = PS_LEFT;
+            side = PS_LEFT;
         }
-        else if (it->type == START && it->axis == plane.aaAxis && it->plane >= plane.plane)
+        else if (event.type == START && event.plane >= plane.plane)
         {
-            primClassification[it->primitive] = PS_RIGHT;
+            side = PS_RIGHT;
         }
-        else if (it->type == PLANAR && it->axis == plane.aaAxis)
+        else if (event.type == PLANAR)
         {
-            if (it->plane < plane.plane ||
-                (it->plane == plane.plane && plane.side == SHASplitPlane::LEFT))
+            if (event.plane < plane.plane ||
+                (event.plane == plane.plane && plane.side == SHASplitPlane::LEFT))
             {
-                primClassification[it->primitive] = PS_LEFT;
+                side = PS_LEFT;
             }
-            else if (it->plane > plane.plane ||
-                     (it->plane == plane.plane && plane.side == SHASplitPlane::RIGHT))
+            else
             {
-                primClassification[it->primitive] = PS_RIGHT;
+                side = PS_RIGHT;
             }
         }
-        else if (primClassification.find(it->primitive) == primClassification.end())
-        {
-            primClassification[it->primitive] = PS_BOTH;
-        }
     }
-    
-    /* Generate SHAPlaneEvents for left and right nodes */
-    std::unordered_set<const Triangle*> spanningPrimitives;
-    for (const SHAPlaneEvent& event : events)
-    {
-        PrimSideMap::const_iterator primIt = primClassification.find(event.primitive);
-        TP_ASSERT(primIt != primClassification.end());
 
-        switch (primIt->second)
+    /* Clip the primitives straddling the split plane to both child voxels */
+    SHAPlaneEvents newLeftEvents;
+    SHAPlaneEvents newRightEvents;
+    for (const SHAPlaneEvent& event : splitAxisEvents)
+    {
+        if (event.type == START && primSides[event.primitive->id()] == PS_BOTH)
         {
-        case PS_LEFT:
-            outLeftEvents.emplace_back(event);
-            break;
-            
-        case PS_RIGHT:
-            outRightEvents.emplace_back(event);
-            break;
-            
-        case PS_BOTH:
-            spanningPrimitives.insert(event.primitive);
-            break;
-
-        default:
-            break;
+            generateEventsForPrimitive(event.primitive, leftBounds, newLeftEvents);
+            generateEventsForPrimitive(event.primitive, rightBounds, newRightEvents);
         }
     }
 
-    SHAPlaneEventList newLeftEvents;
-    SHAPlaneEventList newRightEvents;
-    for (const Triangle* tri : spanningPrimitives)
+    /* Distribute the events of the remaining primitives, this keeps them
+     * sorted so only the new events need sorting before being merged in.
+     * The binned build doesn't keep its events sorted. */
+    forEachAxis(parallel, [&](uint32_t axis)
     {
-        generateEventsForPrimitive(tri, leftBounds, newLeftEvents);
-        generateEventsForPrimitive(tri, rightBounds, newRightEvents);
-    }
-    newLeftEvents.sort();
-    newRightEvents.sort();
-
-    // Merge in left events
-    SHAPlaneEventList::iterator outEventsIt = outLeftEvents.begin();
-    SHAPlaneEventList::iterator newEventsIt = newLeftEvents.begin();
-    for (; newEventsIt != newLeftEvents.end(); ++newEventsIt)
-    {
-        while (outEventsIt != outLeftEvents.end() && *outEventsIt < *newEventsIt)
+        SHAPlaneEventList leftOnly;
+        SHAPlaneEventList rightOnly;
+        for (const SHAPlaneEvent& event : events.axis[axis])
         {
-            ++outEventsIt;
+            switch (primSides[event.primitive->id()])
+            {
+            case PS_LEFT:
+                leftOnly.emplace_back(event);
+                break;
+
+            case PS_RIGHT:
+                rightOnly.emplace_back(event);
+                break;
+
+            default:
+                break;
+            }
         }
-        
-        outLeftEvents.insert(outEventsIt, *newEventsIt);
-    }
 
-    // Merge in right events
-    outEventsIt = outRightEvents.begin();
-    newEventsIt = newRightEvents.begin();
-    for (; newEventsIt != newRightEvents.end(); ++newEventsIt)
-    {
-        while (outEventsIt != outRightEvents.end() && *outEventsIt < *newEventsIt)
+        SHAPlaneEventList& newLeft = newLeftEvents.axis[axis];
+        SHAPlaneEventList& newRight = newRightEvents.axis[axis];
+        if (binned)
         {
-            ++outEventsIt;
+            // Children too small to be binned are swept exactly and need
+            // their events sorted from here on.
+            leftOnly.insert(leftOnly.end(), newLeft.begin(), newLeft.end());
+            if (!isBinnedNode(plane.numPrimitivesLeft))
+            {
+                std::sort(leftOnly.begin(), leftOnly.end());
+            }
+
+            rightOnly.insert(rightOnly.end(), newRight.begin(), newRight.end());
+            if (!isBinnedNode(plane.numPrimitivesRight))
+            {
+                std::sort(rightOnly.begin(), rightOnly.end());
+            }
+
+            outLeftEvents.axis[axis].swap(leftOnly);
+            outRightEvents.axis[axis].swap(rightOnly);
+            return;
         }
-        
-        outRightEvents.insert(outEventsIt, *newEventsIt);
-    }
+
+        std::sort(newLeft.begin(), newLeft.end());
+        std::sort(newRight.begin(), newRight.end());
+
+        SHAPlaneEventList& outLeft = outLeftEvents.axis[axis];
+        outLeft.reserve(leftOnly.size() + newLeft.size());
+        std::merge(newLeft.begin(), newLeft.end(), leftOnly.begin(), leftOnly.end(),
+                   std::back_inserter(outLeft));
+
+        SHAPlaneEventList& outRight = outRightEvents.axis[axis];
+        outRight.reserve(rightOnly.size() + newRight.size());
+        std::merge(newRight.begin(), newRight.end(), rightOnly.begin(), rightOnly.end(),
+                   std::back_inserter(outRight));
+    });
 }
 
-void KdTree::generateEventsForPrimitive(const Triangle* primitive, const AABBox& voxel, SHAPlaneEventList& events) const
+void KdTree::generateEventsForPrimitive(const Triangle* primitive, const AABBox& voxel, SHAPlaneEvents& events) const
 {
     const AABBox primBox = primitive->bounds();
     const AABBox clippedBox = voxel.intersection(primBox);
@@ -259,7 +606,7 @@ void KdTree::generateEventsForPrimitive(const Triangle* primitive, const AABBox&
     {
         if (relEq(clippedBoxWHD[axis], 0.f, 1.0e-10f))
         {
-            events.emplace_back(primitive, clippedBox.ll()[axis], axis, PLANAR);
+            events.axis[axis].emplace_back(primitive, clippedBox.ll()[axis], PLANAR);
         }
         else
         {
@@ -271,85 +618,181 @@ void KdTree::generateEventsForPrimitive(const Triangle* primitive, const AABBox&
 
             // Check for point/line intersection with voxel
             TP_ASSERT(!relEq(area,  0.f, 1.0e-15f));
-            events.emplace_back(primitive, clippedBox.ll()[axis], axis, START);
-            events.emplace_back(primitive, clippedBox.ur()[axis], axis, END);
+            events.axis[axis].emplace_back(primitive, clippedBox.ll()[axis], START);
+            events.axis[axis].emplace_back(primitive, clippedBox.ur()[axis], END);
         }
     }
 }
 
+KdTree::SHASplitPlane KdTree::findSplitPlane(
+    const AABBox& voxel, const SHAPlaneEvents& events,
+    uint32_t totalNumPrimitives, bool parallel) const
+{
+    SHASplitPlane axisSplitPlanes[3];
+    forEachAxis(parallel, [&](uint32_t axis)
+    {
+        axisSplitPlanes[axis] = findSplitPlane(voxel, events.axis[axis], totalNumPrimitives, axis);
+    });
+
+    SHASplitPlane bestSplitPlane;
+    for (const SHASplitPlane& splitPlane : axisSplitPlanes)
+    {
+        if (splitPlane.isCheaperThan(bestSplitPlane))
+        {
+            bestSplitPlane = splitPlane;
+        }
+    }
+
+    return bestSplitPlane;
+}
+
 KdTree::SHASplitPlane KdTree::findSplitPlane(
     const AABBox& voxel, const SHAPlaneEventList& events,
-    uint32_t totalNumPrimitives) const
+    uint32_t totalNumPrimitives, uint32_t aaAxis) const
 {
+    if (isBinnedNode(totalNumPrimitives))
+    {
+        return findBinnedSplitPlane(voxel, events, totalNumPrimitives, aaAxis);
+    }
+
     SHASplitPlane bestSplitPlane;
-    uint32_t numLeft[3] = {0, 0, 0};
-    uint32_t numPlanar[3] = {0, 0, 0};
-    uint32_t numRight[3] = {totalNumPrimitives, totalNumPrimitives, totalNumPrimitives};
+    uint32_t numLeft = 0;
+    uint32_t numRight = totalNumPrimitives;
 
-#if DEBUG
-    uint32_t lowestCounts[3] = {0, 0, 0};
-#endif
-    
     SHAPlaneEventList::const_iterator it = events.begin();
     while (it != events.end())
     {
         float plane = it->plane;
-        uint32_t aaAxis = it->axis;
         uint32_t startingAtPlane = 0;
         uint32_t planar = 0;
         uint32_t endingAtPlane = 0;
-        
-        while (it != events.end() && it->axis == aaAxis && it->plane == plane && it->type == END)
+
+        while (it != events.end() && it->plane == plane && it->type == END)
         {
             ++endingAtPlane;
             ++it;
         }
-        
-        while (it != events.end() && it->axis == aaAxis && it->plane == plane && it->type == PLANAR)
+
+        while (it != events.end() && it->plane == plane && it->type == PLANAR)
         {
             ++planar;
             ++it;
         }
-        
-        while (it != events.end() && it->axis == aaAxis && it->plane == plane && it->type == START)
+
+        while (it != events.end() && it->plane == plane && it->type == START)
         {
             ++startingAtPlane;
             ++it;
         }
-        
-        numPlanar[aaAxis] = planar;
-        numRight[aaAxis] -= planar;
-        numRight[aaAxis] -= endingAtPlane;
-        
-        float cost;
-        SHASplitPlane::Side side;
-        SHACost(&cost, &side, plane, aaAxis, voxel, numLeft[aaAxis], numRight[aaAxis], numPlanar[aaAxis]);
-        
-        if (cost < bestSplitPlane.cost)
+
+        numRight -= planar;
+        numRight -= endingAtPlane;
+
+        SHASplitPlane candidate;
+        SHACost(&candidate.cost, &candidate.side, plane, aaAxis, voxel, numLeft, numRight, planar);
+        candidate.plane = plane;
+        candidate.aaAxis = aaAxis;
+
+        if (candidate.isCheaperThan(bestSplitPlane))
         {
-            bestSplitPlane.plane = plane;
-            bestSplitPlane.aaAxis = aaAxis;
-            bestSplitPlane.side = side;
-            bestSplitPlane.numPrimitivesRight = numRight[aaAxis] +
-                (side == SHASplitPlane::RIGHT ? numPlanar[aaAxis] : 0);
-            bestSplitPlane.numPrimitivesLeft = numLeft[aaAxis] +
-                (side == SHASplitPlane::LEFT ? numPlanar[aaAxis] : 0);
-            bestSplitPlane.cost = cost;
-
-#if DEBUG
-            lowestCounts[0] = numLeft[aaAxis];
-            lowestCounts[1] = numRight[aaAxis];
-            lowestCounts[2] = numPlanar[aaAxis];
-#endif
+            candidate.numPrimitivesRight = numRight +
+                (candidate.side == SHASplitPlane::RIGHT ? planar : 0);
+            candidate.numPrimitivesLeft = numLeft +
+                (candidate.side == SHASplitPlane::LEFT ? planar : 0);
+            bestSplitPlane = candidate;
         }
-        
-        numLeft[aaAxis] += startingAtPlane;
-        numLeft[aaAxis] += planar;
+
+        numLeft += startingAtPlane;
+        numLeft += planar;
     }
     
     return bestSplitPlane;
 }
 
+KdTree::SHASplitPlane KdTree::findBinnedSplitPlane(
+    const AABBox& voxel, const SHAPlaneEventList& events,
+    uint32_t totalNumPrimitives, uint32_t aaAxis) const
+{
+    SHASplitPlane bestSplitPlane;
+
+    const float voxelMin = voxel.ll()[aaAxis];
+    const float binWidth = (voxel.ur()[aaAxis] - voxelMin) / (float)SAH_BINS;
+    if (!(binWidth > 0.f))
+    {
+        return bestSplitPlane;
+    }
+
+    // Lower plane of each bin, the candidate split planes. Bin 0 has no
+    // lower plane since the voxel's own side is never a candidate.
+    float binPlanes[SAH_BINS];
+    for (uint32_t i = 1; i < SAH_BINS; ++i)
+    {
+        binPlanes[i] = voxelMin + binWidth * (float)i;
+    }
+
+    /* Bin the events so the counts on either side of every bin plane use the
+     * same comparisons as split(), otherwise the child primitive counts
+     * wouldn't match the primitives the children actually get. */
+    uint32_t starting[SAH_BINS] = {0};  // START events in the bin
+    uint32_t ending[SAH_BINS] = {0};    // END events above the bin's plane
+    uint32_t planar[SAH_BINS] = {0};    // PLANAR events above the bin's plane
+    uint32_t onPlane[SAH_BINS] = {0};   // PLANAR events on the bin's plane
+    for (const SHAPlaneEvent& event : events)
+    {
+        int32_t bin = std::min(std::max((int32_t)((event.plane - voxelMin) / binWidth), 0),
+                               (int32_t)SAH_BINS - 1);
+        while (bin > 0 && event.plane < binPlanes[bin])
+        {
+            --bin;
+        }
+        while (bin < (int32_t)SAH_BINS - 1 && event.plane >= binPlanes[bin + 1])
+        {
+            ++bin;
+        }
+
+        const bool isOnPlane = bin > 0 && event.plane == binPlanes[bin];
+        switch (event.type)
+        {
+        case START:
+            ++starting[bin];
+            break;
+
+        case END:
+            ++ending[isOnPlane ? bin - 1 : bin];
+            break;
+
+        case PLANAR:
+            ++(isOnPlane ? onPlane[bin] : planar[bin]);
+            break;
+        }
+    }
+
+    uint32_t numLeft = 0;
+    uint32_t numRight = totalNumPrimitives - onPlane[0];
+    for (uint32_t i = 1; i < SAH_BINS; ++i)
+    {
+        numLeft += starting[i - 1] + planar[i - 1] + onPlane[i - 1];
+        numRight -= ending[i - 1] + planar[i - 1] + onPlane[i];
+
+        SHASplitPlane candidate;
+        SHACost(&candidate.cost, &candidate.side, binPlanes[i], aaAxis, voxel,
+                numLeft, numRight, onPlane[i]);
+        candidate.plane = binPlanes[i];
+        candidate.aaAxis = aaAxis;
+
+        if (candidate.isCheaperThan(bestSplitPlane))
+        {
+            candidate.numPrimitivesRight = numRight +
+                (candidate.side == SHASplitPlane::RIGHT ? onPlane[i] : 0);
+            candidate.numPrimitivesLeft = numLeft +
+                (candidate.side == SHASplitPlane::LEFT ? onPlane[i] : 0);
+            bestSplitPlane = candidate;
+        }
+    }
+
+    return bestSplitPlane;
+}
+
 void KdTree::SHACost(float* outCost, SHASplitPlane::Side* outSide, float plane, uint32_t aaAxis, const AABBox& voxel, uint32_t numLeftPrims, uint32_t numRightPrims, uint32_t numPlanarPrims) const
 {
     *outCost = std::numeric_limits<float>::max();
@@ -389,33 +832,67 @@ void KdTree::SHACost(float* outCost, SHASplitPlane::Side* outSide, float plane,
 }
 
 
-KdTree::Node::Node()
+KdTree::BuildNode::BuildNode()
     : mFlags(LEAF)
-    , mPrimitives(nullptr)
 {
+    mPlanePosition = 0.f;
+    mLowerChild = 0;
 }
 
-KdTree::Node::Node(Node&& rhs)
+KdTree::Node::Node()
     : mFlags(LEAF)
-    , mPrimitives(nullptr)
 {
-    std::swap(mUpperChild, rhs.mUpperChild);
-    std::swap(mPrimitives, rhs.mPrimitives);
+    mFirstPrimitive = 0;
+}
+
+
+KdTree::BuildContext::BuildContext()
+    : nodes(2)
+    , nextNodeIdx(1) // idx 0 is root node
+    , leafPrimitives()
+    , primSides()
+    , maxDepth(0)
+    , minDepth(std::numeric_limits<uint32_t>::max())
+    , leafNodes(0)
+    , maxPrimsPerNode(0)
+    , sahCost(0.0)
+{
 }
 
-KdTree::Node::~Node()
+uint32_t KdTree::BuildContext::append(BuildContext& other)
 {
-    if (isLeaf())
+    const uint32_t offset = nextNodeIdx;
+    nextNodeIdx += other.nextNodeIdx;
+
+    size_t newSize = nodes.size();
+    while (newSize < nextNodeIdx)
     {
-        delete [] mPrimitives;
+        newSize <<= 1;
     }
+    nodes.resize(newSize);
+
+    const uint32_t primitiveOffset = (uint32_t)leafPrimitives.size();
+    leafPrimitives.insert(leafPrimitives.end(), other.leafPrimitives.begin(), other.leafPrimitives.end());
+
+    for (uint32_t i = 0; i < other.nextNodeIdx; ++i)
+    {
+        nodes[offset + i] = other.nodes[i];
+        nodes[offset + i].relocate(offset, primitiveOffset);
+    }
+
+    maxDepth = std::max(other.maxDepth, maxDepth);
+    minDepth = std::min(other.minDepth, minDepth);
+    leafNodes += other.leafNodes;
+    maxPrimsPerNode = std::max(other.maxPrimsPerNode, maxPrimsPerNode);
+    sahCost += other.sahCost;
+
+    return offset;
 }
 
 
-KdTree::SHAPlaneEvent::SHAPlaneEvent(const Triangle* _prim, float _plane, uint32_t _axis, SHAPlaneEventType _type)
+KdTree::SHAPlaneEvent::SHAPlaneEvent(const Triangle* _prim, float _plane, SHAPlaneEventType _type)
     : primitive(_prim)
     , plane(_plane)
-    , axis(_axis)
     , type(_type)
 {
 }
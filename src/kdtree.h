@@ -2,55 +2,64 @@
 #define __KDTREE_H__
 
 #include <vector>
-#include <list>
 #include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
 
 #include "aligned_allocator.h"
 #include "aabbox.h"
 #include "common.h"
 #include "stats.h"
 #include "mailboxer.h"
+#include "iaccelerator.h"
+#include "triangle_group.h"
+#include "vector.h"
+#include "ray_packet.h"
+
+// Leaves are intersected this many triangles at a time. Most leaves only
+// hold a few primitives so the narrower SSE groups waste less on padding.
+#define KDTREE_TRIANGLE_GROUP_WIDTH (4)
 
 
 class Triangle;
 class Ray;
 
 
-class KdTree
+class KdTree : public IAccelerator
 {
 private:
     using PrimitiveVector = std::vector<const Triangle*, AlignedAllocator<const Triangle*> >;
 
-    class Node
-    {
-    private:
-        enum Flags : uint32_t
-        {
-            XAXIS = 0x0,
-            YAXIS = 0x1,
-            ZAXIS = 0x2,
-            LEAF = 0x3,
-            MASK = 0x3
-        };
+    // Primitives of all leaves, back to back. Each entry is the index of a
+    // primitive in mPrimVector, which is also its id.
+    using LeafPrimitiveBuffer = std::vector<uint32_t, AlignedAllocator<uint32_t> >;
 
-    public:
-        using ConstPrimIterator = const Triangle* const*;
-        using PrimIterator = const Triangle**;
+    // Packed copies of the leaf primitives, group i holds leaf primitives
+    // [i * width, (i + 1) * width). Every leaf starts on a new group.
+    using LeafTriangleGroup = TriangleGroup<KDTREE_TRIANGLE_GROUP_WIDTH>;
+    using TriangleGroupBuffer = std::vector<LeafTriangleGroup, AlignedAllocator<LeafTriangleGroup> >;
 
-        explicit Node();
-        ~Node();
-
-        // Don't copy
-        Node(const Node&) = delete;
-        Node& operator=(const Node&) = delete;
+    enum NodeFlags : uint32_t
+    {
+        XAXIS = 0x0,
+        YAXIS = 0x1,
+        ZAXIS = 0x2,
+        LEAF = 0x3,
+        MASK = 0x3
+    };
 
-        // But we can move
-        Node(Node&& rhs);
+    // Node the builder works on, children can end up anywhere in the
+    // buffer so both are stored.
+    class BuildNode
+    {
+    public:
+        explicit BuildNode();
 
         void split(uint32_t leftChild, uint32_t rightChild, float position, uint32_t plane);
-        void initLeafNode(uint32_t numPrimitives);
-
-        bool intersect(const Ray& ray) const;
+        void initLeafNode(uint32_t firstPrimitive, uint32_t numPrimitives);
+        void relocate(uint32_t nodeOffset, uint32_t primitiveOffset);
 
         uint32_t splitAxis() const { return (mFlags & MASK); }
         float splitPlane() const { return mPlanePosition; }
@@ -59,19 +68,14 @@ private:
 
         bool isLeaf() const { return (mFlags & MASK) == LEAF; }
         uint32_t primitiveCount() const { return mPrimCount >> 2; }
-
-        ConstPrimIterator beginPrimitives() const { return mPrimitives; }
-        ConstPrimIterator endPrimitives() const { return mPrimitives + primitiveCount(); }
-
-        PrimIterator beginPrimitives() { return mPrimitives; }
-        PrimIterator endPrimitives() { return mPrimitives + primitiveCount(); }
+        uint32_t firstPrimitive() const { return mFirstPrimitive; }
 
     private:
         union // 4 bytes
         {
             uint32_t    mUpperChild;
             uint32_t    mPrimCount;
-            Flags       mFlags;
+            NodeFlags   mFlags;
         };
 
         union // 8 bytes
@@ -82,10 +86,42 @@ private:
                 uint32_t mLowerChild;
             };
 
-            struct
-            {
-                const Triangle** mPrimitives;
-            };
+            uint32_t mFirstPrimitive; // Offset into the leaf primitive buffer
+        };
+    };
+    using BuildNodeBuffer = std::vector<BuildNode, AlignedAllocator<BuildNode> >;
+
+    // Node the tree is traversed with. Nodes are laid out depth first so
+    // the lower child of an inner node always directly follows it and only
+    // the upper child's index is stored, eight of them fit a cache line.
+    class Node
+    {
+    public:
+        explicit Node();
+
+        void initInner(uint32_t upperChild, float position, uint32_t axis);
+        void initLeaf(uint32_t firstPrimitive, uint32_t numPrimitives);
+
+        uint32_t splitAxis() const { return (mFlags & MASK); }
+        float splitPlane() const { return mPlanePosition; }
+        uint32_t upperChildIdx() const { return mUpperChild >> 2; }
+
+        bool isLeaf() const { return (mFlags & MASK) == LEAF; }
+        uint32_t primitiveCount() const { return mPrimCount >> 2; }
+        uint32_t firstPrimitive() const { return mFirstPrimitive; }
+
+    private:
+        union // 4 bytes
+        {
+            float       mPlanePosition;
+            uint32_t    mFirstPrimitive; // Offset into the leaf primitive buffer
+        };
+
+        union // 4 bytes
+        {
+            uint32_t    mUpperChild;
+            uint32_t    mPrimCount;
+            NodeFlags   mFlags;
         };
     };
     using NodeBuffer = std::vector<Node, AlignedAllocator<Node> >;
@@ -99,17 +135,33 @@ private:
     
     struct SHAPlaneEvent
     {
-        SHAPlaneEvent(const Triangle* _prim, float _plane, uint32_t _axis,
-                      SHAPlaneEventType _type);
+        SHAPlaneEvent(const Triangle* _prim, float _plane, SHAPlaneEventType _type);
         
         bool operator<(const SHAPlaneEvent& rhs) const;
         
         const Triangle* primitive;
         float plane;
-        uint32_t axis;
         SHAPlaneEventType type;
     };
-    using SHAPlaneEventList = std::list<SHAPlaneEvent>;
+    using SHAPlaneEventList = std::vector<SHAPlaneEvent>;
+
+    // Events of a voxel, kept in a separate sorted list per split axis so a
+    // split never has to re-sort the events of its children.
+    struct SHAPlaneEvents
+    {
+        size_t size() const;
+        void release();
+
+        SHAPlaneEventList axis[3];
+    };
+
+    enum PrimSide : uint8_t
+    {
+        PS_LEFT = 0,
+        PS_RIGHT,
+        PS_BOTH
+    };
+    using PrimSideBuffer = std::vector<uint8_t>;
     
     struct SHASplitPlane
     {
@@ -121,6 +173,8 @@ private:
 
         SHASplitPlane();
 
+        bool isCheaperThan(const SHASplitPlane& other) const;
+
         float plane;
         float cost;
         uint32_t aaAxis;
@@ -129,51 +183,150 @@ private:
         uint32_t numPrimitivesLeft;
     };
 
+    // State of one build task, every task allocates nodes into its own
+    // buffer which is appended to its parent's once the task is done.
+    struct BuildContext
+    {
+        explicit BuildContext();
+
+        uint32_t allocNode();
+        uint32_t append(BuildContext& other);
+
+        BuildNodeBuffer     nodes;
+        uint32_t            nextNodeIdx;
+        LeafPrimitiveBuffer leafPrimitives;
+        PrimSideBuffer      primSides;
+        uint32_t            maxDepth;
+        uint32_t            minDepth;
+        size_t              leafNodes;
+        uint32_t            maxPrimsPerNode;
+        double              sahCost;
+    };
+
     struct TraversalState
     {
         uint32_t nodeIdx;
         float minT;
         float maxT;
     };
+    using TraversalBuffer = std::vector<TraversalState, AlignedAllocator<TraversalState> >;
+
+    // Far child of a packet, the rays still active in it and their intervals
+    struct PacketTraversalState
+    {
+        alignas(16) float minT[RayPacket::MAX_RAYS];
+        alignas(16) float maxT[RayPacket::MAX_RAYS];
+        uint32_t nodeIdx;
+        uint32_t activeMask;
+    };
+    using PacketTraversalBuffer = std::vector<PacketTraversalState, AlignedAllocator<PacketTraversalState> >;
+
+    // Leaves share primitives so every thread also needs mailboxes to
+    // skip primitives it already tested against the current ray.
+    class KdTraversalContext : public TraversalContext
+    {
+    public:
+        KdTraversalContext(uint32_t maxDepth, size_t numPrimitives)
+            : stack(maxDepth), packetStack(maxDepth), mailboxes(numPrimitives)
+            , packetMailboxes(numPrimitives) { }
+
+        TraversalBuffer         stack;
+        PacketTraversalBuffer   packetStack;
+        Mailboxer               mailboxes;
+        PacketMailboxer         packetMailboxes;
+    };
     
 public:
-    using TraversalBuffer = std::vector<TraversalState, AlignedAllocator<TraversalState> >;
+    enum BuildMode
+    {
+        SAH_EXACT = 0,  // Sweep every event, gives the best tree
+        SAH_BINNED      // Sweep a fixed number of bins per axis near the root, faster to build
+    };
 
     explicit KdTree();
     ~KdTree();
     
-    void build();
+    void setBuildMode(BuildMode mode) { mBuildMode = mode; }
+    void setCache(const std::string& directory, bool forceRebuild);
+    void build(uint32_t numThreads) override;
+
+    void addPrimitive(const Triangle* p) override;
+    size_t numberOfPrimitives() const override { return mPrimVector.size(); }
+    std::unique_ptr<TraversalContext> allocateTraversalContext() const override;
+
+    // The entry is the deepest node whose cell holds everything the
+    // frustum can see
+    FrustumEntry cullFrustum(const Frustum& frustum, Stats& threadStats) const override;
+
+    // The hint is the leaf whose cell holds the hit point
+    OccluderHint occluderHint(const glm::vec3& P) const override;
+    bool traceOccluderHint(Ray& ray, OccluderHint hint, TraversalContext& ctx, Stats& threadStats) const override;
+
+protected:
+    bool traceClosest(Ray& ray, TraversalContext& ctx, Stats& threadStats) const override;
+    bool traceVisibility(Ray& ray, TraversalContext& ctx, Stats& threadStats) const override;
+    uint32_t traceClosestPacket(RayPacket& packet, FrustumEntry entry,
+                                TraversalContext& ctx, Stats& threadStats) const override;
+    uint32_t traceVisibilityPacket(RayPacket& packet, FrustumEntry entry,
+                                   TraversalContext& ctx, Stats& threadStats) const override;
 
-    template <bool visibilityTest>
-    bool trace(Ray& ray, TraversalBuffer& traversalStack, Mailboxer& mailboxes, Stats& threadStats) const;
-    
-    void addPrimitive(const Triangle* p);
-    size_t numberOfPrimitives() const { return mPrimVector.size(); }
-    TraversalBuffer allocateTraversalBuffer() const;
-    
 private:
-    uint32_t allocNode(uint32_t* nextNodeIdx);
+    template <bool visibilityTest>
+    uint32_t tracePacket(RayPacket& packet, uint32_t rootIdx, TraversalContext& ctx, Stats& threadStats) const;
 
-    void build(uint32_t nodeIdx, const AABBox& bounds, SHAPlaneEventList& events, uint32_t numPrimitives, uint32_t depth, uint32_t* nextNodeIdx);
-    void split(SHAPlaneEventList& outLeftEvents, SHAPlaneEventList& outRightEvents,
+    // Rays start at rootIdx, which must be the root or a node every ray
+    // only enters from its parent, see cullFrustum()
+    template <bool visibilityTest>
+    bool traverse(Ray& ray, uint32_t rootIdx, TraversalBuffer& traversalStack,
+                  Mailboxer& mailboxes, Stats& threadStats) const;
+    template <bool visibilityTest>
+    uint32_t traversePacket(RayPacket& packet, uint32_t rootIdx, PacketTraversalBuffer& traversalStack,
+                            PacketMailboxer& mailboxes, Stats& threadStats) const;
+    bool isCoherent(const RayPacket& packet) const;
+
+    void build(uint32_t nodeIdx, const AABBox& bounds, SHAPlaneEvents& events, uint32_t numPrimitives, uint32_t depth, BuildContext& ctx) const;
+    void split(SHAPlaneEvents& outLeftEvents, SHAPlaneEvents& outRightEvents,
                const AABBox& leftBounds, const AABBox& rightBounds,
-               const SHASplitPlane& plane, SHAPlaneEventList& events);
+               const SHASplitPlane& plane, const SHAPlaneEvents& events,
+               PrimSideBuffer& primSides, bool binned, bool parallel) const;
+    SHASplitPlane findSplitPlane(const AABBox& voxel, const SHAPlaneEvents& events,
+                                 uint32_t totalNumPrimitives, bool parallel) const;
     SHASplitPlane findSplitPlane(const AABBox& voxel, const SHAPlaneEventList& events,
-                                 uint32_t totalNumPrimitives) const;
+                                 uint32_t totalNumPrimitives, uint32_t aaAxis) const;
+    SHASplitPlane findBinnedSplitPlane(const AABBox& voxel, const SHAPlaneEventList& events,
+                                       uint32_t totalNumPrimitives, uint32_t aaAxis) const;
+    void relayout(const BuildNodeBuffer& buildNodes, const LeafPrimitiveBuffer& buildLeafPrimitives,
+                  uint32_t buildNodeIdx);
+    void packTriangles();
+    bool isParallelTask(uint32_t depth, uint32_t numPrimitives) const;
+    bool isBinnedNode(uint32_t numPrimitives) const;
     void SHACost(float* lowestCostOut, SHASplitPlane::Side* outSide,
                  float plane, uint32_t aaAxis, const AABBox& voxel,
                  uint32_t numLeftPrims, uint32_t numRightPrims, uint32_t numPlanarPrims) const;
 
     void generateEventsForPrimitive(const Triangle* primitive, const AABBox& voxel,
-                                    SHAPlaneEventList& events) const;
+                                    SHAPlaneEvents& events) const;
+
+    // Cached trees, see kdtree_cache.cpp
+    uint64_t geometryHash() const;
+    std::string cacheFile(uint64_t geometryHash) const;
+    bool loadCache(const std::string& file, uint64_t geometryHash);
+    void saveCache(const std::string& file, uint64_t geometryHash) const;
 
     AABBox                  mBounds;
     NodeBuffer              mNodes;
+    LeafPrimitiveBuffer     mLeafPrimitives;
+    TriangleGroupBuffer     mTriangleGroups;
     uint32_t                mMaxDepth;
     uint32_t                mMinDepth;
     size_t                  mLeafNodes;
     size_t                  mTotalNodes;
     uint32_t                mMaxPrimsPerNode;
+    uint32_t                mParallelDepth;
+    BuildMode               mBuildMode;
+    float                   mSAHCost;
+    std::string             mCacheDirectory;
+    bool                    mForceRebuild;
     PrimitiveVector         mPrimVector;
 };
 
@@ -183,57 +336,70 @@ inline void KdTree::addPrimitive(const Triangle* p)
     mPrimVector.emplace_back(p);
 }
 
-inline uint32_t KdTree::allocNode(uint32_t* nextNodeIdx)
+inline uint32_t KdTree::BuildContext::allocNode()
 {
-    uint32_t result = (*nextNodeIdx)++;
+    uint32_t result = nextNodeIdx++;
 
-    if (result >= mNodes.size())
+    if (result >= nodes.size())
     {
-        mNodes.resize(mNodes.size() << 1);
+        nodes.resize(nodes.size() << 1);
     }
 
-    ++mTotalNodes;
     return result;
 }
 
-inline void KdTree::Node::split(uint32_t leftChild, uint32_t rightChild, float position, uint32_t axis)
+inline void KdTree::BuildNode::split(uint32_t leftChild, uint32_t rightChild, float position, uint32_t axis)
 {
     TP_ASSERT(leftChild != rightChild);
     TP_ASSERT(isLeaf());
     TP_ASSERT(upperChildIdx() == 0);
-    TP_ASSERT(mPrimitives == nullptr);
 
     mUpperChild = (rightChild << 2) | (axis & MASK);
     mLowerChild = leftChild;
     mPlanePosition = position;
 }
 
-inline void KdTree::Node::initLeafNode(uint32_t numPrimitives)
+inline void KdTree::BuildNode::relocate(uint32_t nodeOffset, uint32_t primitiveOffset)
+{
+    if (isLeaf())
+    {
+        mFirstPrimitive += primitiveOffset;
+    }
+    else
+    {
+        mUpperChild += nodeOffset << 2;
+        mLowerChild += nodeOffset;
+    }
+}
+
+inline void KdTree::BuildNode::initLeafNode(uint32_t firstPrimitive, uint32_t numPrimitives)
 {
     TP_ASSERT(isLeaf());
     TP_ASSERT(upperChildIdx() == 0);
-    TP_ASSERT(mPrimitives == nullptr);
 
     mPrimCount |= numPrimitives << 2;
+    mFirstPrimitive = firstPrimitive;
+}
 
-    if (numPrimitives)
-    {
-        mPrimitives = new const Triangle*[numPrimitives];
-    }
+inline void KdTree::Node::initInner(uint32_t upperChild, float position, uint32_t axis)
+{
+    TP_ASSERT(axis < LEAF);
+
+    mUpperChild = (upperChild << 2) | (axis & MASK);
+    mPlanePosition = position;
+}
+
+inline void KdTree::Node::initLeaf(uint32_t firstPrimitive, uint32_t numPrimitives)
+{
+    mPrimCount = (numPrimitives << 2) | LEAF;
+    mFirstPrimitive = firstPrimitive;
 }
 
 inline bool KdTree::SHAPlaneEvent::operator<(const SHAPlaneEvent& rhs) const
 {
     if (plane == rhs.plane)
     {
-        if (axis == rhs.axis)
-        {
-            return type < rhs.type;
-        }
-        else
-        {
-            return axis < rhs.axis;
-        }
+        return type < rhs.type;
     }
     else
     {
@@ -241,8 +407,57 @@ inline bool KdTree::SHAPlaneEvent::operator<(const SHAPlaneEvent& rhs) const
     }
 }
 
+inline bool KdTree::SHASplitPlane::isCheaperThan(const SHASplitPlane& other) const
+{
+    if (cost != other.cost)
+    {
+        return cost < other.cost;
+    }
+
+    // Break ties on the lowest plane, then the lowest axis, so the result
+    // doesn't depend on the order the axes are swept in.
+    return cost < std::numeric_limits<float>::max() &&
+        (plane < other.plane || (plane == other.plane && aaAxis < other.aaAxis));
+}
+
+inline size_t KdTree::SHAPlaneEvents::size() const
+{
+    return axis[0].size() + axis[1].size() + axis[2].size();
+}
+
+inline void KdTree::SHAPlaneEvents::release()
+{
+    for (SHAPlaneEventList& events : axis)
+    {
+        SHAPlaneEventList().swap(events);
+    }
+}
+
+template <bool visibilityTest>
+uint32_t KdTree::tracePacket(RayPacket& packet, uint32_t rootIdx, TraversalContext& ctx, Stats& threadStats) const
+{
+    KdTraversalContext& kdCtx = static_cast<KdTraversalContext&>(ctx);
+    if (isCoherent(packet))
+    {
+        kdCtx.packetMailboxes.IncrementPacketId();
+        return traversePacket<visibilityTest>(packet, rootIdx, kdCtx.packetStack, kdCtx.packetMailboxes, threadStats);
+    }
+
+    uint32_t hitMask = 0;
+    for (uint32_t i = 0; i < packet.size(); ++i)
+    {
+        kdCtx.mailboxes.IncrementRayId();
+        if (traverse<visibilityTest>(packet[i], rootIdx, kdCtx.stack, kdCtx.mailboxes, threadStats))
+        {
+            hitMask |= 1 << i;
+        }
+    }
+    return hitMask;
+}
+
 template <bool visibilityTest>
-bool KdTree::trace(Ray& ray, TraversalBuffer& traversalStack, Mailboxer& mailboxes, Stats& threadStats) const
+bool KdTree::traverse(Ray& ray, uint32_t rootIdx, TraversalBuffer& traversalStack,
+                      Mailboxer& mailboxes, Stats& threadStats) const
 {
     threadStats.boxTests++;
     if (!mBounds.intersect(ray))
@@ -255,30 +470,46 @@ bool KdTree::trace(Ray& ray, TraversalBuffer& traversalStack, Mailboxer& mailbox
     const glm::vec3 invDir = 1.f / ray.dir();
     const glm::vec3 rayOrigin = ray.origin();
     bool hitPrimitive = false;
-    const Node* currentNode = &mNodes[0];
+    const Node* currentNode = &mNodes[rootIdx];
     int traversalStackIdx = -1;
 
     do
     {
         if (currentNode->isLeaf())
         {
-            Node::ConstPrimIterator it = currentNode->beginPrimitives();
-            for (; it != currentNode->endPrimitives(); ++it)
+            const uint32_t firstPrimitive = currentNode->firstPrimitive();
+            const uint32_t numPrimitives = currentNode->primitiveCount();
+            for (uint32_t group = 0; group < numPrimitives; group += KDTREE_TRIANGLE_GROUP_WIDTH)
             {
-                if (!mailboxes.Tested((*it)->id()))
+                // Only test the primitives this ray hasn't seen in another leaf
+                const uint32_t* ids = mLeafPrimitives.data() + firstPrimitive + group;
+                const uint32_t numLanes = std::min(numPrimitives - group, (uint32_t)KDTREE_TRIANGLE_GROUP_WIDTH);
+                uint32_t laneMask = 0;
+                for (uint32_t lane = 0; lane < numLanes; ++lane)
                 {
-                    threadStats.primitiveTests++;
-                    if ((*it)->intersect(ray))
+                    if (!mailboxes.Tested(ids[lane]))
                     {
-                        if (visibilityTest)
-                        {
-                            return true;
-                        }
+                        mailboxes.Mark(ids[lane]);
+                        laneMask |= 1 << lane;
+                    }
+                }
+
+                if (!laneMask)
+                {
+                    continue;
+                }
 
-                        hitPrimitive = true;
+                threadStats.primitiveTests += (uint64_t)__builtin_popcount(laneMask);
+                const LeafTriangleGroup& triangles =
+                    mTriangleGroups[(firstPrimitive + group) / KDTREE_TRIANGLE_GROUP_WIDTH];
+                if (triangles.intersect(ray, laneMask))
+                {
+                    if (visibilityTest)
+                    {
+                        return true;
                     }
 
-                    mailboxes.Mark((*it)->id());
+                    hitPrimitive = true;
                 }
             }
 
@@ -302,22 +533,24 @@ bool KdTree::trace(Ray& ray, TraversalBuffer& traversalStack, Mailboxer& mailbox
             const uint32_t axis = currentNode->splitAxis();
             const float planeT = (currentNode->splitPlane() - rayOrigin[axis]) * invDir[axis];
 
-            uint32_t firstChild = currentNode->lowerChildIdx();
-            uint32_t secondChild = currentNode->upperChildIdx();
+            const Node* firstChild = currentNode + 1;
+            const Node* secondChild = &mNodes[currentNode->upperChildIdx()];
 
-            bool belowFirst = rayOrigin[axis] <= currentNode->splitPlane();
+            // A ray starting on the plane only enters the side it points to
+            bool belowFirst = rayOrigin[axis] < currentNode->splitPlane() ||
+                (rayOrigin[axis] == currentNode->splitPlane() && invDir[axis] <= 0.f);
             if (!belowFirst)
             {
                 std::swap(firstChild, secondChild);
             }
 
-            if (maxT < planeT || planeT < 0.f)
+            if (maxT < planeT || planeT <= 0.f)
             {
-                currentNode = &mNodes[firstChild];
+                currentNode = firstChild;
             }
             else if (minT > planeT)
             {
-                currentNode = &mNodes[secondChild];
+                currentNode = secondChild;
             }
             else
             {
@@ -325,10 +558,10 @@ bool KdTree::trace(Ray& ray, TraversalBuffer& traversalStack, Mailboxer& mailbox
                 TraversalState& state = traversalStack[++traversalStackIdx];
                 state.minT = planeT;
                 state.maxT = maxT;
-                state.nodeIdx = secondChild;
+                state.nodeIdx = (uint32_t)(secondChild - mNodes.data());
 
                 maxT = planeT > 0.f ? planeT : maxT;
-                currentNode = &mNodes[firstChild];
+                currentNode = firstChild;
             }
         }
     } while (ray.maxT() >= minT);
@@ -336,5 +569,199 @@ bool KdTree::trace(Ray& ray, TraversalBuffer& traversalStack, Mailboxer& mailbox
     return hitPrimitive;
 }
 
-#endif
+template <bool visibilityTest>
+uint32_t KdTree::traversePacket(RayPacket& packet, uint32_t rootIdx, PacketTraversalBuffer& traversalStack,
+                                PacketMailboxer& mailboxes, Stats& threadStats) const
+{
+    static_assert(RayPacket::MAX_RAYS <= 16, "Packet mailboxes track at most 16 rays");
+    static_assert(RayPacket::MAX_RAYS % 4 == 0, "Packets are traversed four rays at a time");
+    using SimdType = SimdVector<4>;
+
+    // Rays are split at a node only by their intervals, all of them agree
+    // on which child is near since their directions have the same signs.
+    TP_ASSERT(isCoherent(packet));
+    const glm::vec3 dir = packet[0].dir();
+    const bool nearIsLower[3] = { !std::signbit(dir.x), !std::signbit(dir.y), !std::signbit(dir.z) };
+
+    // Rays SoA, four per SIMD vector. Lanes past the end of the packet or of
+    // inactive rays hold garbage that is masked off.
+    alignas(16) float rayOrigins[3][RayPacket::MAX_RAYS];
+    alignas(16) float invDirs[3][RayPacket::MAX_RAYS];
+    alignas(16) float minTs[RayPacket::MAX_RAYS];
+    alignas(16) float maxTs[RayPacket::MAX_RAYS];
+    alignas(16) float hitTs[RayPacket::MAX_RAYS];
+    const uint32_t numVectors = (packet.size() + 3) / 4;
+    uint32_t activeMask = 0;
+
+    threadStats.boxTests++;
+    for (uint32_t i = 0; i < numVectors * 4; ++i)
+    {
+        Ray& ray = packet[std::min(i, packet.size() - 1)];
+        if (i < packet.size() && mBounds.intersect(ray))
+        {
+            activeMask |= 1 << i;
+        }
+
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            rayOrigins[axis][i] = ray.origin()[axis];
+            invDirs[axis][i] = 1.f / ray.dir()[axis];
+        }
+        minTs[i] = ray.minT();
+        maxTs[i] = ray.maxT();
+        hitTs[i] = ray.maxT();
+    }
+
+    // Rays that still need to be traversed, visibility rays are done once
+    // they hit anything
+    uint32_t pendingMask = activeMask;
+    uint32_t hitMask = 0;
+    const Node* currentNode = &mNodes[rootIdx];
+    int traversalStackIdx = -1;
 
+    while (true)
+    {
+        if (activeMask && currentNode->isLeaf())
+        {
+            const uint32_t firstPrimitive = currentNode->firstPrimitive();
+            const uint32_t numPrimitives = currentNode->primitiveCount();
+            for (uint32_t group = 0; group < numPrimitives; group += KDTREE_TRIANGLE_GROUP_WIDTH)
+            {
+                // Rays of the packet that haven't seen each primitive yet
+                const uint32_t* ids = mLeafPrimitives.data() + firstPrimitive + group;
+                const uint32_t numLanes = std::min(numPrimitives - group, (uint32_t)KDTREE_TRIANGLE_GROUP_WIDTH);
+                uint32_t untestedRays[KDTREE_TRIANGLE_GROUP_WIDTH];
+                uint32_t untestedByAll = activeMask;
+                for (uint32_t lane = 0; lane < numLanes; ++lane)
+                {
+                    untestedRays[lane] = activeMask & ~mailboxes.Tested(ids[lane]);
+                    untestedByAll &= untestedRays[lane];
+                    mailboxes.Mark(ids[lane], activeMask);
+                }
+
+                const LeafTriangleGroup& triangles =
+                    mTriangleGroups[(firstPrimitive + group) / KDTREE_TRIANGLE_GROUP_WIDTH];
+                for (uint32_t rays = activeMask; rays; rays &= rays - 1)
+                {
+                    const uint32_t i = (uint32_t)__builtin_ctz(rays);
+                    uint32_t laneMask = (1 << numLanes) - 1;
+                    if (!((untestedByAll >> i) & 1))
+                    {
+                        laneMask = 0;
+                        for (uint32_t lane = 0; lane < numLanes; ++lane)
+                        {
+                            laneMask |= ((untestedRays[lane] >> i) & 1) << lane;
+                        }
+                    }
+
+                    if (!laneMask)
+                    {
+                        continue;
+                    }
+
+                    threadStats.primitiveTests += (uint64_t)__builtin_popcount(laneMask);
+                    if (triangles.intersect(packet[i], laneMask))
+                    {
+                        hitMask |= 1 << i;
+                        hitTs[i] = packet[i].maxT();
+                        if (visibilityTest)
+                        {
+                            pendingMask &= ~(1 << i);
+                            activeMask &= ~(1 << i);
+                        }
+                    }
+                }
+            }
+
+            activeMask = 0;
+        }
+        else if (activeMask)
+        {
+            threadStats.boxTests++;
+
+            const uint32_t axis = currentNode->splitAxis();
+            const typename SimdType::Type plane = SimdType::set1(currentNode->splitPlane());
+
+            const Node* nearChild = currentNode + 1;
+            const Node* farChild = &mNodes[currentNode->upperChildIdx()];
+            if (!nearIsLower[axis])
+            {
+                std::swap(nearChild, farChild);
+            }
+
+            // Rays in the plane get a NaN planeT, the negated compares send
+            // them to both children and min() and max() keep their interval.
+            uint32_t nearMask = 0;
+            uint32_t farMask = 0;
+            alignas(16) float nearMaxTs[RayPacket::MAX_RAYS];
+            alignas(16) float farMinTs[RayPacket::MAX_RAYS];
+            for (uint32_t v = 0; v < numVectors; ++v)
+            {
+                const uint32_t lane = v * 4;
+                const typename SimdType::Type minT = SimdType::load(minTs + lane);
+                const typename SimdType::Type maxT = SimdType::load(maxTs + lane);
+                const typename SimdType::Type planeT = SimdType::mul(
+                    SimdType::sub(plane, SimdType::load(rayOrigins[axis] + lane)),
+                    SimdType::load(invDirs[axis] + lane));
+
+                nearMask |= (~SimdType::lessMask(planeT, minT) & 0xf) << lane;
+                farMask |= (~SimdType::lessMask(maxT, planeT) & 0xf) << lane;
+                SimdType::store(nearMaxTs + lane, SimdType::min(planeT, maxT));
+                SimdType::store(farMinTs + lane, SimdType::max(planeT, minT));
+            }
+            nearMask &= activeMask;
+            farMask &= activeMask;
+
+            if (farMask && nearMask)
+            {
+                PacketTraversalState& state = traversalStack[++traversalStackIdx];
+                state.nodeIdx = (uint32_t)(farChild - mNodes.data());
+                state.activeMask = farMask;
+                for (uint32_t v = 0; v < numVectors; ++v)
+                {
+                    SimdType::store(state.minT + v * 4, SimdType::load(farMinTs + v * 4));
+                    SimdType::store(state.maxT + v * 4, SimdType::load(maxTs + v * 4));
+                }
+            }
+
+            // Only the intervals of the rays going on are used from here
+            if (nearMask)
+            {
+                std::copy(nearMaxTs, nearMaxTs + numVectors * 4, maxTs);
+                activeMask = nearMask;
+                currentNode = nearChild;
+            }
+            else
+            {
+                std::copy(farMinTs, farMinTs + numVectors * 4, minTs);
+                activeMask = farMask;
+                currentNode = farChild;
+            }
+        }
+        else
+        {
+            // Pop the next node that still has rays without a closer hit
+            if (traversalStackIdx < 0)
+            {
+                break;
+            }
+
+            const PacketTraversalState& state = traversalStack[traversalStackIdx--];
+            for (uint32_t v = 0; v < numVectors; ++v)
+            {
+                const uint32_t lane = v * 4;
+                const typename SimdType::Type minT = SimdType::load(state.minT + lane);
+                activeMask |= SimdType::lessEqualMask(minT, SimdType::load(hitTs + lane)) << lane;
+                SimdType::store(minTs + lane, minT);
+                SimdType::store(maxTs + lane, SimdType::load(state.maxT + lane));
+            }
+            activeMask &= state.activeMask & pendingMask;
+
+            currentNode = &mNodes[state.nodeIdx];
+        }
+    }
+
+    return hitMask;
+}
+
+#endif
@@ -0,0 +1,316 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include "kdtree.h"
+#include "triangle.h"
+#include "vertex.h"
+
+// Bump whenever the file layout or the tree the builder produces changes
+#define KDTREE_CACHE_VERSION (3)
+
+namespace
+{
+const char kCacheMagic[4] = { 'T', 'P', 'K', 'D' };
+
+// Files are written in the host's byte order, a cache is only meant to be
+// reused on the machine that wrote it.
+struct CacheHeader
+{
+    char        magic[4];
+    uint32_t    version;
+    uint64_t    geometryHash;
+    uint32_t    buildMode;
+    uint32_t    numPrimitives;
+    uint32_t    numNodes;
+    uint32_t    numLeafPrimitives;
+    float       bounds[6];
+    uint32_t    maxDepth;
+    uint32_t    minDepth;
+    uint32_t    leafNodes;
+    uint32_t    maxPrimsPerNode;
+    float       sahCost;
+    uint32_t    padding;
+};
+
+// Nodes are stored in the tree's depth first order, the lower child of an
+// inner node is the node after it. Inner nodes store the upper child and
+// split axis in flags and the split plane's bits in a. Leaves store their
+// primitive count and LEAF in flags and the offset of their primitive ids in a.
+struct CachedNode
+{
+    uint32_t flags;
+    uint32_t a;
+};
+
+const uint32_t kLeafFlag = 0x3;
+
+class Hasher
+{
+public:
+    Hasher() : mHash(14695981039346656037ull) { }
+
+    template <typename T>
+    void add(const T& value)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+        for (size_t i = 0; i < sizeof(T); ++i)
+        {
+            mHash = (mHash ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+
+    uint64_t hash() const { return mHash; }
+
+private:
+    uint64_t mHash;
+};
+
+// Read only mapping of a whole file, unmapped when it goes out of scope
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& file)
+        : mData(nullptr)
+        , mSize(0)
+    {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return;
+        }
+
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0)
+        {
+            void* data = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                mData = static_cast<const unsigned char*>(data);
+                mSize = (size_t)fileStat.st_size;
+            }
+        }
+
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (mData != nullptr)
+        {
+            munmap(const_cast<unsigned char*>(mData), mSize);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return mData; }
+    size_t size() const { return mSize; }
+
+private:
+    const unsigned char*    mData;
+    size_t                  mSize;
+};
+} // anonymous namespace
+
+
+uint64_t KdTree::geometryHash() const
+{
+    Hasher hasher;
+    hasher.add((uint32_t)KDTREE_CACHE_VERSION);
+    hasher.add((uint32_t)mBuildMode);
+    hasher.add((uint32_t)KDTREE_TRIANGLE_GROUP_WIDTH);
+    hasher.add((uint64_t)mPrimVector.size());
+
+    for (const Triangle* tri : mPrimVector)
+    {
+        hasher.add(tri->vertexA().position);
+        hasher.add(tri->vertexB().position);
+        hasher.add(tri->vertexC().position);
+    }
+
+    return hasher.hash();
+}
+
+std::string KdTree::cacheFile(uint64_t geometryHash) const
+{
+    std::stringstream ss;
+    ss << mCacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0')
+        << geometryHash << ".kdtree";
+    return ss.str();
+}
+
+bool KdTree::loadCache(const std::string& file, uint64_t geometryHash)
+{
+    MappedFile mapping(file);
+    if (mapping.data() == nullptr || mapping.size() < sizeof(CacheHeader))
+    {
+        return false;
+    }
+
+    CacheHeader header;
+    memcpy(&header, mapping.data(), sizeof(CacheHeader));
+
+    const size_t expectedSize = sizeof(CacheHeader) +
+        (size_t)header.numNodes * sizeof(CachedNode) +
+        (size_t)header.numLeafPrimitives * sizeof(uint32_t);
+    if (memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+        header.version != KDTREE_CACHE_VERSION ||
+        header.geometryHash != geometryHash ||
+        header.buildMode != (uint32_t)mBuildMode ||
+        header.numPrimitives != mPrimVector.size() ||
+        header.numNodes == 0 ||
+        header.numLeafPrimitives % KDTREE_TRIANGLE_GROUP_WIDTH != 0 ||
+        mapping.size() != expectedSize)
+    {
+        std::cerr << "Warning: ignoring stale kd-tree cache " << file << std::endl;
+        return false;
+    }
+
+    const CachedNode* cachedNodes = reinterpret_cast<const CachedNode*>(
+        mapping.data() + sizeof(CacheHeader));
+    const uint32_t* leafPrimitives = reinterpret_cast<const uint32_t*>(
+        cachedNodes + header.numNodes);
+
+    LeafPrimitiveBuffer primitives(leafPrimitives, leafPrimitives + header.numLeafPrimitives);
+    for (uint32_t primId : primitives)
+    {
+        if (primId >= mPrimVector.size())
+        {
+            std::cerr << "Warning: corrupt kd-tree cache " << file << std::endl;
+            return false;
+        }
+    }
+
+    NodeBuffer nodes(header.numNodes);
+    for (uint32_t i = 0; i < header.numNodes; ++i)
+    {
+        const CachedNode& cached = cachedNodes[i];
+        if ((cached.flags & kLeafFlag) == kLeafFlag)
+        {
+            const uint32_t numPrimitives = cached.flags >> 2;
+            if ((uint64_t)cached.a + numPrimitives > header.numLeafPrimitives ||
+                cached.a % KDTREE_TRIANGLE_GROUP_WIDTH != 0)
+            {
+                std::cerr << "Warning: corrupt kd-tree cache " << file << std::endl;
+                return false;
+            }
+
+            nodes[i].initLeaf(cached.a, numPrimitives);
+        }
+        else
+        {
+            // Children always follow their parent so the tree can't loop
+            const uint32_t upperChild = cached.flags >> 2;
+            if (upperChild <= i + 1 || upperChild >= header.numNodes)
+            {
+                std::cerr << "Warning: corrupt kd-tree cache " << file << std::endl;
+                return false;
+            }
+
+            float plane;
+            memcpy(&plane, &cached.a, sizeof(plane));
+            nodes[i].initInner(upperChild, plane, cached.flags & kLeafFlag);
+        }
+    }
+
+    mNodes.swap(nodes);
+    mLeafPrimitives.swap(primitives);
+    mBounds.update(glm::vec3(header.bounds[0], header.bounds[1], header.bounds[2]),
+                   glm::vec3(header.bounds[3], header.bounds[4], header.bounds[5]));
+    mMaxDepth = header.maxDepth;
+    mMinDepth = header.minDepth;
+    mLeafNodes = header.leafNodes;
+    mTotalNodes = header.numNodes;
+    mMaxPrimsPerNode = header.maxPrimsPerNode;
+    mSAHCost = header.sahCost;
+    packTriangles();
+
+    return true;
+}
+
+void KdTree::saveCache(const std::string& file, uint64_t geometryHash) const
+{
+    if (mkdir(mCacheDirectory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        std::cerr << "Warning: can't create kd-tree cache directory " << mCacheDirectory
+            << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    std::vector<CachedNode> cachedNodes(mTotalNodes);
+    for (size_t i = 0; i < mTotalNodes; ++i)
+    {
+        const Node& node = mNodes[i];
+        CachedNode& cached = cachedNodes[i];
+        if (node.isLeaf())
+        {
+            cached.flags = (node.primitiveCount() << 2) | kLeafFlag;
+            cached.a = node.firstPrimitive();
+        }
+        else
+        {
+            const float plane = node.splitPlane();
+            cached.flags = (node.upperChildIdx() << 2) | node.splitAxis();
+            memcpy(&cached.a, &plane, sizeof(plane));
+        }
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+    header.version = KDTREE_CACHE_VERSION;
+    header.geometryHash = geometryHash;
+    header.buildMode = (uint32_t)mBuildMode;
+    header.numPrimitives = (uint32_t)mPrimVector.size();
+    header.numNodes = (uint32_t)mTotalNodes;
+    header.numLeafPrimitives = (uint32_t)mLeafPrimitives.size();
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        header.bounds[axis] = mBounds.ll()[axis];
+        header.bounds[axis + 3] = mBounds.ur()[axis];
+    }
+    header.maxDepth = mMaxDepth;
+    header.minDepth = mMinDepth;
+    header.leafNodes = (uint32_t)mLeafNodes;
+    header.maxPrimsPerNode = mMaxPrimsPerNode;
+    header.sahCost = mSAHCost;
+
+    // Write to a temporary first so a concurrent run never maps a partial
+    // file. Each process writes its own, the last rename wins.
+    std::ostringstream tmpName;
+    tmpName << file << "." << getpid() << ".tmp";
+    const std::string tmpFile = tmpName.str();
+    {
+        std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(cachedNodes.data()),
+                  cachedNodes.size() * sizeof(CachedNode));
+        out.write(reinterpret_cast<const char*>(mLeafPrimitives.data()),
+                  mLeafPrimitives.size() * sizeof(uint32_t));
+
+        if (!out)
+        {
+            std::cerr << "Warning: failed writing kd-tree cache " << tmpFile << std::endl;
+            out.close();
+            std::remove(tmpFile.c_str());
+            return;
+        }
+    }
+
+    if (std::rename(tmpFile.c_str(), file.c_str()) != 0)
+    {
+        std::cerr << "Warning: failed writing kd-tree cache " << file
+            << ": " << strerror(errno) << std::endl;
+        std::remove(tmpFile.c_str());
+    }
+}
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "light_tree.h"
+#include "ilight.h"
+#include "noise.h"
+#include "common.h"
+
+
+LightTree::LightTree()
+    : mLights()
+    , mNodes()
+{
+}
+
+void LightTree::build(const std::vector<ILight*>& lights)
+{
+    mLights.clear();
+    mNodes.clear();
+
+    for (const ILight* light : lights)
+    {
+        if (light->isLocal() && luminance(light->color()) > 0.f)
+        {
+            mLights.push_back(light);
+        }
+    }
+
+    if (mLights.empty())
+    {
+        return;
+    }
+
+    mNodes.reserve(2 * mLights.size() - 1);
+    build(0, (uint32_t)mLights.size());
+}
+
+void LightTree::build(uint32_t begin, uint32_t end)
+{
+    const uint32_t nodeIdx = (uint32_t)mNodes.size();
+    mNodes.emplace_back();
+
+    Node node;
+    node.bounds = AABBox(glm::vec3(std::numeric_limits<float>::max()),
+                         glm::vec3(-std::numeric_limits<float>::max()));
+    node.attenuation = glm::vec3(std::numeric_limits<float>::max());
+    node.intensity = 0.f;
+    node.secondChild = 0;
+    node.light = begin;
+    node.isLeaf = end - begin == 1;
+
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        const ILight& light = *mLights[i];
+        node.bounds.encompass(light.position() - light.radius());
+        node.bounds.encompass(light.position() + light.radius());
+        node.attenuation = glm::min(node.attenuation, light.attenuation());
+        node.intensity += luminance(light.color());
+    }
+
+    if (!node.isLeaf)
+    {
+        // Median split on the longest axis of the lights' positions
+        AABBox centers(mLights[begin]->position(), mLights[begin]->position());
+        for (uint32_t i = begin + 1; i < end; ++i)
+        {
+            centers.encompass(mLights[i]->position());
+        }
+
+        const short axis = centers.longestAxis();
+        const uint32_t middle = begin + (end - begin) / 2;
+        std::nth_element(mLights.begin() + begin, mLights.begin() + middle, mLights.begin() + end,
+                         [axis](const ILight* a, const ILight* b)
+                         {
+                             return a->position()[axis] < b->position()[axis];
+                         });
+
+        build(begin, middle);
+        node.secondChild = (uint32_t)mNodes.size();
+        build(middle, end);
+    }
+
+    mNodes[nodeIdx] = node;
+}
+
+bool LightTree::sample(Noise& noise, const glm::vec3& P, const glm::vec3& N,
+                       const ILight*& light, float& pdf) const
+{
+    if (mNodes.empty())
+    {
+        return false;
+    }
+
+    pdf = 1.f;
+    uint32_t nodeIdx = 0;
+    while (!mNodes[nodeIdx].isLeaf)
+    {
+        const uint32_t first = nodeIdx + 1;
+        const uint32_t second = mNodes[nodeIdx].secondChild;
+        const float firstImportance = importance(mNodes[first], P, N);
+        const float secondImportance = importance(mNodes[second], P, N);
+        const float total = firstImportance + secondImportance;
+        if (total <= 0.f)
+        {
+            return false;
+        }
+
+        const float firstProbability = firstImportance / total;
+        if (noise.generateNormalizedFloat() < firstProbability)
+        {
+            nodeIdx = first;
+            pdf *= firstProbability;
+        }
+        else
+        {
+            nodeIdx = second;
+            pdf *= 1.f - firstProbability;
+        }
+    }
+
+    // The root may be a leaf that's below the surface
+    if (nodeIdx == 0 && importance(mNodes[0], P, N) <= 0.f)
+    {
+        return false;
+    }
+
+    light = mLights[mNodes[nodeIdx].light];
+    return pdf > 0.f;
+}
+
+float LightTree::importance(const Node& node, const glm::vec3& P, const glm::vec3& N) const
+{
+    const glm::vec3 center = (node.bounds.ll() + node.bounds.ur()) * .5f;
+    const glm::vec3 toCenter = center - P;
+    const float distance2 = glm::dot(toCenter, toCenter);
+    const float radius = .5f * glm::length(node.bounds.ur() - node.bounds.ll());
+
+    // Smallest angle to the normal any point in the bounding sphere can
+    // be at, the lights can be anywhere if P is inside it
+    float cosBound = 1.f;
+    if (distance2 > radius * radius)
+    {
+        const float distance = sqrtf(distance2);
+        const float cosTheta = glm::dot(N, toCenter) / distance;
+        const float sinU = radius / distance;
+        const float cosU = sqrtf(1.f - sinU * sinU);
+        if (cosTheta < cosU)
+        {
+            const float sinTheta = sqrtf(std::max(0.f, 1.f - cosTheta * cosTheta));
+            cosBound = cosTheta * cosU + sinTheta * sinU;
+            if (cosBound <= 0.f)
+            {
+                return 0.f;
+            }
+        }
+    }
+
+    // Clamped to the bounds' size, lights inside don't all get that close
+    const float distance = std::max(sqrtf(distance2), radius);
+    const float falloff = node.attenuation.x + node.attenuation.y * distance +
+        node.attenuation.z * distance * distance;
+    return node.intensity * cosBound / std::max(falloff, 1e-4f);
+}
@@ -0,0 +1,58 @@
+#ifndef __LIGHT_TREE_H__
+#define __LIGHT_TREE_H__
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "aabbox.h"
+
+class ILight;
+class Noise;
+
+
+// Binary tree over the local lights, each node bounding its lights and
+// summing their intensity. A light is sampled by walking down from the
+// root and picking a child in proportion to its estimated contribution
+// to the shading point, so far away lights and lights below the surface
+// are rarely picked. Nodes are laid out depth first: the first child
+// follows its parent and the second is at secondChild.
+class LightTree
+{
+public:
+    explicit LightTree();
+
+    // Lights that aren't local are skipped
+    void build(const std::vector<ILight*>& lights);
+
+    bool empty() const { return mNodes.empty(); }
+    size_t numLights() const { return mLights.size(); }
+
+    // Picks a light for a shading point at P with the normal N, returns
+    // false if none of them can light it. pdf is the probability of the
+    // light picked.
+    bool sample(Noise& noise, const glm::vec3& P, const glm::vec3& N,
+                const ILight*& light, float& pdf) const;
+
+private:
+    struct Node
+    {
+        AABBox      bounds;         // Of the lights' spheres
+        glm::vec3   attenuation;    // Smallest falloff terms of the lights
+        float       intensity;      // Summed luminance of the lights
+        uint32_t    secondChild;    // Leaves hold one light instead
+        uint32_t    light;
+        bool        isLeaf;
+    };
+
+    LightTree(const LightTree&) = delete;
+    LightTree& operator=(const LightTree&) = delete;
+
+    void build(uint32_t begin, uint32_t end);
+    float importance(const Node& node, const glm::vec3& P, const glm::vec3& N) const;
+
+    std::vector<const ILight*>  mLights;
+    std::vector<Node>           mNodes;
+};
+
+#endif
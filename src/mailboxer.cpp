@@ -17,3 +17,13 @@ Mailboxer::~Mailboxer()
 {
     mMailboxes.clear();
 }
+
+PacketMailboxer::PacketMailboxer(size_t count) :
+    mCurrentPacketId(0),
+    mMailboxes(count, 0)
+{}
+
+PacketMailboxer::~PacketMailboxer()
+{
+    mMailboxes.clear();
+}
@@ -10,6 +10,7 @@
 #define __trichoplax__mailboxer__
 
 #include <vector>
+#include <cstdint>
 #include "aligned_allocator.h"
 
 class Mailboxer
@@ -37,4 +38,31 @@ private:
 };
 
 
+// Mailboxes for packets of up to 16 rays. Each one remembers which rays of
+// the current packet already tested the primitive.
+class PacketMailboxer
+{
+public:
+    explicit PacketMailboxer(size_t count);
+    ~PacketMailboxer();
+    
+    inline void IncrementPacketId()
+    { ++mCurrentPacketId; }
+    
+    inline uint32_t Tested(const size_t& primId) const
+    { return (mMailboxes[primId] >> 16) == mCurrentPacketId ? (uint32_t)(mMailboxes[primId] & 0xffff) : 0; }
+    
+    inline void Mark(const size_t& primId, uint32_t rayMask)
+    { mMailboxes[primId] = (mCurrentPacketId << 16) | Tested(primId) | rayMask; }
+    
+private:
+    uint64_t                                                mCurrentPacketId;
+    std::vector<uint64_t, AlignedAllocator<uint64_t> >      mMailboxes;
+    
+    /* Not copyable */
+    PacketMailboxer(const PacketMailboxer&) = delete;
+    PacketMailboxer& operator=(const PacketMailboxer&) = delete;
+};
+
+
 #endif /* defined(__trichoplax__mailboxer__) */
@@ -10,6 +10,7 @@
 #include "iparser.h"
 #include "timer.h"
 #include "cl_args.h"
+#include "thread_pool.h"
 
 struct Args
 {
@@ -18,10 +19,16 @@ struct Args
     std::string sceneFile;
     std::string outputImage;
     std::string envSphere;
+    std::string accelerator;
+    std::string kdTreeCache;
+    std::string tileOrder;
+    std::string integrator;
 
     uint32_t width;
     uint32_t height;
     uint32_t maxThreads;
+    bool binnedKdTree;
+    bool rebuildKdTree;
 
     Scene::RenderSettings renderSettings;
 };
@@ -30,9 +37,15 @@ Args::Args()
     : sceneFile()
     , outputImage()
     , envSphere()
+    , accelerator("kdtree")
+    , kdTreeCache()
+    , tileOrder("hilbert")
+    , integrator("splitting")
     , width(0)
     , height(0)
     , maxThreads(std::numeric_limits<uint32_t>::max())
+    , binnedKdTree(false)
+    , rebuildKdTree(false)
     , renderSettings()
 {
 }
@@ -48,9 +61,30 @@ Args parseArgs(int argc, char** argv)
     argParser.RegisterArg("-height", &args.height, args.height);
     argParser.RegisterArg("-maxDepth", &args.renderSettings.maxDepth, args.renderSettings.maxDepth);
     argParser.RegisterArg("-giSamples", &args.renderSettings.GISamples, args.renderSettings.GISamples);
+    argParser.RegisterArg("-integrator", &args.integrator, args.integrator);
+    argParser.RegisterArg("-rouletteDepth", &args.renderSettings.rouletteDepth, args.renderSettings.rouletteDepth);
     argParser.RegisterArg("-bias", &args.renderSettings.bias, args.renderSettings.bias);
     argParser.RegisterArg("-lightRadius", &args.renderSettings.lightRadius, args.renderSettings.lightRadius);
+    argParser.RegisterArg("-tileSize", &args.renderSettings.tileSize, args.renderSettings.tileSize);
+    argParser.RegisterArg("-tileOrder", &args.tileOrder, args.tileOrder);
+    argParser.RegisterArg("-spp", &args.renderSettings.targetSamples, args.renderSettings.targetSamples);
+    argParser.RegisterArg("-timeBudget", &args.renderSettings.timeBudget, args.renderSettings.timeBudget);
+    argParser.RegisterArg("-writeInterval", &args.renderSettings.writeInterval, args.renderSettings.writeInterval);
+    argParser.RegisterArg("-minSpp", &args.renderSettings.minSamples, args.renderSettings.minSamples);
+    argParser.RegisterArg("-maxSpp", &args.renderSettings.maxSamples, args.renderSettings.maxSamples);
+    argParser.RegisterArg("-adaptiveThreshold", &args.renderSettings.adaptiveThreshold, args.renderSettings.adaptiveThreshold);
+    argParser.RegisterArg("-irradianceCache", &args.renderSettings.irradianceCacheError, args.renderSettings.irradianceCacheError);
+    argParser.RegisterArg("-irradianceSamples", &args.renderSettings.irradianceCacheSamples, args.renderSettings.irradianceCacheSamples);
+    argParser.RegisterArg("-irradiancePrepass", &args.renderSettings.irradianceCachePrepass, args.renderSettings.irradianceCachePrepass);
+    argParser.RegisterArg("-photons", &args.renderSettings.photons, args.renderSettings.photons);
+    argParser.RegisterArg("-photonLookup", &args.renderSettings.photonLookup, args.renderSettings.photonLookup);
+    argParser.RegisterArg("-emissiveSamples", &args.renderSettings.emissiveSamples, args.renderSettings.emissiveSamples);
+    argParser.RegisterArg("-lightsPerHit", &args.renderSettings.lightsPerHit, args.renderSettings.lightsPerHit);
     argParser.RegisterArg("-maxThreads", &args.maxThreads, args.maxThreads);
+    argParser.RegisterArg("-binnedKdTree", &args.binnedKdTree, args.binnedKdTree);
+    argParser.RegisterArg("-accelerator", &args.accelerator, args.accelerator);
+    argParser.RegisterArg("-kdTreeCache", &args.kdTreeCache, args.kdTreeCache);
+    argParser.RegisterArg("-rebuildKdTree", &args.rebuildKdTree, args.rebuildKdTree);
     
     std::vector<std::string> extraArgs;
     try
@@ -81,7 +115,77 @@ void applyCLArgs(const Args& args, Scene& scene)
     scene.setBias(args.renderSettings.bias);
     scene.setNumGISamples(args.renderSettings.GISamples);
     scene.setMaxDepth(args.renderSettings.maxDepth);
+    scene.setRouletteDepth(args.renderSettings.rouletteDepth);
     scene.setLightRadius(args.renderSettings.lightRadius);
+    scene.setTileSize(args.renderSettings.tileSize);
+    scene.setTargetSamples(args.renderSettings.targetSamples);
+    scene.setTimeBudget(args.renderSettings.timeBudget);
+    scene.setWriteInterval(args.renderSettings.writeInterval);
+    scene.setAdaptiveSampling(args.renderSettings.minSamples, args.renderSettings.maxSamples,
+                              args.renderSettings.adaptiveThreshold);
+    scene.setIrradianceCache(args.renderSettings.irradianceCacheError,
+                             args.renderSettings.irradianceCacheSamples,
+                             args.renderSettings.irradianceCachePrepass);
+    scene.setPhotonMap(args.renderSettings.photons, args.renderSettings.photonLookup);
+    scene.setEmissiveSamples(args.renderSettings.emissiveSamples);
+    scene.setLightsPerHit(args.renderSettings.lightsPerHit);
+    scene.setKdTreeBuildMode(args.binnedKdTree ? KdTree::SAH_BINNED : KdTree::SAH_EXACT);
+    scene.setKdTreeCache(args.kdTreeCache, args.rebuildKdTree);
+
+    if (args.accelerator == "kdtree")
+    {
+        scene.setAccelerator(Scene::ACCEL_KDTREE);
+    }
+    else if (args.accelerator == "bvh")
+    {
+        scene.setAccelerator(Scene::ACCEL_BVH);
+    }
+    else if (args.accelerator == "bvh4")
+    {
+        scene.setAccelerator(Scene::ACCEL_BVH4);
+    }
+    else if (args.accelerator == "bvh8")
+    {
+        scene.setAccelerator(Scene::ACCEL_BVH8);
+    }
+    else
+    {
+        throw std::invalid_argument("Unknown accelerator: " + args.accelerator);
+    }
+
+    if (args.tileOrder == "scanline")
+    {
+        scene.setTileOrder(Sampler::TILES_SCANLINE);
+    }
+    else if (args.tileOrder == "morton")
+    {
+        scene.setTileOrder(Sampler::TILES_MORTON);
+    }
+    else if (args.tileOrder == "hilbert")
+    {
+        scene.setTileOrder(Sampler::TILES_HILBERT);
+    }
+    else if (args.tileOrder == "spiral")
+    {
+        scene.setTileOrder(Sampler::TILES_SPIRAL);
+    }
+    else
+    {
+        throw std::invalid_argument("Unknown tile order: " + args.tileOrder);
+    }
+
+    if (args.integrator == "splitting")
+    {
+        scene.setIntegrator(Scene::INTEGRATOR_SPLITTING);
+    }
+    else if (args.integrator == "path")
+    {
+        scene.setIntegrator(Scene::INTEGRATOR_PATH);
+    }
+    else
+    {
+        throw std::invalid_argument("Unknown integrator: " + args.integrator);
+    }
 
     if (!args.envSphere.empty())
     {
@@ -104,6 +208,7 @@ int main(int argc, char** argv)
     Args clArgs = parseArgs(argc, argv);
 
     FreeImage_Initialise();
+    ThreadPool::create(clArgs.maxThreads);
     Scene::create();
     applyCLArgs(clArgs, Scene::instance());
 
@@ -121,6 +226,7 @@ int main(int argc, char** argv)
         catch (...)
         {
             Scene::destroy();
+            ThreadPool::destroy();
             throw;
         }
 
@@ -131,6 +237,7 @@ int main(int argc, char** argv)
         
         std::cout << "Scene load time: "
             << loadTimer.elapsedToString(loadTimer.elapsed()) << std::endl;
+        Scene::instance().printLoadStats();
     }
 
     // Override the output image size if set on the CL
@@ -140,8 +247,9 @@ int main(int argc, char** argv)
     }
 
     Scene::instance().prepareForRendering();
-    Scene::instance().render(clArgs.outputImage, clArgs.maxThreads);
+    Scene::instance().render(clArgs.outputImage);
     Scene::destroy();
+    ThreadPool::destroy();
     
     FreeImage_DeInitialise();
 	
@@ -1,9 +1,13 @@
 #include <cmath>
+#include <cstring>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 #include "material.h"
 #include "scene.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "multi_sample_ray.h"
 #include "ilight.h"
 #include "common.h"
@@ -12,6 +16,10 @@
 #include "noise.h"
 #include "isampler.h"
 #include "sampler_info.h"
+#include "sampler_utils.h"
+#include "emissive_lights.h"
+#include "irradiance_cache.h"
+#include "triangle.h"
 
 
 namespace
@@ -25,6 +33,13 @@ inline glm::vec3 computeSurfaceLighting(const Ray& ray, const Hit& hit, const BR
     return result;
 }
 
+// Veach's power heuristic, weighs the strategy with density a against one
+// with density b. Densities include the number of samples taken.
+inline float powerHeuristic(float a, float b)
+{
+    return (a * a) / (a * a + b * b);
+}
+
 } // anonymous namespace
 
 
@@ -46,6 +61,33 @@ Material::Material(const Material& other)
 {
 }
 
+size_t Material::hash() const
+{
+    const float values[] = {
+        mBrdf.Kd().x, mBrdf.Kd().y, mBrdf.Kd().z,
+        mBrdf.Ka().x, mBrdf.Ka().y, mBrdf.Ka().z,
+        mBrdf.Ke().x, mBrdf.Ke().y, mBrdf.Ke().z,
+        mBrdf.Kt().x, mBrdf.Kt().y, mBrdf.Kt().z,
+        mBrdf.Kr(), mBrdf.IOR(), mBrdf.roughness()
+    };
+
+    // FNV-1a over the values' bits, with -0 folded into 0 since they
+    // compare equal
+    uint64_t hash = 14695981039346656037ull;
+    for (float value : values)
+    {
+        value += 0.f;
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            hash = (hash ^ ((bits >> (i * 8)) & 0xff)) * 1099511628211ull;
+        }
+    }
+
+    return (size_t)hash;
+}
+
 glm::vec4 Material::shadeRay(const Raytracer& tracer, const Ray& r) const
 {
     glm::vec4 result(0.f);
@@ -53,17 +95,91 @@ glm::vec4 Material::shadeRay(const Raytracer& tracer, const Ray& r) const
     const Scene& scene = Scene::instance();
     const Hit hit(r);
 
+    // Final gather, the photons stand in for the direct and indirect light
+    // wherever GI rays land
+    if (r.type() == Ray::GI && tracer.hasPhotonMap())
+    {
+        result += glm::vec4(tracer.photonIrradiance(hit) * mBrdf.Kd() * INV_PI, 0.f);
+        if (!VEC3_IS_REL_ZERO(mBrdf.Ke()))
+        {
+            result += glm::vec4(mBrdf.Ke() * emissionWeight(r), 0.f);
+        }
+        result.a = 1.f;
+        return result;
+    }
+
     glm::vec3 directLighting(0.f);
     const bool hasSpecLobe = mBrdf.roughness() < .998f;
-    for (Scene::ConstLightIter it = scene.lightsBegin(); it != scene.lightsEnd(); ++it)
+    const LightTree& lightTree = scene.lightTree();
+    if (lightTree.empty())
+    {
+        for (Scene::ConstLightIter it = scene.lightsBegin(); it != scene.lightsEnd(); ++it)
+        {
+            directLighting += sampleLight(**it, hit, tracer, r.depth(), hasSpecLobe);
+        }
+    }
+    else
+    {
+        for (Scene::ConstLightIter it = scene.distantLightsBegin(); it != scene.distantLightsEnd(); ++it)
+        {
+            directLighting += sampleLight(**it, hit, tracer, r.depth(), hasSpecLobe);
+        }
+
+        // A few local lights picked by their estimated contribution, each
+        // weighed by the odds of picking it
+        const unsigned lightsPerHit = scene.renderSettings().lightsPerHit;
+        glm::vec3 localLighting(0.f);
+        for (unsigned i = 0; i < lightsPerHit; ++i)
+        {
+            const ILight* light;
+            float pdf;
+            if (lightTree.sample(tracer.getNoiseGenerator(), hit.P, hit.N, light, pdf))
+            {
+                localLighting += sampleLight(*light, hit, tracer, r.depth(), hasSpecLobe) / pdf;
+            }
+        }
+        directLighting += localLighting / (float)lightsPerHit;
+    }
+
+    // The GI rays this hit shoots, they find the emissive triangles too
+    const Scene::RenderSettings& settings = scene.renderSettings();
+    unsigned giRays = 0;
+    if (r.depth() < tracer.maxDepth())
+    {
+        if (r.type() == Ray::PRIMARY && tracer.hasIrradianceCache())
+        {
+            giRays = tracer.irradianceCache().numSamples();
+        }
+        else
+        {
+            giRays = settings.integrator == Scene::INTEGRATOR_PATH ? 1 : settings.GISamples;
+        }
+    }
+
+    const EmissiveLights& emitters = scene.emissiveLights();
+    if (!emitters.empty() && settings.emissiveSamples > 0 && !VEC3_IS_REL_ZERO(mBrdf.Kd()))
     {
-        directLighting += sampleLight(**it, hit, tracer, r.depth(), hasSpecLobe);
+        directLighting += sampleEmissive(emitters, hit, tracer, r.depth(), giRays);
     }
 
     directLighting *= 1.f / PI;
     result += glm::vec4(directLighting * mBrdf.Kd(), 0.f);
 
-    if (r.depth() < tracer.maxDepth() && scene.renderSettings().GISamples > 0)
+    if (r.depth() < tracer.maxDepth() && r.type() == Ray::PRIMARY && tracer.hasIrradianceCache())
+    {
+        // Irradiance is PI times the cosine weighted mean of the incoming
+        // radiance, the diffuse BRDF divides it out again
+        if (!VEC3_IS_REL_ZERO(mBrdf.Kd()))
+        {
+            result += glm::vec4(tracer.irradiance(hit, r.depth()) * mBrdf.Kd() * INV_PI, 0.f);
+        }
+    }
+    else if (r.depth() < tracer.maxDepth() &&
+             scene.renderSettings().integrator == Scene::INTEGRATOR_PATH)
+    {
+        result += glm::vec4(continuePath(tracer, r, hit), 0.f);
+    }
+    else if (r.depth() < tracer.maxDepth() && scene.renderSettings().GISamples > 0)
     {
         glm::vec3 giRadiance(0.f);
 
@@ -80,23 +196,99 @@ glm::vec4 Material::shadeRay(const Raytracer& tracer, const Ray& r) const
             const glm::vec3& giSample = noiseGen.getGISample(seqNumber, i);
             giRay.setDir(hit.toWorld(giSample));
             giRay.setMaxDistance(std::numeric_limits<float>::max());
+            giRay.setSampleDensity(scene.renderSettings().GISamples * giSample.z * INV_PI);
 
+            // The samples are cosine weighted, which cancels the cosine
+            // and 1 / PI of the diffuse BRDF, same as continuePath()
             glm::vec4 rayResult;
             tracer.traceAndShade(giRay, rayResult);
-            giRadiance.r += rayResult.r * giSample.z;
-            giRadiance.g += rayResult.g * giSample.z;
-            giRadiance.b += rayResult.b * giSample.z;
+            giRadiance.r += rayResult.r;
+            giRadiance.g += rayResult.g;
+            giRadiance.b += rayResult.b;
         }
         giRadiance = giRadiance / static_cast<float>(scene.renderSettings().GISamples);
 
         result += glm::vec4(giRadiance * mBrdf.Kd(), 0.f);
     }
 
-    result += glm::vec4(mBrdf.Ke(), 0.f);
+    // Only emitters are weighed, it looks their density up
+    if (!VEC3_IS_REL_ZERO(mBrdf.Ke()))
+    {
+        result += glm::vec4(mBrdf.Ke() * emissionWeight(r), 0.f);
+    }
     result.a = 1.f;
     return result;
 }
 
+float Material::emissionWeight(const Ray& r) const
+{
+    const Scene& scene = Scene::instance();
+    const EmissiveLights& emitters = scene.emissiveLights();
+    const unsigned numSamples = scene.renderSettings().emissiveSamples;
+    if (r.sampleDensity() <= 0.f || numSamples == 0 || emitters.empty())
+    {
+        return 1.f;
+    }
+
+    // Light sampling from where the ray started could have picked this
+    // point too, unless it's the back of the triangle
+    const float cosLight = -glm::dot(r.dir(), r.hitPrimitive()->normal());
+    if (cosLight <= 0.f)
+    {
+        return 1.f;
+    }
+
+    const float t = r.maxT();
+    const float lightDensity = numSamples * emitters.pdf(*r.hitPrimitive()) * t * t / cosLight;
+    return powerHeuristic(r.sampleDensity(), lightDensity);
+}
+
+glm::vec3 Material::continuePath(const Raytracer& tracer, const Ray& r, const Hit& hit) const
+{
+    const Scene::RenderSettings& settings = Scene::instance().renderSettings();
+    Noise& noiseGen = tracer.getNoiseGenerator();
+
+    // The bounce is sampled proportional to the cosine, which cancels the
+    // cosine and 1 / PI of the diffuse BRDF and leaves Kd as its weight
+    glm::vec3 weight = mBrdf.Kd();
+    glm::vec3 throughput = r.throughput() * weight;
+    const float maxThroughput = std::max(throughput.r, std::max(throughput.g, throughput.b));
+    if (maxThroughput <= 0.f)
+    {
+        return glm::vec3(0.f);
+    }
+
+    // Past the first few bounces a path survives with a probability that
+    // follows its throughput, survivors are weighted up to stay unbiased
+    if (r.depth() > settings.rouletteDepth)
+    {
+        const float survival = std::min(maxThroughput, .95f);
+        if (noiseGen.generateNormalizedFloat() >= survival)
+        {
+            return glm::vec3(0.f);
+        }
+
+        weight /= survival;
+        throughput /= survival;
+    }
+
+    const glm::vec2 sample(noiseGen.generateNormalizedFloat(), noiseGen.generateNormalizedFloat());
+    const glm::vec3 dir = cosineSampleHemisphere(sample);
+
+    Ray pathRay(Ray::GI);
+    pathRay.setDepth(r.depth() + 1);
+    pathRay.setOrigin(hit.P);
+    pathRay.bias(settings.bias);
+    pathRay.shouldHitBackFaces(false);
+    pathRay.setDir(hit.toWorld(dir));
+    pathRay.setThroughput(throughput);
+    pathRay.setSampleDensity(dir.z * INV_PI);
+
+    glm::vec4 radiance(0.f);
+    tracer.traceAndShade(pathRay, radiance);
+    return glm::vec3(radiance) * weight;
+}
+
 glm::vec3 Material::sampleLight(const ILight& light, const Hit& hit,
                                 const Raytracer& tracer,
                                 unsigned rayDepth,
@@ -117,7 +309,21 @@ glm::vec3 Material::sampleLight(const ILight& light, const Hit& hit,
     shadowRay.setDepth(rayDepth);
     shadowRay.setOrigin(hit.P);
     shadowRay.bias(light.bias());
-    ISampler* lightSampler = light.generateSamplerForPoint(hit.P);
+    ScratchArena& scratch = tracer.scratch();
+    const ScratchArena::Marker scratchMarker = scratch.mark();
+    const ISampler* lightSampler = light.generateSamplerForPoint(hit.P, scratch);
+
+    // Rays toward one light are coherent, trace them in packets
+    Ray* shadowRays = scratch.allocateArray<Ray>(RayPacket::MAX_RAYS);
+    unsigned numShadowRays = 0;
+    float nDotLs[RayPacket::MAX_RAYS];
+
+    // The second pass only runs if the first one's rays disagree, points
+    // that aren't in a penumbra are either fully lit or fully occluded
+    const unsigned secondPassRays = light.secondPassShadowRays();
+    unsigned numLit = 0;
+    unsigned numOccluded = 0;
+    bool skippedSecondPass = false;
 
     do
     {
@@ -125,21 +331,121 @@ glm::vec3 Material::sampleLight(const ILight& light, const Hit& hit,
         --shadowRay;
 
         float nDotL = glm::dot(hit.N, shadowRay.dir());
-        if (nDotL <= 0.f)
+        if (nDotL > 0.f)
         {
-            continue;
+            nDotLs[numShadowRays] = nDotL;
+            new (&shadowRays[numShadowRays++]) Ray(shadowRay);
         }
 
-        if (tracer.traceShadow(shadowRay))
+        const bool endOfFirstPass = secondPassRays > 0 && shadowRay.currentSample() == secondPassRays;
+        if (numShadowRays == RayPacket::MAX_RAYS ||
+            ((!shadowRay.currentSample() || endOfFirstPass) && numShadowRays > 0))
         {
-            continue;
+            RayPacket packet;
+            for (unsigned i = 0; i < numShadowRays; ++i)
+            {
+                packet.add(shadowRays[i]);
+            }
+
+            const uint32_t occludedMask = tracer.traceShadow(packet, ShadowTarget(light));
+            for (uint32_t i = 0; i < packet.size(); ++i)
+            {
+                if ((occludedMask >> i) & 1)
+                {
+                    ++numOccluded;
+                    continue;
+                }
+
+                ++numLit;
+                result += computeSurfaceLighting(
+                        packet[i], hit, mBrdf, lightColor, nDotLs[i], hasSpecLobe);
+            }
+
+            numShadowRays = 0;
         }
 
-        result += computeSurfaceLighting(
-                shadowRay, hit, mBrdf, lightColor, nDotL, hasSpecLobe);
+        if (endOfFirstPass)
+        {
+            skippedSecondPass = numLit == 0 || numOccluded == 0;
+            tracer.countShadowFirstPass(skippedSecondPass);
+            if (skippedSecondPass)
+            {
+                break;
+            }
+        }
     } while (shadowRay.currentSample());
 
-    delete lightSampler;
-    return result / (float)light.shadowRays();
+    scratch.release(scratchMarker);
+    return result / (float)(skippedSecondPass ? light.firstPassShadowRays() : light.shadowRays());
 }
 
+
+glm::vec3 Material::sampleEmissive(const EmissiveLights& emitters, const Hit& hit,
+                                   const Raytracer& tracer, unsigned rayDepth,
+                                   unsigned giRays) const
+{
+    const Scene::RenderSettings& settings = Scene::instance().renderSettings();
+    const unsigned numSamples = settings.emissiveSamples;
+    Noise& noiseGen = tracer.getNoiseGenerator();
+
+    // Shadow rays are traced in packets like the ones of the other lights,
+    // they start at the same point at least
+    ScratchArena& scratch = tracer.scratch();
+    const ScratchArena::Marker scratchMarker = scratch.mark();
+    Ray* shadowRays = scratch.allocateArray<Ray>(RayPacket::MAX_RAYS);
+    unsigned numShadowRays = 0;
+    glm::vec3 contributions[RayPacket::MAX_RAYS];
+
+    glm::vec3 result(0.f);
+    for (unsigned i = 0; i < numSamples; ++i)
+    {
+        EmissiveLights::Sample sample;
+        emitters.sample(noiseGen, sample);
+
+        const glm::vec3 toLight = sample.P - hit.P;
+        const float distance2 = glm::dot(toLight, toLight);
+        const float distance = sqrtf(distance2);
+        const glm::vec3 dir = toLight / distance;
+
+        const float nDotL = glm::dot(hit.N, dir);
+        const float cosLight = -glm::dot(dir, sample.triangle->normal());
+        if (nDotL > 0.f && cosLight > 0.f)
+        {
+            // Per solid angle, like the density of the GI rays
+            const float lightDensity = sample.pdf * distance2 / cosLight;
+            const float weight = giRays > 0 ?
+                powerHeuristic(numSamples * lightDensity, giRays * nDotL * INV_PI) : 1.f;
+
+            contributions[numShadowRays] = sample.Ke * (nDotL * weight / lightDensity);
+            Ray& shadowRay = *new (&shadowRays[numShadowRays++]) Ray(Ray::SHADOW);
+            shadowRay.setDepth(rayDepth);
+            shadowRay.setOrigin(hit.P);
+            shadowRay.setDir(dir);
+            shadowRay.bias(settings.bias);
+            shadowRay.setMaxDistance(distance - settings.bias);
+        }
+
+        if (numShadowRays == RayPacket::MAX_RAYS || (i + 1 == numSamples && numShadowRays > 0))
+        {
+            RayPacket packet;
+            for (unsigned j = 0; j < numShadowRays; ++j)
+            {
+                packet.add(shadowRays[j]);
+            }
+
+            const uint32_t occludedMask = tracer.traceShadow(packet, ShadowTarget(emitters));
+            for (uint32_t j = 0; j < packet.size(); ++j)
+            {
+                if (!((occludedMask >> j) & 1))
+                {
+                    result += contributions[j];
+                }
+            }
+
+            numShadowRays = 0;
+        }
+    }
+
+    scratch.release(scratchMarker);
+    return result / (float)numSamples;
+}
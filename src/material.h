@@ -10,6 +10,7 @@ class Ray;
 class Raytracer;
 class ILight;
 class Hit;
+class EmissiveLights;
 
 
 class Material {
@@ -19,6 +20,11 @@ public:
                       const glm::vec3& Kd, const glm::vec3& Kt,
                       float Kr, float roughness, float ior);
     Material* clone() const;
+
+    // By value, so parsers can share one material between the primitives
+    // that were given the same parameters
+    bool operator==(const Material& rhs) const { return mBrdf == rhs.mBrdf; }
+    size_t hash() const;
     
     void setAmbient(const glm::vec3& Ka);
     void setEmissive(const glm::vec3& Ke);
@@ -28,6 +34,9 @@ public:
     void setRoughness(float roughness);
     void setIor(float Ior);
     
+    const glm::vec3& diffuse() const { return mBrdf.Kd(); }
+    const glm::vec3& emissive() const { return mBrdf.Ke(); }
+
     glm::vec4 shadeRay(const Raytracer& tracer, const Ray& r) const;
     
 private:
@@ -35,6 +44,10 @@ private:
 
     glm::vec3 sampleLight(const ILight& light, const Hit& hit,
                           const Raytracer& tracer, unsigned rayDepth, bool hasSpecLobe) const;
+    glm::vec3 sampleEmissive(const EmissiveLights& emitters, const Hit& hit, const Raytracer& tracer,
+                             unsigned rayDepth, unsigned giRays) const;
+    float emissionWeight(const Ray& r) const;
+    glm::vec3 continuePath(const Raytracer& tracer, const Ray& r, const Hit& hit) const;
     
     BRDF mBrdf;
 };
@@ -7,8 +7,9 @@
 
 #include <glm/glm.hpp>
 
-Mesh::Mesh(unsigned numberOfVerticies)
+Mesh::Mesh(unsigned numberOfVerticies, unsigned numberOfTriangles)
     : mVertices(nullptr)
+    , mTriangles(numberOfTriangles)
     , mPrimitives()
     , mNumVerts(numberOfVerticies)
     , mCurrentVertexIdx(0)
@@ -17,15 +18,12 @@ Mesh::Mesh(unsigned numberOfVerticies)
     {
         mVertices = new Vertex[mNumVerts];
     }
+
+    mPrimitives.reserve(numberOfTriangles);
 }
 
 Mesh::~Mesh()
 {
-    for (Triangle* prim : mPrimitives)
-    {
-        delete prim;
-    }
-
     delete [] mVertices;
     mVertices = nullptr;
 }
@@ -37,9 +35,10 @@ void Mesh::addPrimitive(unsigned indexA, unsigned indexB, unsigned indexC, Mater
         return;
     }
 
-    Triangle* newTri = new Triangle(&mVertices[indexA], &mVertices[indexB], &mVertices[indexC], material);
-
-    const AABBox bounds = newTri->bounds();
+    // Checked before the triangle is made, the pool can't give slots back
+    AABBox bounds(mVertices[indexA].position, mVertices[indexA].position);
+    bounds.encompass(mVertices[indexB].position);
+    bounds.encompass(mVertices[indexC].position);
     unsigned flatCount = 0;
     for (unsigned i = 0; i < 3; ++i)
     {
@@ -48,10 +47,10 @@ void Mesh::addPrimitive(unsigned indexA, unsigned indexB, unsigned indexC, Mater
 
     if (flatCount > 1)
     {
-        delete newTri;
         return;
     }
-    
+
+    Triangle* newTri = mTriangles.create(&mVertices[indexA], &mVertices[indexB], &mVertices[indexC], material);
     mPrimitives.emplace_back(newTri);
 }
 
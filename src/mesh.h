@@ -3,7 +3,9 @@
 #include <vector>
 #include <glm/glm.hpp>
 
-class Triangle;
+#include "bucket_pool.h"
+#include "triangle.h"
+
 class Material;
 class Vertex;
 
@@ -15,7 +17,8 @@ private:
 public:
     typedef PrimitivesArray::const_iterator ConstPrimIterator;
 
-    Mesh(unsigned numberOfVerticies);
+    // The triangles are allocated up front as well, more can be added
+    Mesh(unsigned numberOfVerticies, unsigned numberOfTriangles);
     ~Mesh();
 
     void addVertex(const glm::vec3& position, const glm::vec3& normal, const glm::vec2& uv);
@@ -24,9 +27,12 @@ public:
     ConstPrimIterator begin() const { return mPrimitives.begin(); }
     ConstPrimIterator end() const   { return mPrimitives.end(); }
 
+    const BucketAllocator& triangleAllocator() const { return mTriangles.allocator(); }
+
 private:
-    Vertex*         mVertices;
-    PrimitivesArray mPrimitives;
-    unsigned        mNumVerts;
-    unsigned        mCurrentVertexIdx;
+    Vertex*                 mVertices;
+    BucketPool<Triangle>    mTriangles;     // Contiguous, in the order they're added
+    PrimitivesArray         mPrimitives;
+    unsigned                mNumVerts;
+    unsigned                mCurrentVertexIdx;
 };
@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "photon_map.h"
+#include "raytracer.h"
+#include "ray.h"
+#include "hit.h"
+#include "ilight.h"
+#include "material.h"
+#include "noise.h"
+#include "scene.h"
+#include "sampler_utils.h"
+#include "thread_pool.h"
+#include "common.h"
+
+// Subtrees with fewer photons than this are always built on the calling thread
+#define PARALLEL_BUILD_MIN_PHOTONS (16384)
+
+
+PhotonMap::PhotonMap(const AABBox& sceneBounds, uint32_t lookupSize)
+    : mSceneBounds(sceneBounds)
+    , mLookupSize(glm::clamp(lookupSize, 1u, (uint32_t)PHOTON_MAP_MAX_LOOKUP))
+    , mMaxRadius(PHOTON_MAP_MAX_RADIUS * glm::length(sceneBounds.ur() - sceneBounds.ll()))
+    , mPhotons()
+{
+}
+
+void PhotonMap::shoot(const Raytracer& tracer, const ILight& light, uint32_t numPhotons,
+                      uint32_t totalPhotons, std::vector<Photon>& photons) const
+{
+    const float bias = Scene::instance().renderSettings().bias;
+    const glm::vec3 photonPower = light.power(mSceneBounds) / (float)totalPhotons;
+    Noise& noiseGen = tracer.getNoiseGenerator();
+
+    Ray photonRay(Ray::PHOTON);
+    for (uint32_t i = 0; i < numPhotons; ++i)
+    {
+        light.emitPhoton(noiseGen, mSceneBounds, photonRay);
+        photonRay.bias(light.bias());
+        photonRay.setMaxDistance(std::numeric_limits<float>::max());
+
+        glm::vec3 power = photonPower;
+        for (unsigned bounce = 0; bounce < PHOTON_MAP_MAX_BOUNCES; ++bounce)
+        {
+            if (!tracer.intersect(photonRay))
+            {
+                break;
+            }
+
+            const Hit hit(photonRay);
+            if (bounce == 0)
+            {
+                light.attenuatePhoton(hit.P, power);
+            }
+
+            const glm::vec3& Kd = photonRay.hitPrimitive()->material().diffuse();
+            if (VEC3_IS_REL_ZERO(Kd))
+            {
+                break;
+            }
+
+            photons.push_back({ hit.P, power, photonRay.dir(), 0 });
+
+            // Russian roulette on the reflectance, the photons that survive
+            // keep their power per channel in proportion to the albedo
+            const float reflectance = std::min(1.f, std::max(Kd.r, std::max(Kd.g, Kd.b)));
+            if (noiseGen.generateNormalizedFloat() >= reflectance)
+            {
+                break;
+            }
+            power *= Kd / reflectance;
+
+            const glm::vec2 sample(noiseGen.generateNormalizedFloat(), noiseGen.generateNormalizedFloat());
+            photonRay.setOrigin(hit.P);
+            photonRay.setDir(hit.toWorld(cosineSampleHemisphere(sample)));
+            photonRay.bias(bias);
+            photonRay.setMaxDistance(std::numeric_limits<float>::max());
+        }
+    }
+}
+
+void PhotonMap::build(std::vector<Photon>& photons)
+{
+    mPhotons.swap(photons);
+    build(0, (uint32_t)mPhotons.size());
+}
+
+void PhotonMap::build(uint32_t begin, uint32_t end)
+{
+    if (end - begin <= 1)
+    {
+        return;
+    }
+
+    AABBox bounds(mPhotons[begin].position, mPhotons[begin].position);
+    for (uint32_t i = begin + 1; i < end; ++i)
+    {
+        bounds.encompass(mPhotons[i].position);
+    }
+
+    const uint32_t axis = (uint32_t)bounds.longestAxis();
+    const uint32_t middle = begin + (end - begin) / 2;
+    std::nth_element(mPhotons.begin() + begin, mPhotons.begin() + middle, mPhotons.begin() + end,
+                     [axis](const Photon& a, const Photon& b)
+                     {
+                         return a.position[axis] < b.position[axis];
+                     });
+    mPhotons[middle].axis = axis;
+
+    if (end - begin >= PARALLEL_BUILD_MIN_PHOTONS)
+    {
+        // The two halves don't overlap, build one as a task of its own
+        TaskGroup tasks;
+        tasks.run([this, begin, middle]()
+        {
+            build(begin, middle);
+        });
+
+        build(middle + 1, end);
+        tasks.wait();
+    }
+    else
+    {
+        build(begin, middle);
+        build(middle + 1, end);
+    }
+}
+
+glm::vec3 PhotonMap::irradiance(const glm::vec3& P, const glm::vec3& N) const
+{
+    if (mPhotons.empty())
+    {
+        return glm::vec3(0.f);
+    }
+
+    Neighbors neighbors;
+    neighbors.size = 0;
+    neighbors.maxDistance2 = mMaxRadius * mMaxRadius;
+    locate(0, (uint32_t)mPhotons.size(), P, neighbors);
+
+    glm::vec3 power(0.f);
+    for (uint32_t i = 0; i < neighbors.size; ++i)
+    {
+        const Photon& photon = mPhotons[neighbors.items[i].photon];
+        if (glm::dot(photon.direction, N) < 0.f)
+        {
+            power += photon.power;
+        }
+    }
+
+    // Spread over the disk reaching out to the furthest photon, or the max
+    // radius if fewer were found
+    return power / (PI * neighbors.maxDistance2);
+}
+
+void PhotonMap::locate(uint32_t begin, uint32_t end, const glm::vec3& P, Neighbors& neighbors) const
+{
+    if (begin >= end)
+    {
+        return;
+    }
+
+    const uint32_t middle = begin + (end - begin) / 2;
+    const Photon& photon = mPhotons[middle];
+
+    // The side P is on first, the search radius is smaller once the other
+    // one is checked
+    const float delta = P[photon.axis] - photon.position[photon.axis];
+    if (delta < 0.f)
+    {
+        locate(begin, middle, P, neighbors);
+        if (delta * delta < neighbors.maxDistance2)
+        {
+            locate(middle + 1, end, P, neighbors);
+        }
+    }
+    else
+    {
+        locate(middle + 1, end, P, neighbors);
+        if (delta * delta < neighbors.maxDistance2)
+        {
+            locate(begin, middle, P, neighbors);
+        }
+    }
+
+    const glm::vec3 offset = photon.position - P;
+    const float distance2 = glm::dot(offset, offset);
+    if (distance2 < neighbors.maxDistance2)
+    {
+        addNeighbor(middle, distance2, neighbors);
+    }
+}
+
+void PhotonMap::addNeighbor(uint32_t photonIdx, float distance2, Neighbors& neighbors) const
+{
+    const auto furthestFirst = [](const Neighbor& a, const Neighbor& b)
+    {
+        return a.distance2 < b.distance2;
+    };
+
+    Neighbor* const items = neighbors.items;
+    if (neighbors.size < mLookupSize)
+    {
+        items[neighbors.size++] = { distance2, photonIdx };
+        if (neighbors.size == mLookupSize)
+        {
+            std::make_heap(items, items + neighbors.size, furthestFirst);
+            neighbors.maxDistance2 = items[0].distance2;
+        }
+        return;
+    }
+
+    std::pop_heap(items, items + neighbors.size, furthestFirst);
+    items[neighbors.size - 1] = { distance2, photonIdx };
+    std::push_heap(items, items + neighbors.size, furthestFirst);
+    neighbors.maxDistance2 = items[0].distance2;
+}
@@ -0,0 +1,88 @@
+#ifndef __PHOTON_MAP_H__
+#define __PHOTON_MAP_H__
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "aabbox.h"
+
+class Raytracer;
+class ILight;
+
+// Most photons a radiance estimate gathers
+#define PHOTON_MAP_MAX_LOOKUP (256)
+
+// Photons further away than this fraction of the scene's diagonal are never
+// gathered
+#define PHOTON_MAP_MAX_RADIUS (0.05f)
+
+// Photons are followed for this many bounces at most, Russian roulette
+// usually ends them well before
+#define PHOTON_MAP_MAX_BOUNCES (8)
+
+
+// Photons shot from the lights, stored wherever they land on a diffuse
+// surface. They are kept in a balanced kd-tree laid out in a flat array:
+// a range's median photon is the root of its subtree and the photons
+// before and after it are its two children's subtrees, so the tree needs
+// no child pointers.
+class PhotonMap
+{
+public:
+    struct Photon
+    {
+        glm::vec3   position;
+        glm::vec3   power;
+        glm::vec3   direction;  // The direction it was travelling in
+        uint32_t    axis;       // Split axis of the photon's node
+    };
+
+    explicit PhotonMap(const AABBox& sceneBounds, uint32_t lookupSize);
+
+    // Shoots numPhotons photons from the light on the calling thread and
+    // appends the ones stored to photons. totalPhotons is what all calls for
+    // the light shoot together, each photon gets that share of its power.
+    void shoot(const Raytracer& tracer, const ILight& light, uint32_t numPhotons,
+               uint32_t totalPhotons, std::vector<Photon>& photons) const;
+
+    // Takes over the photons and builds the tree, in parallel
+    void build(std::vector<Photon>& photons);
+
+    // Irradiance at P from the photons arriving at the front of the surface,
+    // estimated from the nearest lookupSize photons
+    glm::vec3 irradiance(const glm::vec3& P, const glm::vec3& N) const;
+
+    size_t numPhotons() const { return mPhotons.size(); }
+    const AABBox& sceneBounds() const { return mSceneBounds; }
+
+private:
+    struct Neighbor
+    {
+        float       distance2;
+        uint32_t    photon;
+    };
+
+    // Max heap on the distance once full, so the furthest photon is the
+    // one replaced
+    struct Neighbors
+    {
+        uint32_t    size;
+        float       maxDistance2;   // Squared search radius, shrinks once full
+        Neighbor    items[PHOTON_MAP_MAX_LOOKUP];
+    };
+
+    PhotonMap(const PhotonMap&) = delete;
+    PhotonMap& operator=(const PhotonMap&) = delete;
+
+    void build(uint32_t begin, uint32_t end);
+    void locate(uint32_t begin, uint32_t end, const glm::vec3& P, Neighbors& neighbors) const;
+    void addNeighbor(uint32_t photonIdx, float distance2, Neighbors& neighbors) const;
+
+    const AABBox            mSceneBounds;
+    const uint32_t          mLookupSize;
+    const float             mMaxRadius;
+    std::vector<Photon>     mPhotons;
+};
+
+#endif
@@ -2,6 +2,8 @@
 #include <cmath>
 
 #include "point_light.h"
+#include "noise.h"
+#include "ray.h"
 
 
 PointLight::PointLight(const glm::vec3& pos, const glm::vec3& kd, float radius,
@@ -22,3 +24,28 @@ void PointLight::attenuate(const glm::vec3& P, glm::vec3& result) const
     float distance = glm::length(P - mPos);
     result /= mConstAtten + mLinearAtten * distance + mQuadAtten * distance * distance;
 }
+
+glm::vec3 PointLight::power(const AABBox& /*sceneBounds*/) const
+{
+    return mKd * (4.f * PI);
+}
+
+void PointLight::emitPhoton(Noise& noise, const AABBox& /*sceneBounds*/, Ray& photonRay) const
+{
+    // Uniform over the sphere
+    const float z = 1.f - 2.f * noise.generateNormalizedFloat();
+    const float r = sqrtf(std::max(0.f, 1.f - z * z));
+    const float phi = TWO_PI * noise.generateNormalizedFloat();
+
+    photonRay.setOrigin(mPos);
+    photonRay.setDir(glm::vec3(r * cosf(phi), r * sinf(phi), z));
+}
+
+void PointLight::attenuatePhoton(const glm::vec3& P, glm::vec3& power) const
+{
+    // The photons' density already falls off with the squared distance,
+    // direct lighting only does so through the attenuation terms
+    const glm::vec3 toLight = mPos - P;
+    power *= glm::dot(toLight, toLight);
+    attenuate(P, power);
+}
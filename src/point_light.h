@@ -4,6 +4,7 @@
 #include <glm/glm.hpp>
 
 #include "ilight.h"
+#include "scratch_arena.h"
 #include "sampler_info.h"
 #include "spherical_sampler.h"
 #include "point_sampler.h"
@@ -18,9 +19,15 @@ public:
     // ILight
     glm::vec3 directionToLight(const glm::vec3& p) const override;
     void attenuate(const glm::vec3& P, glm::vec3& result) const override;
-    ISampler* generateSamplerForPoint(const glm::vec3& samplePoint) const override;
+    ISampler* generateSamplerForPoint(const glm::vec3& samplePoint, ScratchArena& arena) const override;
     void setShadowRays(unsigned numRays) override;
     unsigned shadowRays() const override;
+    glm::vec3 power(const AABBox& sceneBounds) const override;
+    void emitPhoton(Noise& noise, const AABBox& sceneBounds, Ray& photonRay) const override;
+    void attenuatePhoton(const glm::vec3& P, glm::vec3& power) const override;
+    bool isLocal() const override { return true; }
+    glm::vec3 position() const override { return mPos; }
+    glm::vec3 attenuation() const override;
     
 private:
     glm::vec3                   mPos;
@@ -36,18 +43,23 @@ inline glm::vec3 PointLight::directionToLight(const glm::vec3& p) const
     return glm::normalize(mPos - p);
 }
 
-inline ISampler* PointLight::generateSamplerForPoint(const glm::vec3& samplePoint) const
+inline glm::vec3 PointLight::attenuation() const
+{
+    return glm::vec3(mConstAtten, mLinearAtten, mQuadAtten);
+}
+
+inline ISampler* PointLight::generateSamplerForPoint(const glm::vec3& samplePoint, ScratchArena& arena) const
 {
     if (shadowRays() > 1)
     {
-        return new SphericalSampler(mPos, mRadius, &mSamplesInfo, samplePoint);
+        return arena.create<SphericalSampler>(mPos, mRadius, &mSamplesInfo, samplePoint);
     }
     else
     {
         glm::vec3 dir = mPos - samplePoint;
         float distance = glm::length(dir);
         dir = dir / distance;
-        return new PointSampler(dir, distance);
+        return arena.create<PointSampler>(dir, distance);
     }
 }
 
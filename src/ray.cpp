@@ -8,6 +8,8 @@ Ray::Ray(const TYPE t)
     , mOrigin(0.f)
     , mDir(0.f)
     , mDepth(1)
+    , mThroughput(1.f)
+    , mSampleDensity(0.f)
     , mIor(1.0f)
     , mMinT(0.f)
     , mMaxT(std::numeric_limits<float>::max())
@@ -22,6 +24,8 @@ Ray::Ray(const TYPE t, const glm::vec3& origin, const float ior)
     , mOrigin(origin)
     , mDir(0.f)
     , mDepth(1)
+    , mThroughput(1.f)
+    , mSampleDensity(0.f)
     , mIor(ior)
     , mMinT(0.f)
     , mMaxT(std::numeric_limits<float>::max())
@@ -37,6 +41,8 @@ Ray::Ray(const Ray& r)
     , mOrigin(r.mOrigin)
     , mDir(r.mDir)
     , mDepth(r.mDepth)
+    , mThroughput(r.mThroughput)
+    , mSampleDensity(r.mSampleDensity)
     , mIor(r.mIor)
     , mMinT(r.mMinT)
     , mMaxT(r.mMaxT)
@@ -52,6 +58,8 @@ Ray::Ray(const Ray& r, TYPE t)
     , mOrigin(r.mOrigin)
     , mDir(r.mDir)
     , mDepth(r.mDepth)
+    , mThroughput(r.mThroughput)
+    , mSampleDensity(r.mSampleDensity)
     , mIor(r.mIor)
     , mMinT(r.mMinT)
     , mMaxT(r.mMaxT)
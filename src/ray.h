@@ -21,6 +21,7 @@ public:
         REFRACTED,
         SHADOW,
         GI,
+        PHOTON,
         TYPE_COUNT
     };
     
@@ -36,11 +37,15 @@ public:
     void setMaxDistance(float dist)     { mMaxT = dist; }
     void shouldHitBackFaces(bool value) { mShouldHitBack = value; }
     void incrementDepth()               { ++mDepth; }
+    void setThroughput(const glm::vec3& t) { mThroughput = t; }
+    void setSampleDensity(float density) { mSampleDensity = density; }
 
     const glm::vec3& origin() const         { return mOrigin; }
     const glm::vec3& dir() const            { return mDir; }
     glm::vec3 point(const float t) const    { return mOrigin + mDir * t; }
     unsigned depth() const                  { return mDepth; }
+    const glm::vec3& throughput() const     { return mThroughput; }
+    float sampleDensity() const             { return mSampleDensity; }
     bool shouldHitBackFaces() const         { return mShouldHitBack; }
     bool didHitBackFace() const             { return mDidHitBack; }
     float ior() const                       { return mIor; }
@@ -73,6 +78,8 @@ private:
     glm::vec3           mOrigin;
     glm::vec3           mDir;
     unsigned            mDepth;
+    glm::vec3           mThroughput; // Weight of the ray's radiance in the pixel
+    float               mSampleDensity; // Rays shot times the pdf of the direction, 0 if not sampled
     float               mIor;
     float               mMinT;
     float               mMaxT;
@@ -0,0 +1,46 @@
+#ifndef __RAY_PACKET_H__
+#define __RAY_PACKET_H__
+
+#include <cstdint>
+
+#include "common.h"
+
+class Ray;
+
+
+// Rays traced together through an accelerator, e.g. the sub-pixel samples of
+// a pixel. Coherent packets share most of their node fetches. The rays are
+// owned by the caller.
+class RayPacket
+{
+public:
+    enum
+    {
+        MAX_RAYS = 16
+    };
+
+    explicit RayPacket() : mNumRays(0) { }
+
+    void add(Ray& ray)
+    {
+        TP_ASSERT(mNumRays < MAX_RAYS);
+        mRays[mNumRays++] = &ray;
+    }
+
+    void clear()                            { mNumRays = 0; }
+    bool full() const                       { return mNumRays == MAX_RAYS; }
+    uint32_t size() const                   { return mNumRays; }
+    Ray& operator[](uint32_t idx) const     { return *mRays[idx]; }
+
+    // Bit i is set for every ray in the packet
+    uint32_t mask() const                   { return (uint32_t)((1ull << mNumRays) - 1); }
+
+private:
+    RayPacket(const RayPacket&) = delete;
+    RayPacket& operator=(const RayPacket&) = delete;
+
+    Ray*        mRays[MAX_RAYS];
+    uint32_t    mNumRays;
+};
+
+#endif
@@ -1,38 +1,47 @@
 #include <iostream>
-#include <unistd.h>
+#include <algorithm>
 
 #include "raytracer.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "material.h"
 #include "hit.h"
 #include "stats_collector.h"
-#include "kdtree.h"
+#include "iaccelerator.h"
 #include "sampler.h"
 #include "sample.h"
 #include "image_buffer.h"
 #include "camera.h"
+#include "frustum.h"
+#include "thread_pool.h"
 #include "env_sphere.h"
 #include "noise.h"
 #include "scene.h"
 #include "hit.h"
+#include "irradiance_cache.h"
+#include "photon_map.h"
+#include "triangle.h"
 
 
-Raytracer::Raytracer(const KdTree& tree, const Camera& cam, const EnvSphere* env,
+Raytracer::Raytracer(const IAccelerator& accelerator, const Camera& cam, const EnvSphere* env,
                      Sampler* const sampler, ImageBuffer* const imgBuffer,
+                     IrradianceCache* const irradianceCache, const PhotonMap* const photonMap,
                      const unsigned int maxDepth)
     : mNoiseGen()
-    , mMailboxes(tree.numberOfPrimitives())
-    , mKdTree(tree)
-    , mTraversalStack(mKdTree.allocateTraversalBuffer())
+    , mAccelerator(accelerator)
+    , mTraversalContext(mAccelerator.allocateTraversalContext())
     , mCamera(cam)
     , mEnv(env)
     , mImgBuffer(imgBuffer)
     , mSampler(sampler)
+    , mIrradianceCache(irradianceCache)
+    , mPhotonMap(photonMap)
+    , mOccluderCache()
+    , mScratch()
     , mStats()
     , mMaxDepth(maxDepth)
-    , mThreadId(0)
-    , mIsCanceled(false)
 {
+    mNoiseGen.initGISamples(Scene::instance().renderSettings().GISamples);
 }
 
 Raytracer::~Raytracer()
@@ -44,85 +53,255 @@ void Raytracer::registerStatsCollector(StatsCollector& c) const
     c.addStats(&mStats);
 }
 
-bool Raytracer::start()
+void Raytracer::renderTile(const Tile& tile, unsigned pass, const TaskGroup& tasks) const
 {
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    
-    int err = pthread_create(&mThreadId, &attr, _run, this);
-    pthread_attr_destroy(&attr);
-    if (err)
+    // The primary rays of a tile share the camera position and stay
+    // inside a narrow frustum, cull what none of them can reach once
+    const Frustum frustum = mCamera.generateFrustum((float)tile.x0, (float)tile.y0,
+                                                    (float)tile.x1, (float)tile.y1);
+    const IAccelerator::FrustumEntry entry = mAccelerator.cullFrustum(frustum, mStats);
+
+    // Adaptive passes only go on sampling the pixels that are still noisy
+    const Scene::RenderSettings& settings = Scene::instance().renderSettings();
+    const bool adaptive = settings.adaptiveThreshold > 0.f;
+
+    SamplePacket packet;
+    std::vector<Ray> primaryRays;
+    std::vector<glm::vec4> colors;
+    primaryRays.reserve(Sampler::sSamplesPerPixel);
+    for (unsigned y = tile.y0; y < tile.y1 && !tasks.isCanceled(); ++y)
     {
-        std::cerr << "Error creating new thread: " << err << std::endl;
-        return false;
+        for (unsigned x = tile.x0; x < tile.x1; ++x)
+        {
+            if (adaptive && !mImgBuffer->needsSamples(x, y, settings.minSamples, settings.maxSamples,
+                                                      settings.adaptiveThreshold))
+            {
+                continue;
+            }
+
+            // The sub-pixel rays are close to parallel, trace them as packets
+            mSampler->buildSamplePacket(x, y, pass, packet);
+            const Sample* sample = nullptr;
+            primaryRays.clear();
+            while (packet.nextSample(sample))
+            {
+                primaryRays.emplace_back(Ray::PRIMARY);
+                mCamera.generateRay(*sample, &primaryRays.back());
+            }
+
+            traceAndShadePrimaries(primaryRays, entry, colors);
+            mImgBuffer->commit(*sample, colors.data(), (unsigned)colors.size());
+            mScratch.reset();
+        }
     }
-    
-    return true;
+
+    mSampler->tileDone();
 }
 
-void* Raytracer::_run(void *arg)
+void Raytracer::seedIrradianceCache(const Tile& tile, unsigned stride, const TaskGroup& tasks) const
 {
-    Raytracer* tracer = static_cast<Raytracer*>(arg);
-    tracer->run();
-    
-    pthread_exit(nullptr);
-    return nullptr;
+    const unsigned y0 = (tile.y0 + stride - 1) / stride * stride;
+    const unsigned x0 = (tile.x0 + stride - 1) / stride * stride;
+    for (unsigned y = y0; y < tile.y1 && !tasks.isCanceled(); y += stride)
+    {
+        for (unsigned x = x0; x < tile.x1; x += stride)
+        {
+            Ray primaryRay(Ray::PRIMARY);
+            mCamera.generateRay(Sample((float)x + .5f, (float)y + .5f), &primaryRay);
+
+            glm::vec4 color;
+            traceAndShade(primaryRay, color);
+            mScratch.reset();
+        }
+    }
 }
 
-void Raytracer::run() const
+glm::vec3 Raytracer::irradiance(const Hit& hit, unsigned rayDepth) const
 {
-    mNoiseGen.initGISamples(Scene::instance().renderSettings().GISamples);
+    TP_ASSERT(mIrradianceCache != nullptr);
+    return mIrradianceCache->irradiance(*this, hit, rayDepth, mStats);
+}
 
-    SamplePacket packet;
-    while (!mIsCanceled && mSampler->buildSamplePacket(packet))
+glm::vec3 Raytracer::photonIrradiance(const Hit& hit) const
+{
+    TP_ASSERT(mPhotonMap != nullptr);
+    return mPhotonMap->irradiance(hit.P, hit.N);
+}
+
+void Raytracer::traceAndShadePrimaries(std::vector<Ray>& primaryRays, IAccelerator::FrustumEntry entry,
+                                       std::vector<glm::vec4>& colors) const
+{
+    colors.assign(primaryRays.size(), glm::vec4(0.f, 0.f, 0.f, 0.f));
+    RayPacket packet;
+    for (size_t first = 0; first < primaryRays.size(); first += RayPacket::MAX_RAYS)
     {
-        const Sample* sample;
-        glm::vec4 packetResult(0.f, 0.f, 0.f, 0.f);
-        while (!mIsCanceled && packet.nextSample(sample))
+        packet.clear();
+        for (size_t i = first; i < primaryRays.size() && !packet.full(); ++i)
         {
-            Ray primary(Ray::PRIMARY);
-            mCamera.generateRay(*sample, &primary);
+            packet.add(primaryRays[i]);
+        }
 
-            glm::vec4 rayColor(0.f, 0.f, 0.f, 0.f);
-            traceAndShade(primary, rayColor);
-            packetResult += rayColor;
+        const uint32_t hitMask = trace(packet, entry, false);
+        for (uint32_t i = 0; i < packet.size(); ++i)
+        {
+            shade(packet[i], (hitMask >> i) & 1, colors[first + i]);
         }
+    }
+}
+
+bool Raytracer::trace(Ray& ray, bool visibilityTest) const
+{
+    if (ray.depth() > mMaxDepth) return false;
+    
+    mStats.incrementRayCount(ray.type());
 
-        mImgBuffer->commit(*sample, packetResult / (float)Sampler::sSamplesPerPixel);
+    if (visibilityTest)
+    {
+        return mAccelerator.trace<true>(ray, *mTraversalContext, mStats);
     }
+    return mAccelerator.trace<false>(ray, *mTraversalContext, mStats);
 }
 
-bool Raytracer::join() const
+uint32_t Raytracer::traceShadow(RayPacket& packet, const ShadowTarget& target) const
 {
-    void* status;
-    int err = pthread_join(mThreadId, &status);
-    if (err)
+    uint32_t occludedMask = 0;
+    RayPacket traced;
+    uint32_t tracedRays[RayPacket::MAX_RAYS];
+    for (uint32_t i = 0; i < packet.size(); ++i)
     {
-        std::cerr << "Error joining threads: " << err << std::endl;
-        return false;
+        Ray& ray = packet[i];
+        if (ray.depth() > mMaxDepth)
+        {
+            continue;
+        }
+
+        CachedOccluders& cached = cachedOccluders(target, ray.depth());
+        mStats.occluderCacheLookups +=
+            (cached.occluders[0] != nullptr || cached.hint != IAccelerator::OCCLUDER_NONE) ? 1 : 0;
+
+        bool isOccluded = false;
+        for (unsigned j = 0; j < RAYTRACER_OCCLUDERS_PER_LIGHT && cached.occluders[j] != nullptr; ++j)
+        {
+            ++mStats.primitiveTests;
+            if (cached.occluders[j]->intersect(ray))
+            {
+                // Most recent first
+                std::rotate(cached.occluders, cached.occluders + j, cached.occluders + j + 1);
+                ++mStats.occluderCacheHits;
+                isOccluded = true;
+                break;
+            }
+        }
+
+        if (!isOccluded && cached.hint != IAccelerator::OCCLUDER_NONE &&
+            mAccelerator.traceOccluderHint(ray, cached.hint, *mTraversalContext, mStats))
+        {
+            ++mStats.occluderHintHits;
+            isOccluded = true;
+        }
+
+        if (isOccluded)
+        {
+            mStats.incrementRayCount(ray.type());
+            occludedMask |= 1u << i;
+            continue;
+        }
+
+        tracedRays[traced.size()] = i;
+        traced.add(ray);
     }
-    
-    return true;
+
+    if (traced.size() == 0)
+    {
+        return occludedMask;
+    }
+
+    const uint32_t tracedHits = trace(traced, IAccelerator::FRUSTUM_ROOT, true);
+    for (uint32_t i = 0; i < traced.size(); ++i)
+    {
+        if (!((tracedHits >> i) & 1))
+        {
+            continue;
+        }
+
+        occludedMask |= 1u << tracedRays[i];
+        if (traced[i].hitPrimitive() != nullptr)
+        {
+            CachedOccluders& cached = cachedOccluders(target, traced[i].depth());
+            std::copy_backward(cached.occluders, cached.occluders + RAYTRACER_OCCLUDERS_PER_LIGHT - 1,
+                               cached.occluders + RAYTRACER_OCCLUDERS_PER_LIGHT);
+            cached.occluders[0] = traced[i].hitPrimitive();
+            cached.hint = mAccelerator.occluderHint(traced[i].point(traced[i].maxT()));
+        }
+    }
+    return occludedMask;
 }
 
-void Raytracer::cancel()
+Raytracer::CachedOccluders& Raytracer::cachedOccluders(const ShadowTarget& target, unsigned depth) const
 {
-    mIsCanceled = true;
+    // Hits at different depths are far apart, they'd only evict each
+    // other's occluders
+    const size_t slot = (target.hash() + depth * 31) % RAYTRACER_OCCLUDER_CACHE_SIZE;
+    CachedOccluders& cached = mOccluderCache[slot];
+    if (cached.target != target || cached.depth != depth)
+    {
+        cached.target = target;
+        cached.depth = depth;
+        std::fill(cached.occluders, cached.occluders + RAYTRACER_OCCLUDERS_PER_LIGHT, nullptr);
+        cached.hint = IAccelerator::OCCLUDER_NONE;
+    }
+    return cached;
 }
 
-bool Raytracer::trace(Ray& ray, bool visibilityTest) const
+uint32_t Raytracer::trace(RayPacket& packet, IAccelerator::FrustumEntry entry, bool visibilityTest) const
 {
-    if (ray.depth() > mMaxDepth) return false;
-    
-    mStats.incrementRayCount(ray.type());
-    mMailboxes.IncrementRayId();
+    // Same as tracing the rays one by one, rays past the max depth miss
+    RayPacket traced;
+    uint32_t tracedRays[RayPacket::MAX_RAYS];
+    for (uint32_t i = 0; i < packet.size(); ++i)
+    {
+        if (packet[i].depth() <= mMaxDepth)
+        {
+            mStats.incrementRayCount(packet[i].type());
+            tracedRays[traced.size()] = i;
+            traced.add(packet[i]);
+        }
+    }
 
-    if (visibilityTest)
+    if (traced.size() == 0)
+    {
+        return 0;
+    }
+
+    if (entry == IAccelerator::FRUSTUM_EMPTY)
+    {
+        mStats.culledRays += traced.size();
+        return 0;
+    }
+
+    if (traced.size() == 1)
     {
-        return mKdTree.trace<true>(ray, mTraversalStack, mMailboxes, mStats);
+        const bool hit = visibilityTest ?
+            mAccelerator.trace<true>(traced[0], *mTraversalContext, mStats) :
+            mAccelerator.trace<false>(traced[0], *mTraversalContext, mStats);
+        return hit ? 1u << tracedRays[0] : 0u;
     }
-    return mKdTree.trace<false>(ray, mTraversalStack, mMailboxes, mStats);
+
+    const uint32_t tracedHits = visibilityTest ?
+        mAccelerator.trace<true>(traced, entry, *mTraversalContext, mStats) :
+        mAccelerator.trace<false>(traced, entry, *mTraversalContext, mStats);
+
+    mStats.packetRays += traced.size();
+
+    uint32_t hitMask = 0;
+    for (uint32_t i = 0; i < traced.size(); ++i)
+    {
+        if ((tracedHits >> i) & 1)
+        {
+            hitMask |= 1u << tracedRays[i];
+        }
+    }
+    return hitMask;
 }
 
 bool Raytracer::traceAndShade(Ray& ray, glm::vec4& result) const
@@ -132,7 +311,12 @@ bool Raytracer::traceAndShade(Ray& ray, glm::vec4& result) const
     if (ray.depth() > mMaxDepth)
         return false;
 
-    if (trace(ray, false))
+    return shade(ray, trace(ray, false), result);
+}
+
+bool Raytracer::shade(const Ray& ray, bool hit, glm::vec4& result) const
+{
+    if (hit)
     {
         result = ray.shade(*this);
         return true;
@@ -2,42 +2,124 @@
 #define __RAYTRACER_H__
 
 #include <glm/glm.hpp>
-#include <pthread.h>
+#include <memory>
+#include <vector>
 
 #include "stats.h"
-#include "mailboxer.h"
 #include "noise.h"
-#include "kdtree.h"
+#include "iaccelerator.h"
+#include "scratch_arena.h"
 
 class Ray;
+class RayPacket;
 class Camera;
 class Sampler;
 class ImageBuffer;
 class Stats;
 class StatsCollector;
 class EnvSphere;
+class TaskGroup;
+class IrradianceCache;
+class PhotonMap;
+class Hit;
+class Triangle;
+class ILight;
+class EmissiveLights;
+struct Tile;
+
+// Lights and ray depths whose last occluders each tracer remembers, more
+// share the slots
+#define RAYTRACER_OCCLUDER_CACHE_SIZE (64)
+
+// Recent occluders kept per light and depth, tested before traversing
+#define RAYTRACER_OCCLUDERS_PER_LIGHT (4)
+
+
+// What a packet of shadow rays is traced toward, one light or all of the
+// emissive triangles. Occluders are cached per target.
+class ShadowTarget
+{
+public:
+    explicit ShadowTarget() : mLight(nullptr), mEmitters(nullptr) { }
+    explicit ShadowTarget(const ILight& light) : mLight(&light), mEmitters(nullptr) { }
+    explicit ShadowTarget(const EmissiveLights& emitters) : mLight(nullptr), mEmitters(&emitters) { }
+
+    bool operator==(const ShadowTarget& rhs) const
+    {
+        return mLight == rhs.mLight && mEmitters == rhs.mEmitters;
+    }
+    bool operator!=(const ShadowTarget& rhs) const { return !(*this == rhs); }
+
+    size_t hash() const
+    {
+        return (reinterpret_cast<uintptr_t>(mLight) ^ reinterpret_cast<uintptr_t>(mEmitters)) >> 4;
+    }
+
+private:
+    const ILight*           mLight;
+    const EmissiveLights*   mEmitters;
+};
 
 
 class Raytracer
 {
 public:
-	explicit Raytracer(const KdTree& tree, const Camera& cam, const EnvSphere* env,
+	explicit Raytracer(const IAccelerator& accelerator, const Camera& cam, const EnvSphere* env,
                        Sampler* const sampler, ImageBuffer* const imgBuffer,
+                       IrradianceCache* const irradianceCache, const PhotonMap* const photonMap,
                        const unsigned int maxDepth);
 	~Raytracer();
     
     void registerStatsCollector(StatsCollector& c) const;
-    bool start();
-    bool join() const;
-    void cancel();
+
+    // Renders the samples of one pass over the tile, stops early if the
+    // group is canceled
+    void renderTile(const Tile& tile, unsigned pass, const TaskGroup& tasks) const;
+
+    // Shades one primary ray through every stride'th pixel of the tile to
+    // fill the irradiance cache, the colors are thrown away
+    void seedIrradianceCache(const Tile& tile, unsigned stride, const TaskGroup& tasks) const;
     
     bool traceAndShade(Ray& ray, glm::vec4& result) const;
+
+    // Finds the closest hit without shading it
+    inline bool intersect(Ray& ray) const
+    {
+        return trace(ray, false);
+    }
     inline bool traceShadow(Ray& ray) const
     {
         return trace(ray, true);
     }
+
+    // Bit i of the result is set if ray i of the packet is occluded. The
+    // rays are tested against the triangles that last blocked rays toward
+    // the same target first, then the accelerator's occluder hint, since
+    // neighboring hits are usually blocked by the same geometry.
+    uint32_t traceShadow(RayPacket& packet, const ShadowTarget& target) const;
     
+    // Indirect irradiance at a diffuse hit, only if there's a cache
+    bool hasIrradianceCache() const { return mIrradianceCache != nullptr; }
+    const IrradianceCache& irradianceCache() const { return *mIrradianceCache; }
+    glm::vec3 irradiance(const Hit& hit, unsigned rayDepth) const;
+
+    // Irradiance at a hit estimated from the nearest photons, only if
+    // there's a photon map
+    bool hasPhotonMap() const { return mPhotonMap != nullptr; }
+    glm::vec3 photonIrradiance(const Hit& hit) const;
+
+    // Counts the two pass shadow sampling of area lights, see
+    // Material::sampleLight
+    inline void countShadowFirstPass(bool skippedSecondPass) const
+    {
+        ++mStats.shadowFirstPasses;
+        mStats.shadowSecondPassesSkipped += skippedSecondPass ? 1 : 0;
+    }
+
     Noise& getNoiseGenerator() const { return mNoiseGen; }
+
+    // Memory for what shading a sample needs, reset once it's done
+    ScratchArena& scratch() const { return mScratch; }
     unsigned maxDepth() const { return mMaxDepth; }
 	
 private:
@@ -45,24 +127,36 @@ private:
     Raytracer(const Raytracer&) = delete;
     Raytracer& operator=(const Raytracer&) = delete;
     
-    static void* _run(void* arg);
-    void run() const;
-    
     bool trace(Ray& ray, bool visibilityTest) const;
+    uint32_t trace(RayPacket& packet, IAccelerator::FrustumEntry entry, bool visibilityTest) const;
+    bool shade(const Ray& ray, bool hit, glm::vec4& result) const;
+    void traceAndShadePrimaries(std::vector<Ray>& primaryRays, IAccelerator::FrustumEntry entry,
+                                std::vector<glm::vec4>& colors) const;
+
+    struct CachedOccluders
+    {
+        ShadowTarget                target;
+        unsigned                    depth;
+        const Triangle*             occluders[RAYTRACER_OCCLUDERS_PER_LIGHT];
+        IAccelerator::OccluderHint  hint;   // Of the last traced occluder
+    };
+
+    CachedOccluders& cachedOccluders(const ShadowTarget& target, unsigned depth) const;
 
     mutable Noise                   mNoiseGen;
-    mutable Mailboxer               mMailboxes;
-    const KdTree&                   mKdTree;
-    mutable KdTree::TraversalBuffer mTraversalStack;
+    const IAccelerator&             mAccelerator;
+    std::unique_ptr<IAccelerator::TraversalContext> mTraversalContext;
     const Camera&                   mCamera;
     const EnvSphere*                mEnv;
     ImageBuffer* const              mImgBuffer;
     Sampler* const                  mSampler;
+    IrradianceCache* const          mIrradianceCache;
+    const PhotonMap* const          mPhotonMap;
+    mutable CachedOccluders         mOccluderCache[RAYTRACER_OCCLUDER_CACHE_SIZE];
+    mutable ScratchArena            mScratch;
 
     mutable Stats                   mStats;
     const unsigned int              mMaxDepth;
-    pthread_t                       mThreadId;
-    bool                            mIsCanceled;
 };
 
 #endif
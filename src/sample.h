@@ -16,6 +16,7 @@ class SamplePacket {
 public:
     explicit SamplePacket()
     {
+        mSamples.reserve(Sampler::sSamplesPerPixel);
         clear();
     }
     
@@ -32,7 +33,6 @@ public:
     
     inline void clear() {
         mSamples.clear();
-        mSamples.reserve(Sampler::sSamplesPerPixel);
         mCurrSample = mSamples.begin();
     }
     
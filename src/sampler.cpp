@@ -1,39 +1,165 @@
 #include <cmath>
+#include <cstdint>
+#include <algorithm>
 #include <iostream>
+#include <stdexcept>
 
 #include "sampler.h"
 #include "sample.h"
+#include "common.h"
+#include "halton_generator.h"
 
 const unsigned Sampler::sSamplesPerPixel = 4;
 const unsigned Sampler::sSamplesPerAxis = (unsigned)sqrtf((float)Sampler::sSamplesPerPixel);
 const float Sampler::sSubpixelStep = 1.0f / (sSamplesPerAxis + 1);
 
-Sampler::Sampler(unsigned width, unsigned height)
+
+namespace
+{
+uint64_t mortonKey(uint32_t x, uint32_t y)
+{
+    uint64_t key = 0;
+    for (uint32_t bit = 0; bit < 32; ++bit)
+    {
+        key |= (uint64_t)((x >> bit) & 1) << (2 * bit);
+        key |= (uint64_t)((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return key;
+}
+
+// Distance along the Hilbert curve filling a size x size grid, size is a
+// power of two
+uint64_t hilbertKey(uint32_t size, uint32_t x, uint32_t y)
+{
+    uint64_t key = 0;
+    for (uint32_t s = size / 2; s > 0; s /= 2)
+    {
+        const uint32_t rx = (x & s) ? 1 : 0;
+        const uint32_t ry = (y & s) ? 1 : 0;
+        key += (uint64_t)s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the curve's sub-quadrants line up
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = size - 1 - x;
+                y = size - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return key;
+}
+} // anonymous namespace
+
+
+Sampler::Sampler(unsigned width, unsigned height, unsigned tileSize, TileOrder order)
     : mWidth(width)
     , mHeight(height)
-    , mPixelIdx(0)
+    , mTiles()
+    , mTilesDone(0)
 {
+    if (tileSize == 0)
+    {
+        throw std::invalid_argument("Tile size must be at least one pixel");
+    }
+
+    const unsigned tilesX = (width + tileSize - 1) / tileSize;
+    const unsigned tilesY = (height + tileSize - 1) / tileSize;
+    unsigned curveSize = 1;
+    while (curveSize < tilesX || curveSize < tilesY)
+    {
+        curveSize *= 2;
+    }
+
+    // Tiles are sorted once up front
+    std::vector<std::pair<uint64_t, Tile> > keyedTiles;
+    keyedTiles.reserve(tilesX * tilesY);
+    for (unsigned tileY = 0; tileY < tilesY; ++tileY)
+    {
+        for (unsigned tileX = 0; tileX < tilesX; ++tileX)
+        {
+            Tile tile;
+            tile.x0 = tileX * tileSize;
+            tile.y0 = tileY * tileSize;
+            tile.x1 = std::min(tile.x0 + tileSize, width);
+            tile.y1 = std::min(tile.y0 + tileSize, height);
+
+            uint64_t key = 0;
+            switch (order)
+            {
+            case TILES_SCANLINE:
+                key = (uint64_t)tileY * tilesX + tileX;
+                break;
+
+            case TILES_MORTON:
+                key = mortonKey(tileX, tileY);
+                break;
+
+            case TILES_HILBERT:
+                key = hilbertKey(curveSize, tileX, tileY);
+                break;
+
+            case TILES_SPIRAL:
+            {
+                // Ring around the centre tile first, then the angle within
+                // the ring
+                const float dx = tileX - (tilesX - 1) / 2.f;
+                const float dy = tileY - (tilesY - 1) / 2.f;
+                const uint64_t ring = (uint64_t)std::max(std::fabs(dx), std::fabs(dy));
+                const float angle = std::atan2(dy, dx) + PI;
+                key = (ring << 32) | (uint64_t)(angle * (float)0xffff);
+                break;
+            }
+            }
+
+            keyedTiles.emplace_back(key, tile);
+        }
+    }
+
+    std::stable_sort(keyedTiles.begin(), keyedTiles.end(),
+        [](const std::pair<uint64_t, Tile>& a, const std::pair<uint64_t, Tile>& b)
+        {
+            return a.first < b.first;
+        });
+
+    mTiles.reserve(keyedTiles.size());
+    for (const std::pair<uint64_t, Tile>& keyedTile : keyedTiles)
+    {
+        mTiles.push_back(keyedTile.second);
+    }
 }
 
-bool Sampler::buildSamplePacket(SamplePacket& packet)
+void Sampler::tileDone()
 {
-    unsigned pixelId = mPixelIdx.fetch_add(1, std::memory_order_relaxed);
-    
-    float pixelX = static_cast<unsigned>(pixelId % mWidth);
-    float pixelY = static_cast<unsigned>(pixelId / mWidth);
-    if (pixelX == 0.f && static_cast<unsigned>(pixelY) % 10 == 0)
+    const unsigned tilesDone = mTilesDone.fetch_add(1, std::memory_order_relaxed) % numTiles() + 1;
+    const unsigned progressStep = std::max(1u, numTiles() / 10);
+    if (tilesDone % progressStep == 0 || tilesDone == numTiles())
     {
-        std::cout << "Scanline " << static_cast<unsigned>(pixelY) << std::endl;
+        std::cout << "Tile " << tilesDone << " of " << numTiles() << std::endl;
     }
-    
+}
+
+void Sampler::buildSamplePacket(unsigned pixelX, unsigned pixelY, unsigned pass, SamplePacket& packet) const
+{
     packet.clear();
+    if (pass == 0)
+    {
+        for (unsigned i = 0; i < sSamplesPerPixel; ++i)
+        {
+            float x = pixelX + (((i % sSamplesPerAxis) + 1.0f) * sSubpixelStep);
+            float y = pixelY + ((floorf(i / sSamplesPerAxis) + 1.0f) * sSubpixelStep);
+            packet.addSample(x, y);
+        }
+        return;
+    }
+
+    const glm::vec2 offset = HaltonGenerator(2, 3).generateSample(pass);
     for (unsigned i = 0; i < sSamplesPerPixel; ++i)
     {
-        float x = pixelX + (((i % sSamplesPerAxis) + 1.0f) * sSubpixelStep);
-        float y = pixelY + ((floorf(i / sSamplesPerAxis) + 1.0f) * sSubpixelStep);
+        float x = pixelX + ((i % sSamplesPerAxis) + offset.x) / sSamplesPerAxis;
+        float y = pixelY + (floorf(i / sSamplesPerAxis) + offset.y) / sSamplesPerAxis;
         packet.addSample(x, y);
     }
-    
-    return pixelY < mHeight;
 }
-
@@ -2,27 +2,56 @@
 #define __SAMPLER_H__
 
 #include <atomic>
+#include <vector>
+
+// Default width and height of the tiles the image is rendered in, the
+// primary rays of a tile are traced through one frustum
+#define SAMPLER_TILE_SIZE (8)
 
 class SamplePacket;
 
+// Pixels [x0, x1) x [y0, y1) of the image
+struct Tile
+{
+    unsigned x0, y0, x1, y1;
+};
+
 class Sampler
 {
 public:
     static const unsigned sSamplesPerPixel;
     static const unsigned sSamplesPerAxis;
     static const float sSubpixelStep;
+
+    // Order tiles are rendered in, the curves keep consecutive tiles next to
+    // each other
+    enum TileOrder
+    {
+        TILES_SCANLINE = 0,
+        TILES_MORTON,
+        TILES_HILBERT,
+        TILES_SPIRAL    // Out from the centre of the image
+    };
     
-    explicit Sampler(unsigned width, unsigned height);
+    explicit Sampler(unsigned width, unsigned height, unsigned tileSize, TileOrder order);
     Sampler(const Sampler&) = delete;
     Sampler operator=(const Sampler&) = delete;
 
-    bool buildSamplePacket(SamplePacket& packet);
+    // Tiles in the order they should be rendered in
+    unsigned numTiles() const { return (unsigned)mTiles.size(); }
+    const Tile& tile(unsigned idx) const { return mTiles[idx]; }
+
+    // Reports progress once every tenth of the tiles of a pass is done
+    void tileDone();
+
+    // Every pass takes sSamplesPerPixel stratified samples, each pass at a
+    // different offset within the strata
+    void buildSamplePacket(unsigned pixelX, unsigned pixelY, unsigned pass, SamplePacket& packet) const;
 
 private:
     const unsigned mWidth, mHeight;
-    std::atomic_uint mPixelIdx;
+    std::vector<Tile> mTiles;
+    std::atomic_uint mTilesDone;
 };
 
 #endif
-
-
@@ -1,9 +1,10 @@
-#include <pthread.h>
-#include <errno.h>
-#include <unistd.h>
 #include <iostream>
+#include <iomanip>
+#include <limits>
+#include <chrono>
 #include <stdexcept>
-#include <sstream>
+#include <algorithm>
+#include <iterator>
 
 #include "scene.h"
 #include "image_buffer.h"
@@ -16,31 +17,41 @@
 #include "stats_collector.h"
 #include "env_sphere.h"
 #include "mesh.h"
+#include "kdtree.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "thread_pool.h"
+#include "irradiance_cache.h"
+#include "photon_map.h"
+#include "triangle.h"
 
 class Triangle;
 
-
-namespace
-{
-void joinThreads(std::vector<std::unique_ptr<Raytracer> >& tracers, bool kill=false)
-{
-    if (kill)
-    {
-        for (auto& tracer : tracers)
-            tracer->cancel();
-    }
-    
-    for (auto& tracer : tracers)
-        tracer->join();
-}
-} // annonymous namespace
+// Photons shot by one task
+#define PHOTONS_PER_TASK (4096)
 
 
 Scene::RenderSettings::RenderSettings()
     : maxDepth(1)
     , GISamples(50)
+    , integrator(INTEGRATOR_SPLITTING)
+    , rouletteDepth(3)
     , bias(0.001f)
     , lightRadius(0.f)
+    , tileSize(SAMPLER_TILE_SIZE)
+    , targetSamples(0)
+    , timeBudget(0.f)
+    , writeInterval(0.f)
+    , minSamples(8)
+    , maxSamples(64)
+    , adaptiveThreshold(0.f)
+    , irradianceCacheError(0.f)
+    , irradianceCacheSamples(256)
+    , irradianceCachePrepass(4)
+    , photons(0)
+    , photonLookup(64)
+    , emissiveSamples(4)
+    , lightsPerHit(0)
 {
 }
 
@@ -52,9 +63,17 @@ Scene::Scene()
     : mCam(nullptr)
     , mSampler(nullptr)
     , mImgBuffer(nullptr)
-    , mKdTree(new KdTree)
+    , mAccelerator(nullptr)
+    , mAcceleratorType(ACCEL_KDTREE)
+    , mKdTreeBuildMode(KdTree::SAH_EXACT)
+    , mKdTreeCacheDirectory()
+    , mForceKdTreeRebuild(false)
+    , mTileOrder(Sampler::TILES_HILBERT)
     , mEnvSphere(nullptr)
     , mLights()
+    , mEmissiveLights()
+    , mLightTree()
+    , mDistantLights()
     , mSettings()
     , mMeshes()
 {
@@ -74,8 +93,8 @@ Scene::~Scene()
     delete mEnvSphere;
     mEnvSphere = nullptr;
 
-    delete mKdTree;
-    mKdTree = nullptr;
+    delete mAccelerator;
+    mAccelerator = nullptr;
 
     for (ILight* light : mLights)
     {
@@ -112,13 +131,13 @@ void Scene::createBuffer()
     delete mSampler;
     delete mImgBuffer;
     
-    mSampler = new Sampler(mCam->width(), mCam->height());
+    mSampler = new Sampler(mCam->width(), mCam->height(), mSettings.tileSize, mTileOrder);
     mImgBuffer = new ImageBuffer(mCam->width(), mCam->height());
 }
 
-Mesh& Scene::allocateMesh(uint32_t numberOfVerticies)
+Mesh& Scene::allocateMesh(uint32_t numberOfVerticies, uint32_t numberOfTriangles)
 {
-    mMeshes.emplace_front(new Mesh(numberOfVerticies));
+    mMeshes.emplace_front(new Mesh(numberOfVerticies, numberOfTriangles));
     return *mMeshes.front();
 }
 
@@ -137,64 +156,382 @@ void Scene::setEnvSphereImage(const std::string& file)
     mEnvSphere = new EnvSphere(file);
 }
 
+void Scene::setKdTreeCache(const std::string& directory, bool forceRebuild)
+{
+    mKdTreeCacheDirectory = directory;
+    mForceKdTreeRebuild = forceRebuild;
+}
+
+void Scene::setAdaptiveSampling(uint32_t minSamples, uint32_t maxSamples, float threshold)
+{
+    if (minSamples > maxSamples)
+    {
+        throw std::invalid_argument("Adaptive sampling needs minSpp <= maxSpp");
+    }
+
+    // Pixels get whole passes of samples, a maxSpp in between would be
+    // overshot by the last pass
+    const uint32_t roundedMaxSamples =
+        std::max(maxSamples / Sampler::sSamplesPerPixel, 1u) * Sampler::sSamplesPerPixel;
+    if (roundedMaxSamples != maxSamples)
+    {
+        std::cerr << "Warning: maxSpp " << maxSamples << " isn't a multiple of the "
+            << Sampler::sSamplesPerPixel << " samples per pass, using " << roundedMaxSamples << std::endl;
+    }
+
+    mSettings.minSamples = std::min(minSamples, roundedMaxSamples);
+    mSettings.maxSamples = roundedMaxSamples;
+    mSettings.adaptiveThreshold = threshold;
+}
+
+void Scene::setIrradianceCache(float maxError, uint32_t numSamples, uint32_t prepassStride)
+{
+    if (maxError > 0.f && numSamples == 0)
+    {
+        throw std::invalid_argument("Irradiance cache needs at least one sample per record");
+    }
+
+    mSettings.irradianceCacheError = maxError;
+    mSettings.irradianceCacheSamples = numSamples;
+    mSettings.irradianceCachePrepass = prepassStride;
+}
+
+void Scene::setPhotonMap(uint32_t numPhotons, uint32_t lookupSize)
+{
+    if (numPhotons > 0 && (lookupSize == 0 || lookupSize > PHOTON_MAP_MAX_LOOKUP))
+    {
+        throw std::invalid_argument("Photon lookups must gather between 1 and " +
+                                    std::to_string(PHOTON_MAP_MAX_LOOKUP) + " photons");
+    }
+
+    mSettings.photons = numPhotons;
+    mSettings.photonLookup = lookupSize;
+}
+
+AABBox Scene::bounds() const
+{
+    AABBox result(glm::vec3(std::numeric_limits<float>::max()),
+                  glm::vec3(-std::numeric_limits<float>::max()));
+    for (const Mesh* mesh : mMeshes)
+    {
+        for (const Triangle* triangle : *mesh)
+        {
+            result = result.join(triangle->bounds());
+        }
+    }
+
+    return result;
+}
+
+void Scene::shootPhotons(PhotonMap& photonMap,
+                         const std::vector<std::unique_ptr<Raytracer> >& tracers) const
+{
+    HighResTimer timer;
+    timer.start();
+
+    struct PhotonTask
+    {
+        const ILight*                   light;
+        uint32_t                        numPhotons;
+        uint32_t                        lightPhotons;
+        std::vector<PhotonMap::Photon>  photons;
+    };
+
+    // Every light gets a share of the photons that follows its power,
+    // split into tasks that each store their photons separately
+    float totalPower = 0.f;
+    for (const ILight* light : mLights)
+    {
+        totalPower += luminance(light->power(photonMap.sceneBounds()));
+    }
+
+    std::vector<PhotonTask> photonTasks;
+    for (const ILight* light : mLights)
+    {
+        const float share = totalPower > 0.f ?
+            luminance(light->power(photonMap.sceneBounds())) / totalPower : 0.f;
+        const uint32_t lightPhotons = (uint32_t)((float)mSettings.photons * share + .5f);
+        for (uint32_t first = 0; first < lightPhotons; first += PHOTONS_PER_TASK)
+        {
+            photonTasks.push_back({ light, std::min(lightPhotons - first, (uint32_t)PHOTONS_PER_TASK),
+                                    lightPhotons, std::vector<PhotonMap::Photon>() });
+        }
+    }
+
+    TaskGroup tasks;
+    for (PhotonTask& photonTask : photonTasks)
+    {
+        tasks.run([&photonMap, &tracers, &photonTask]()
+        {
+            photonMap.shoot(*tracers[ThreadPool::workerIndex()], *photonTask.light,
+                            photonTask.numPhotons, photonTask.lightPhotons, photonTask.photons);
+        });
+    }
+    tasks.wait();
+
+    size_t numStored = 0;
+    for (const PhotonTask& photonTask : photonTasks)
+    {
+        numStored += photonTask.photons.size();
+    }
+
+    std::vector<PhotonMap::Photon> photons;
+    photons.reserve(numStored);
+    for (const PhotonTask& photonTask : photonTasks)
+    {
+        photons.insert(photons.end(), photonTask.photons.begin(), photonTask.photons.end());
+    }
+    photonMap.build(photons);
+
+    std::cout << "Photon map: " << photonMap.numPhotons() << " photons stored in "
+        << timer.elapsedToString(timer.elapsed()) << std::endl;
+}
+
+void Scene::createAccelerator()
+{
+    delete mAccelerator;
+    mAccelerator = nullptr;
+
+    switch (mAcceleratorType)
+    {
+    case ACCEL_KDTREE:
+    {
+        KdTree* kdTree = new KdTree;
+        kdTree->setBuildMode(mKdTreeBuildMode);
+        kdTree->setCache(mKdTreeCacheDirectory, mForceKdTreeRebuild);
+        mAccelerator = kdTree;
+        break;
+    }
+
+    case ACCEL_BVH:
+        mAccelerator = new BVH;
+        break;
+
+    case ACCEL_BVH4:
+        mAccelerator = new WideBVH<4>;
+        break;
+
+    case ACCEL_BVH8:
+#ifdef __AVX__
+        mAccelerator = new WideBVH<8>;
+#else
+        std::cerr << "Warning: built without AVX, using a 4-wide BVH" << std::endl;
+        mAccelerator = new WideBVH<4>;
+#endif
+        break;
+    }
+}
+
+void Scene::printLoadStats() const
+{
+    size_t numTriangles = 0;
+    size_t numBuckets = 0;
+    size_t bytesUsed = 0;
+    size_t bytesReserved = 0;
+    for (const Mesh* mesh : mMeshes)
+    {
+        const BucketAllocator& allocator = mesh->triangleAllocator();
+        numTriangles += allocator.slotsUsed();
+        numBuckets += allocator.numBuckets();
+        bytesUsed += allocator.bytesUsed();
+        bytesReserved += allocator.bytesReserved();
+    }
+
+    std::cout << "Triangle Pool Stats:" << std::endl;
+    std::cout << std::left << std::setw(22) << "  Triangles:" << numTriangles << std::endl;
+    std::cout << std::left << std::setw(22) << "  Buckets:" << numBuckets << std::endl;
+    std::cout << std::left << std::setw(22) << "  Memory:" << bytesReserved / 1024 << " KB" << std::endl;
+    std::cout << std::left << std::setw(22) << "  Overhead:" << (bytesReserved - bytesUsed) / 1024 << " KB ("
+        << (bytesUsed > 0 ? 100.0 * (double)(bytesReserved - bytesUsed) / (double)bytesUsed : 0.0)
+        << "%)" << std::endl;
+}
+
 void Scene::prepareForRendering()
 {
+    createAccelerator();
+
     size_t triangleID = 0;
     for (const Mesh* mesh : mMeshes)
     {
         for (Triangle* triangle : *mesh)
         {
             triangle->SetID(triangleID++);
-            mKdTree->addPrimitive(triangle);
+            mAccelerator->addPrimitive(triangle);
+
+            if (!VEC3_IS_REL_ZERO(triangle->material().emissive()))
+            {
+                mEmissiveLights.addTriangle(triangle);
+            }
         }
     }
+    mEmissiveLights.build();
 
     for (ILight* light : mLights)
     {
         light->setBias(mSettings.bias);
     }
+
+    if (mSettings.lightsPerHit > 0)
+    {
+        mLightTree.build(mLights);
+        mDistantLights.clear();
+        std::copy_if(mLights.begin(), mLights.end(), std::back_inserter(mDistantLights),
+                     [](const ILight* light) { return !light->isLocal(); });
+    }
 }
 
-void Scene::render(const std::string& filename, uint32_t maxThreads)
+void Scene::render(const std::string& filename)
 {
     TP_ASSERT(mCam != nullptr);
     createBuffer();
-    mKdTree->build();
+
+    // The budget covers building the accelerator too
+    HighResTimer budgetTimer;
+    budgetTimer.start();
+    const auto timeBudget = std::chrono::duration<float>(mSettings.timeBudget);
+    const bool hasTimeBudget = mSettings.timeBudget > 0.f;
+
+    const uint32_t numCpus = ThreadPool::instance().numWorkers();
+    mAccelerator->build(numCpus);
     
     Timer t;
     StatsCollector collector;
     t.start();
     
-    uint32_t numCpus = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
-    if (numCpus < 1)
+    std::cout << "Using " << numCpus << " CPUs" << std::endl;
+    
+    // Irradiance records and photons are shared by all tracers
+    const AABBox sceneBounds = bounds();
+    std::unique_ptr<IrradianceCache> irradianceCache;
+    if (mSettings.irradianceCacheError > 0.f)
     {
-        std::stringstream ss;
-        ss << "Error getting number of CPUs: " << strerror(numCpus);
-        throw std::runtime_error(ss.str());
+        irradianceCache = std::make_unique<IrradianceCache>(
+            sceneBounds, mSettings.irradianceCacheError, mSettings.irradianceCacheSamples);
     }
 
-    numCpus = std::min(numCpus, maxThreads);
-    std::cout << "Using " << numCpus << " CPUs" << std::endl;
-    
+    std::unique_ptr<PhotonMap> photonMap;
+    if (mSettings.photons > 0)
+    {
+        photonMap = std::make_unique<PhotonMap>(sceneBounds, mSettings.photonLookup);
+    }
+
+    // One tracer per worker, tasks use the one of the worker they run on
     std::vector<std::unique_ptr<Raytracer> > tracers;
     tracers.reserve(numCpus);
-    
     for (uint32_t i = 0; i < numCpus; ++i)
     {
         tracers.emplace_back(
-            std::make_unique<Raytracer>(*mKdTree, *mCam, mEnvSphere, mSampler, mImgBuffer, mSettings.maxDepth));
+            std::make_unique<Raytracer>(*mAccelerator, *mCam, mEnvSphere, mSampler, mImgBuffer,
+                                        irradianceCache.get(), photonMap.get(), mSettings.maxDepth));
+        tracers.back()->registerStatsCollector(collector);
+    }
+
+    if (photonMap)
+    {
+        shootPhotons(*photonMap, tracers);
+    }
 
-        std::unique_ptr<Raytracer>& tracer = tracers.back();
-        tracer->registerStatsCollector(collector);
-        if (!tracer->start())
+    // Seeding the cache at a lower resolution first spreads the records
+    // evenly over the image, the full resolution passes then mostly
+    // interpolate between them instead of extrapolating from one side
+    if (irradianceCache && mSettings.irradianceCachePrepass > 0)
+    {
+        TaskGroup tasks;
+        const uint32_t numTiles = mSampler->numTiles();
+        for (uint32_t i = 0; i < numTiles; ++i)
         {
-            joinThreads(tracers, true /*kill*/);
-            throw std::runtime_error("Error creating threads!");
+            const uint32_t worker = (uint32_t)((uint64_t)i * numCpus / numTiles);
+            tasks.run([this, &tracers, &tasks, i]()
+            {
+                tracers[ThreadPool::workerIndex()]->seedIrradianceCache(
+                    mSampler->tile(i), mSettings.irradianceCachePrepass, tasks);
+            }, worker);
         }
+        tasks.wait();
+
+        std::cout << "Irradiance cache seeded with " << irradianceCache->numRecords()
+            << " records" << std::endl;
     }
-    
-    joinThreads(tracers);
+
+    // Without a sample target a single pass is rendered, or as many as
+    // fit the time budget
+    const bool adaptive = mSettings.adaptiveThreshold > 0.f;
+    uint32_t numPasses = 1;
+    if (adaptive)
+    {
+        numPasses = (mSettings.maxSamples + Sampler::sSamplesPerPixel - 1) / Sampler::sSamplesPerPixel;
+    }
+    else if (mSettings.targetSamples > 0)
+    {
+        numPasses = (mSettings.targetSamples + Sampler::sSamplesPerPixel - 1) / Sampler::sSamplesPerPixel;
+    }
+    else if (hasTimeBudget)
+    {
+        numPasses = std::numeric_limits<uint32_t>::max();
+    }
+
+    HighResTimer writeTimer;
+    writeTimer.start();
+    const auto writeInterval = std::chrono::duration<float>(mSettings.writeInterval);
+    for (uint32_t pass = 0; pass < numPasses; ++pass)
+    {
+        // Every worker starts on its own stretch of the tile order and works
+        // through it back to front, idle workers steal from the other end of
+        // what's left of the others'. Only the first pass always finishes so
+        // every pixel gets samples, the others stop once the budget runs out.
+        TaskGroup tasks;
+        const bool enforceBudget = hasTimeBudget && pass > 0;
+        const uint32_t numTiles = mSampler->numTiles();
+        for (uint32_t i = 0; i < numTiles; ++i)
+        {
+            const uint32_t worker = (uint32_t)((uint64_t)i * numCpus / numTiles);
+            tasks.run([this, &tracers, &tasks, &budgetTimer, timeBudget, enforceBudget, pass, i]()
+            {
+                if (enforceBudget && budgetTimer.elapsed() >= timeBudget)
+                {
+                    tasks.cancel();
+                    return;
+                }
+
+                tracers[ThreadPool::workerIndex()]->renderTile(mSampler->tile(i), pass, tasks);
+            }, worker);
+        }
+        tasks.wait();
+
+        const bool outOfTime = hasTimeBudget && budgetTimer.elapsed() >= timeBudget;
+        bool converged = false;
+        if (adaptive)
+        {
+            const unsigned noisyPixels = mImgBuffer->countPixelsNeedingSamples(
+                mSettings.minSamples, mSettings.maxSamples, mSettings.adaptiveThreshold);
+            std::cout << "Pass " << pass + 1 << ": " << noisyPixels << " pixels need more samples" << std::endl;
+            converged = noisyPixels == 0;
+        }
+
+        if (tasks.isCanceled() || outOfTime || converged || pass + 1 == numPasses)
+        {
+            if (numPasses > 1)
+            {
+                std::cout << "Finished after " << (tasks.isCanceled() ? pass : pass + 1)
+                    << " full passes" << std::endl;
+            }
+            break;
+        }
+
+        if (mSettings.writeInterval > 0.f && writeTimer.elapsed() >= writeInterval)
+        {
+            std::cout << "Pass " << pass + 1 << " done, " << (pass + 1) * Sampler::sSamplesPerPixel
+                << " samples per pixel" << std::endl;
+            mImgBuffer->write(filename);
+            writeTimer.start();
+        }
+    }
+
     mImgBuffer->write(filename);
+    if (numPasses > 1)
+    {
+        std::cout << "Average samples per pixel: " << mImgBuffer->averageSamplesPerPixel() << std::endl;
+    }
     
     // Print stats
     std::cout << std::endl;
@@ -3,10 +3,15 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include <forward_list>
 
 #include "kdtree.h"
+#include "sampler.h"
+#include "emissive_lights.h"
+#include "light_tree.h"
 
+class IAccelerator;
 class Camera;
 class Sampler;
 class ImageBuffer;
@@ -14,6 +19,8 @@ class Mesh;
 class ILight;
 class Ray;
 class EnvSphere;
+class Raytracer;
+class PhotonMap;
 
 class Scene
 {
@@ -25,32 +32,104 @@ public:
     typedef LightVector::const_iterator ConstLightIter;
     typedef LightVector::iterator       LightIter;
 
+    enum AcceleratorType
+    {
+        ACCEL_KDTREE = 0,
+        ACCEL_BVH,
+        ACCEL_BVH4,
+        ACCEL_BVH8
+    };
+
+    // How indirect diffuse light is gathered
+    enum Integrator
+    {
+        INTEGRATOR_SPLITTING = 0,   // GISamples child rays at every hit
+        INTEGRATOR_PATH             // One continuation ray, ended by Russian roulette
+    };
+
     struct RenderSettings
     {
         RenderSettings();
 
         uint32_t maxDepth;
         uint32_t GISamples;
+        Integrator integrator;
+        uint32_t rouletteDepth; // Bounces before paths may be terminated
         float bias;
         float lightRadius;
+        uint32_t tileSize;
+        uint32_t targetSamples; // Per pixel, 0 for a single pass
+        float timeBudget;       // Seconds, 0 for none
+        float writeInterval;    // Seconds between intermediate images, 0 for none
+
+        // Adaptive sampling, used instead of targetSamples if the threshold
+        // is set. maxSamples is rounded down to whole passes. See
+        // ImageBuffer::needsSamples().
+        uint32_t minSamples;
+        uint32_t maxSamples;
+        float adaptiveThreshold;
+
+        // Irradiance caching of the indirect light at primary hits, off
+        // unless the max error is set. See IrradianceCache.
+        float irradianceCacheError;
+        uint32_t irradianceCacheSamples;    // Hemisphere rays per record
+        uint32_t irradianceCachePrepass;    // Pixel stride of the seeding pass, 0 for none
+
+        // Photons shot before rendering, 0 for no photon map. GI rays
+        // are shaded from the nearest photonLookup photons.
+        uint32_t photons;
+        uint32_t photonLookup;
+
+        // Shadow rays toward the emissive triangles per hit, 0 to only
+        // find them with GI rays
+        uint32_t emissiveSamples;
+
+        // Local lights sampled per hit from the LightTree, 0 to shade
+        // every light at every hit
+        uint32_t lightsPerHit;
     };
 
     void prepareForRendering();
-    void render(const std::string& filename, uint32_t maxThreads);
+    void render(const std::string& filename);
     void setCamera(Camera* cam) { mCam = cam; }
-    Mesh& allocateMesh(uint32_t numberOfVerticies);
+    Mesh& allocateMesh(uint32_t numberOfVerticies, uint32_t numberOfTriangles);
     void addLight(ILight* lgt) { mLights.push_back(lgt); }
     void setMaxDepth(uint32_t depth) { mSettings.maxDepth = depth; }
     void setNumGISamples(uint32_t numSamples) { mSettings.GISamples = numSamples; }
+    void setIntegrator(Integrator integrator) { mSettings.integrator = integrator; }
+    void setRouletteDepth(uint32_t depth) { mSettings.rouletteDepth = depth; }
     void setBias(float bias) { mSettings.bias = bias; }
     void setLightRadius(float radius) { mSettings.lightRadius = radius; }
+    void setTileSize(uint32_t size) { mSettings.tileSize = size; }
+    void setTargetSamples(uint32_t samples) { mSettings.targetSamples = samples; }
+    void setTimeBudget(float seconds) { mSettings.timeBudget = seconds; }
+    void setWriteInterval(float seconds) { mSettings.writeInterval = seconds; }
+    void setAdaptiveSampling(uint32_t minSamples, uint32_t maxSamples, float threshold);
+    void setIrradianceCache(float maxError, uint32_t numSamples, uint32_t prepassStride);
+    void setPhotonMap(uint32_t numPhotons, uint32_t lookupSize);
+    void setEmissiveSamples(uint32_t numSamples) { mSettings.emissiveSamples = numSamples; }
+    void setLightsPerHit(uint32_t numLights) { mSettings.lightsPerHit = numLights; }
+    void setTileOrder(Sampler::TileOrder order) { mTileOrder = order; }
     void setImageSize(uint32_t width, uint32_t height);
     void setEnvSphereImage(const std::string& file);
     void setShadowRays(uint32_t num);
+    void setAccelerator(AcceleratorType type) { mAcceleratorType = type; }
+    void setKdTreeBuildMode(KdTree::BuildMode mode) { mKdTreeBuildMode = mode; }
+    void setKdTreeCache(const std::string& directory, bool forceRebuild);
 
     bool hasCamera() const { return mCam != nullptr; }
 
+    // Memory the meshes' triangle pools take
+    void printLoadStats() const;
+
     const RenderSettings& renderSettings() const { return mSettings; }
+    const EmissiveLights& emissiveLights() const { return mEmissiveLights; }
+
+    // Empty unless lights are sampled per hit, the distant lights are the
+    // ones left out of it
+    const LightTree& lightTree() const { return mLightTree; }
+    ConstLightIter distantLightsBegin() const { return mDistantLights.begin(); }
+    ConstLightIter distantLightsEnd() const { return mDistantLights.end(); }
     
     ConstLightIter lightsBegin() const { return mLights.begin(); }
     ConstLightIter lightsEnd() const { return mLights.end(); }
@@ -67,13 +146,25 @@ private:
     ~Scene();
 
     void createBuffer();
+    void createAccelerator();
+    AABBox bounds() const;
+    void shootPhotons(PhotonMap& photonMap,
+                      const std::vector<std::unique_ptr<Raytracer> >& tracers) const;
 
     Camera*                 mCam;
     Sampler*                mSampler;
     ImageBuffer*            mImgBuffer;
-    KdTree*                 mKdTree;
+    IAccelerator*           mAccelerator;
+    AcceleratorType         mAcceleratorType;
+    KdTree::BuildMode       mKdTreeBuildMode;
+    std::string             mKdTreeCacheDirectory;
+    bool                    mForceKdTreeRebuild;
+    Sampler::TileOrder      mTileOrder;
     EnvSphere*              mEnvSphere;
     LightVector             mLights;
+    EmissiveLights          mEmissiveLights;
+    LightTree               mLightTree;
+    LightVector             mDistantLights;
     RenderSettings          mSettings;
     MeshList                mMeshes;
     
@@ -0,0 +1,71 @@
+#include <algorithm>
+
+#include "scratch_arena.h"
+#include "common.h"
+
+
+ScratchArena::ScratchArena()
+    : mBlocks()
+    , mCurrentBlock(0)
+    , mOffset(0)
+{
+}
+
+ScratchArena::~ScratchArena()
+{
+    for (Block& block : mBlocks)
+    {
+        delete[] block.memory;
+    }
+}
+
+void* ScratchArena::allocate(size_t size, size_t alignment)
+{
+    TP_ASSERT(alignment > 0 && (alignment & (alignment - 1)) == 0);
+
+    // The first block from the current one on that the allocation fits in
+    while (mCurrentBlock < mBlocks.size())
+    {
+        const Block& block = mBlocks[mCurrentBlock];
+        const uintptr_t start = reinterpret_cast<uintptr_t>(block.memory) + mOffset;
+        const size_t padding = (alignment - (start & (alignment - 1))) & (alignment - 1);
+        if (mOffset + padding + size <= block.size)
+        {
+            mOffset += padding + size;
+            return block.memory + mOffset - size;
+        }
+
+        ++mCurrentBlock;
+        mOffset = 0;
+    }
+
+    // new[] aligns to max_align_t only, pad for larger alignments
+    const size_t blockSize = std::max((size_t)SCRATCH_ARENA_BLOCK_SIZE, size + alignment);
+    mBlocks.push_back({ new char[blockSize], blockSize });
+    mCurrentBlock = mBlocks.size() - 1;
+    mOffset = 0;
+    return allocate(size, alignment);
+}
+
+void ScratchArena::reset()
+{
+    mCurrentBlock = 0;
+    mOffset = 0;
+}
+
+void ScratchArena::release(const Marker& marker)
+{
+    TP_ASSERT(marker.block <= mCurrentBlock);
+    mCurrentBlock = marker.block;
+    mOffset = marker.offset;
+}
+
+size_t ScratchArena::capacity() const
+{
+    size_t total = 0;
+    for (const Block& block : mBlocks)
+    {
+        total += block.size;
+    }
+    return total;
+}
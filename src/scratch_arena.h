@@ -0,0 +1,72 @@
+#ifndef __SCRATCH_ARENA_H__
+#define __SCRATCH_ARENA_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Size of the arena's blocks, allocations larger than this get a block
+// of their own
+#define SCRATCH_ARENA_BLOCK_SIZE (64 * 1024)
+
+
+// Bump allocator for the objects that only live while one sample is
+// shaded, e.g. light samplers and shadow rays. Every tracer owns one and
+// resets it after each sample. The blocks are kept on reset, so once they
+// have grown to what a sample needs shading allocates nothing from the
+// heap. Destructors are never run, only objects that don't own resources
+// may be created in it.
+class ScratchArena
+{
+public:
+    explicit ScratchArena();
+    ~ScratchArena();
+
+    void* allocate(size_t size, size_t alignment);
+
+    template <typename T>
+    T* allocateArray(size_t count)
+    {
+        return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Everything allocated since the last reset is invalid afterwards
+    void reset();
+
+    // Frees what was allocated after the marker was taken, for callers
+    // that are done with their scratch memory before the sample is
+    struct Marker
+    {
+        size_t  block;
+        size_t  offset;
+    };
+
+    Marker mark() const { return { mCurrentBlock, mOffset }; }
+    void release(const Marker& marker);
+
+    size_t capacity() const;
+
+private:
+    struct Block
+    {
+        char*   memory;
+        size_t  size;
+    };
+
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+
+    std::vector<Block>  mBlocks;
+    size_t              mCurrentBlock;
+    size_t              mOffset;
+};
+
+#endif
@@ -4,6 +4,10 @@
 #include <iostream>
 #include <locale>
 #include <vector>
+#include <stack>
+#include <unordered_map>
+#include <unordered_set>
+#include <iomanip>
 #include <stdexcept>
 #include <glm/glm.hpp>
 
@@ -38,21 +42,60 @@ bool readValues(std::stringstream &lineStream, const int num, float* values)
 struct TriangleIndicies
 {
     TriangleIndicies()
-        : startVertexIndex(0)
+        : a(0)
+        , b(0)
+        , c(0)
         , material(nullptr)
     {
     }
 
-    TriangleIndicies(uint32_t startIdx, Material* _material)
-        : startVertexIndex(startIdx)
+    TriangleIndicies(uint32_t _a, uint32_t _b, uint32_t _c, Material* _material)
+        : a(_a)
+        , b(_b)
+        , c(_c)
         , material(_material)
     {
     }
 
-    uint32_t startVertexIndex;
+    uint32_t a, b, c;
     Material* material;
 };
 
+struct MaterialHash
+{
+    size_t operator()(const Material* material) const { return material->hash(); }
+};
+
+struct MaterialEqual
+{
+    bool operator()(const Material* a, const Material* b) const { return *a == *b; }
+};
+
+typedef std::unordered_set<Material*, MaterialHash, MaterialEqual> MaterialSet;
+
+// The material the next triangles get, only cloned the first time its
+// parameters are seen
+Material* internMaterial(MaterialSet& materials, Material& currMaterial)
+{
+    MaterialSet::const_iterator it = materials.find(&currMaterial);
+    if (it != materials.end())
+    {
+        return *it;
+    }
+
+    Material* material = currMaterial.clone();
+    materials.insert(material);
+    return material;
+}
+
+// A vertex is transformed once for every transform it's used with. Each
+// transform a command sets gets a new id, pushes and pops save and restore
+// the id with the matrix.
+inline uint64_t transformedVertexKey(uint32_t transformId, uint32_t vertexIdx)
+{
+    return ((uint64_t)transformId << 32) | vertexIdx;
+}
+
 } // annoymous namespace
 
 SimpleParser::SimpleParser()
@@ -75,8 +118,13 @@ std::string SimpleParser::parse(const std::string& file, Scene& scene)
     std::vector<glm::vec3> verticies;
     std::vector<glm::vec3> transformedVerticies;
     std::vector<TriangleIndicies> triangleIndicies;
+    std::unordered_map<uint64_t, uint32_t> transformedVertexIndicies;
+    std::stack<uint32_t> transformIds;
+    uint32_t transformId = 0;
+    uint32_t nextTransformId = 1;
     float values[10]; // Buffer for values
     Material currMaterial;
+    MaterialSet materials;
     
     // Defaults
     float constAtten = 1.0f;
@@ -154,24 +202,39 @@ std::string SimpleParser::parse(const std::string& file, Scene& scene)
         else if (cmd == "pushTransform")
         {
             tStack.push();
+            transformIds.push(transformId);
         }
         else if (cmd == "popTransform")
         {
             tStack.pop();
+            if (!transformIds.empty())
+            {
+                transformId = transformIds.top();
+                transformIds.pop();
+            }
         }
         else if (cmd == "tri")
         {
             if (readValues(lineStream, 3, values))
             {
-                transformedVerticies.emplace_back(
-                    tStack.transformPoint(verticies[(size_t)values[0]]));
-                transformedVerticies.emplace_back(
-                    tStack.transformPoint(verticies[(size_t)values[1]]));
-                transformedVerticies.emplace_back(
-                    tStack.transformPoint(verticies[(size_t)values[2]]));
+                uint32_t indicies[3];
+                for (unsigned i = 0; i < 3; ++i)
+                {
+                    const uint32_t vertexIdx = (uint32_t)values[i];
+                    auto inserted = transformedVertexIndicies.emplace(
+                        transformedVertexKey(transformId, vertexIdx),
+                        (uint32_t)transformedVerticies.size());
+                    if (inserted.second)
+                    {
+                        transformedVerticies.emplace_back(
+                            tStack.transformPoint(verticies[vertexIdx]));
+                    }
 
-                triangleIndicies.emplace_back(
-                    transformedVerticies.size() - 3, currMaterial.clone());
+                    indicies[i] = inserted.first->second;
+                }
+
+                triangleIndicies.emplace_back(indicies[0], indicies[1], indicies[2],
+                                              internMaterial(materials, currMaterial));
             }
         }
         else if (cmd == "envsphere")
@@ -183,17 +246,26 @@ std::string SimpleParser::parse(const std::string& file, Scene& scene)
         else if (cmd == "translate")
         {
             if (readValues(lineStream, 3, values))
+            {
                 tStack.translate(values[0], values[1], values[2]);
+                transformId = nextTransformId++;
+            }
         }
         else if (cmd == "scale")
         {
             if (readValues(lineStream, 3, values))
+            {
                 tStack.scale(values[0], values[1], values[2]);
+                transformId = nextTransformId++;
+            }
         }
         else if (cmd == "rotate")
         {
             if (readValues(lineStream, 4, values))
+            {
                 tStack.rotate(glm::vec3(values[0], values[1], values[2]), values[3]);
+                transformId = nextTransformId++;
+            }
         }
         else if (cmd == "ambient")
         {
@@ -296,26 +368,30 @@ std::string SimpleParser::parse(const std::string& file, Scene& scene)
     } while (in);
 
     // Now that we know how many transformed verts we have, actually put
-    // the verticies and triangles in the mesh.
-    Mesh& triangleMesh = scene.allocateMesh((uint32_t)transformedVerticies.size());
+    // the verticies and triangles in the mesh. The verticies are shared
+    // between faces so they get no normal, the triangles are flat shaded.
+    Mesh& triangleMesh = scene.allocateMesh((uint32_t)transformedVerticies.size(),
+                                            (uint32_t)triangleIndicies.size());
 
-    uint32_t vertexIndex = 0;
-    for (const TriangleIndicies& ti : triangleIndicies)
+    for (const glm::vec3& position : transformedVerticies)
     {
-        // Assumes each triangle has a unique set of vertices
-        const glm::vec3& a = transformedVerticies[ti.startVertexIndex];
-        const glm::vec3& b = transformedVerticies[ti.startVertexIndex + 1];
-        const glm::vec3& c = transformedVerticies[ti.startVertexIndex + 2];
-        glm::vec3 Ng = glm::normalize(glm::cross(a - b, a - c));
-
-        triangleMesh.addVertex(a, Ng, glm::vec2(0.f));
-        triangleMesh.addVertex(b, Ng, glm::vec2(0.f));
-        triangleMesh.addVertex(c, Ng, glm::vec2(0.f));
+        triangleMesh.addVertex(position, glm::vec3(0.f), glm::vec2(0.f));
+    }
 
-        triangleMesh.addPrimitive(
-            vertexIndex, vertexIndex + 1, vertexIndex + 2, ti.material);
+    for (const TriangleIndicies& ti : triangleIndicies)
+    {
+        triangleMesh.addPrimitive(ti.a, ti.b, ti.c, ti.material);
+    }
 
-        vertexIndex += 3;
+    if (!triangleIndicies.empty())
+    {
+        const size_t numTriangles = triangleIndicies.size();
+        std::cout << "Parser Dedup Stats:" << std::endl;
+        std::cout << std::left << std::setw(22) << "  Materials:" << materials.size()
+            << " (" << (double)numTriangles / (double)materials.size() << " tris each)" << std::endl;
+        std::cout << std::left << std::setw(22) << "  Vertices:" << transformedVerticies.size()
+            << " (" << (double)(numTriangles * 3) / (double)transformedVerticies.size()
+            << " uses each)" << std::endl;
     }
 
     std::locale::global(oldLocale);
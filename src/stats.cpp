@@ -6,6 +6,15 @@
 Stats::Stats()
     : boxTests(0)
     , primitiveTests(0)
+    , packetRays(0)
+    , culledRays(0)
+    , irradianceLookups(0)
+    , irradianceRecords(0)
+    , shadowFirstPasses(0)
+    , shadowSecondPassesSkipped(0)
+    , occluderCacheLookups(0)
+    , occluderCacheHits(0)
+    , occluderHintHits(0)
 {
     for (unsigned i = 0; i < Ray::TYPE_COUNT; ++i)
     {
@@ -22,4 +31,13 @@ void Stats::accumulate(const Stats& other)
 
     boxTests += other.boxTests;
     primitiveTests += other.primitiveTests;
+    packetRays += other.packetRays;
+    culledRays += other.culledRays;
+    irradianceLookups += other.irradianceLookups;
+    irradianceRecords += other.irradianceRecords;
+    shadowFirstPasses += other.shadowFirstPasses;
+    shadowSecondPassesSkipped += other.shadowSecondPassesSkipped;
+    occluderCacheLookups += other.occluderCacheLookups;
+    occluderCacheHits += other.occluderCacheHits;
+    occluderHintHits += other.occluderHintHits;
 }
@@ -15,6 +15,15 @@ public:
     uint64_t rayCounts[Ray::TYPE_COUNT];
     uint64_t boxTests;
     uint64_t primitiveTests;
+    uint64_t packetRays;
+    uint64_t culledRays;
+    uint64_t irradianceLookups;
+    uint64_t irradianceRecords;
+    uint64_t shadowFirstPasses;
+    uint64_t shadowSecondPassesSkipped;
+    uint64_t occluderCacheLookups;
+    uint64_t occluderCacheHits;
+    uint64_t occluderHintHits;
 private:
     Stats(const Stats&) = delete;
     Stats& operator=(const Stats&) = delete;
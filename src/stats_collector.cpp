@@ -19,6 +19,7 @@ namespace
             CASE(Ray::REFRACTED, "Refraction rays");
             CASE(Ray::GI, "GI rays");
             CASE(Ray::SHADOW, "Shadow rays");
+            CASE(Ray::PHOTON, "Photon rays");
             default: break;
         }
 #undef CASE
@@ -57,6 +58,44 @@ void StatsCollector::print() const
         << " (" << (double)allThreadStats.boxTests / (double)totalRaysCast << " per ray)" << std::endl;
     std::cout << std::left << std::setw(22) << "  Primitive Tests: " << allThreadStats.primitiveTests
         << " (" << (double)allThreadStats.primitiveTests / (double)totalRaysCast << " per ray)" << std::endl;
+    std::cout << std::left << std::setw(22) << "  Packet Rays:" << allThreadStats.packetRays
+        << " (" << 100.0 * (double)allThreadStats.packetRays / (double)totalRaysCast << "%)" << std::endl;
+    std::cout << std::left << std::setw(22) << "  Culled Rays:" << allThreadStats.culledRays
+        << " (" << 100.0 * (double)allThreadStats.culledRays / (double)totalRaysCast << "%)" << std::endl;
+
+    if (allThreadStats.irradianceLookups > 0)
+    {
+        const uint64_t interpolated = allThreadStats.irradianceLookups - allThreadStats.irradianceRecords;
+        std::cout << "\nIrradiance Cache Stats:" << std::endl;
+        std::cout << std::left << std::setw(22) << "  Lookups:" << allThreadStats.irradianceLookups << std::endl;
+        std::cout << std::left << std::setw(22) << "  Records:" << allThreadStats.irradianceRecords << std::endl;
+        std::cout << std::left << std::setw(22) << "  Interpolated:" << interpolated
+            << " (" << 100.0 * (double)interpolated / (double)allThreadStats.irradianceLookups << "%)" << std::endl;
+    }
+
+    if (allThreadStats.shadowFirstPasses > 0 || allThreadStats.occluderCacheLookups > 0)
+    {
+        std::cout << "\nShadow Ray Stats:" << std::endl;
+    }
+
+    if (allThreadStats.shadowFirstPasses > 0)
+    {
+        std::cout << std::left << std::setw(22) << "  First passes:" << allThreadStats.shadowFirstPasses << std::endl;
+        std::cout << std::left << std::setw(22) << "  Skipped passes:" << allThreadStats.shadowSecondPassesSkipped
+            << " (" << 100.0 * (double)allThreadStats.shadowSecondPassesSkipped / (double)allThreadStats.shadowFirstPasses
+            << "%)" << std::endl;
+    }
+
+    if (allThreadStats.occluderCacheLookups > 0)
+    {
+        std::cout << std::left << std::setw(22) << "  Occluder lookups:" << allThreadStats.occluderCacheLookups << std::endl;
+        std::cout << std::left << std::setw(22) << "  Occluder hits:" << allThreadStats.occluderCacheHits
+            << " (" << 100.0 * (double)allThreadStats.occluderCacheHits / (double)allThreadStats.occluderCacheLookups
+            << "%)" << std::endl;
+        std::cout << std::left << std::setw(22) << "  Leaf hint hits:" << allThreadStats.occluderHintHits
+            << " (" << 100.0 * (double)allThreadStats.occluderHintHits / (double)allThreadStats.occluderCacheLookups
+            << "%)" << std::endl;
+    }
 }
 
 uint64_t StatsCollector::totalRaysCast() const
@@ -0,0 +1,286 @@
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "thread_pool.h"
+#include "common.h"
+
+namespace
+{
+thread_local uint32_t sWorkerIndex = ThreadPool::NOT_A_WORKER;
+} // anonymous namespace
+
+
+// Global static pointer for singleton
+ThreadPool* ThreadPool::sInstance = nullptr;
+
+ThreadPool& ThreadPool::instance()
+{
+    TP_ASSERT(sInstance != nullptr);
+    return *sInstance;
+}
+
+void ThreadPool::create(uint32_t maxWorkers)
+{
+    TP_ASSERT(sInstance == nullptr);
+
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numCpus < 1)
+    {
+        std::stringstream ss;
+        ss << "Error getting number of CPUs: " << strerror(errno);
+        throw std::runtime_error(ss.str());
+    }
+
+    sInstance = new ThreadPool(std::max(1u, std::min((uint32_t)numCpus, maxWorkers)));
+}
+
+void ThreadPool::destroy()
+{
+    delete sInstance;
+    sInstance = nullptr;
+}
+
+uint32_t ThreadPool::workerIndex()
+{
+    return sWorkerIndex;
+}
+
+ThreadPool::ThreadPool(uint32_t numWorkers)
+    : mWorkers()
+    , mQueuedTasks(0)
+    , mNextWorker(0)
+    , mSleepLock()
+    , mWakeUp()
+    , mShutdown(false)
+{
+    mWorkers.reserve(numWorkers);
+    for (uint32_t i = 0; i < numWorkers; ++i)
+    {
+        mWorkers.emplace_back(std::make_unique<Worker>());
+    }
+
+    // Only start once every deque exists, workers steal from all of them
+    for (uint32_t i = 0; i < numWorkers; ++i)
+    {
+        mWorkers[i]->thread = std::thread(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mSleepLock);
+        mShutdown = true;
+    }
+    mWakeUp.notify_all();
+
+    for (std::unique_ptr<Worker>& worker : mWorkers)
+    {
+        worker->thread.join();
+    }
+}
+
+void ThreadPool::push(Task&& task, uint32_t worker)
+{
+    {
+        std::lock_guard<std::mutex> lock(mWorkers[worker]->lock);
+        mWorkers[worker]->tasks.emplace_back(std::move(task));
+    }
+
+    // Sleeping workers check the count under mSleepLock, taking it once
+    // makes sure none of them misses the notify
+    mQueuedTasks.fetch_add(1, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lock(mSleepLock);
+    }
+    mWakeUp.notify_one();
+}
+
+bool ThreadPool::pop(uint32_t worker, Task& task)
+{
+    if (mQueuedTasks.load(std::memory_order_acquire) == 0)
+    {
+        return false;
+    }
+
+    // Newest task of our own first, it's the most likely to still be in cache
+    {
+        Worker& self = *mWorkers[worker];
+        std::lock_guard<std::mutex> lock(self.lock);
+        if (!self.tasks.empty())
+        {
+            task = std::move(self.tasks.back());
+            self.tasks.pop_back();
+            mQueuedTasks.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    // Steal the oldest task of another worker, the furthest from what that
+    // worker is busy with
+    for (uint32_t i = 1; i < mWorkers.size(); ++i)
+    {
+        Worker& victim = *mWorkers[(worker + i) % mWorkers.size()];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            mQueuedTasks.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::execute(Task& task)
+{
+    std::exception_ptr error;
+    if (!task.group->isCanceled())
+    {
+        try
+        {
+            task.func();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+    }
+
+    // Releases what the task captured before the group can go away
+    task.func = nullptr;
+    task.group->finish(error);
+}
+
+void ThreadPool::workerLoop(uint32_t worker)
+{
+    sWorkerIndex = worker;
+
+    Task task;
+    while (true)
+    {
+        if (pop(worker, task))
+        {
+            execute(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mSleepLock);
+        mWakeUp.wait(lock, [this]()
+        {
+            return mShutdown || mQueuedTasks.load(std::memory_order_acquire) > 0;
+        });
+
+        if (mShutdown && mQueuedTasks.load(std::memory_order_acquire) == 0)
+        {
+            break;
+        }
+    }
+}
+
+
+TaskGroup::TaskGroup()
+    : mPool(ThreadPool::instance())
+    , mPending(0)
+    , mCanceled(false)
+    , mLock()
+    , mDone()
+    , mError()
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    // Only left with pending tasks while unwinding, they may still
+    // reference the stack so they have to finish first.
+    if (mPending.load(std::memory_order_acquire) > 0)
+    {
+        cancel();
+        try
+        {
+            wait();
+        }
+        catch (...)
+        {
+        }
+    }
+}
+
+void TaskGroup::run(std::function<void()> func)
+{
+    uint32_t worker = ThreadPool::workerIndex();
+    if (worker == ThreadPool::NOT_A_WORKER)
+    {
+        worker = mPool.mNextWorker.fetch_add(1, std::memory_order_relaxed) % mPool.numWorkers();
+    }
+
+    run(std::move(func), worker);
+}
+
+void TaskGroup::run(std::function<void()> func, uint32_t worker)
+{
+    TP_ASSERT(worker < mPool.numWorkers());
+
+    mPending.fetch_add(1, std::memory_order_relaxed);
+    ThreadPool::Task task;
+    task.func = std::move(func);
+    task.group = this;
+    mPool.push(std::move(task), worker);
+}
+
+void TaskGroup::wait()
+{
+    const uint32_t worker = ThreadPool::workerIndex();
+    if (worker != ThreadPool::NOT_A_WORKER)
+    {
+        ThreadPool::Task task;
+        while (mPending.load(std::memory_order_acquire) > 0)
+        {
+            if (mPool.pop(worker, task))
+            {
+                mPool.execute(task);
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Also makes sure the last finish() is done with the group
+    std::unique_lock<std::mutex> lock(mLock);
+    mDone.wait(lock, [this]()
+    {
+        return mPending.load(std::memory_order_acquire) == 0;
+    });
+
+    if (mError)
+    {
+        std::exception_ptr error = mError;
+        mError = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void TaskGroup::finish(std::exception_ptr error)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    if (error)
+    {
+        if (!mError)
+        {
+            mError = error;
+        }
+        cancel();
+    }
+
+    if (mPending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        mDone.notify_all();
+    }
+}
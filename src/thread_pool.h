@@ -0,0 +1,139 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+
+// Worker threads that live for the whole process. Every worker has its own
+// deque of tasks, it runs the newest task of its own and once that's empty
+// steals the oldest one of another worker.
+class ThreadPool
+{
+public:
+    enum
+    {
+        NOT_A_WORKER = 0xffffffff
+    };
+
+    static ThreadPool& instance();
+
+    // One worker per CPU, but no more than maxWorkers
+    static void create(uint32_t maxWorkers);
+    static void destroy();
+
+    uint32_t numWorkers() const { return (uint32_t)mWorkers.size(); }
+
+    // Index of the worker calling, NOT_A_WORKER on any other thread
+    static uint32_t workerIndex();
+
+    // Runs func(begin, end) over chunks of [0, count) and returns once all
+    // of them are done
+    template <typename Func>
+    void parallelFor(uint32_t count, const Func& func);
+
+private:
+    friend class TaskGroup;
+
+    struct Task
+    {
+        std::function<void()>   func;
+        TaskGroup*              group;
+    };
+
+    struct Worker
+    {
+        std::mutex              lock;
+        std::deque<Task>        tasks;
+        std::thread             thread;
+    };
+
+    explicit ThreadPool(uint32_t numWorkers);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void push(Task&& task, uint32_t worker);
+    bool pop(uint32_t worker, Task& task);
+    void execute(Task& task);
+    void workerLoop(uint32_t worker);
+
+    std::vector<std::unique_ptr<Worker> > mWorkers;
+    std::atomic_uint        mQueuedTasks;
+    std::atomic_uint        mNextWorker;
+    std::mutex              mSleepLock;
+    std::condition_variable mWakeUp;
+    bool                    mShutdown; // Guarded by mSleepLock
+
+    static ThreadPool* sInstance;
+};
+
+
+// Tasks that are waited for together. Canceling the group drops the tasks
+// that haven't started yet, running ones poll isCanceled() to stop early.
+// A task throwing cancels the group, wait() rethrows the exception.
+class TaskGroup
+{
+public:
+    explicit TaskGroup();
+    ~TaskGroup();
+
+    // Queues the task on the calling worker, threads outside the pool spread
+    // their tasks over all workers
+    void run(std::function<void()> func);
+    void run(std::function<void()> func, uint32_t worker);
+
+    // Workers keep running tasks while they wait, so tasks can wait on
+    // groups of their own
+    void wait();
+
+    void cancel() { mCanceled.store(true, std::memory_order_relaxed); }
+    bool isCanceled() const { return mCanceled.load(std::memory_order_relaxed); }
+
+private:
+    friend class ThreadPool;
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    void finish(std::exception_ptr error);
+
+    ThreadPool&             mPool;
+    std::atomic_uint        mPending;
+    std::atomic_bool        mCanceled;
+    std::mutex              mLock;
+    std::condition_variable mDone;
+    std::exception_ptr      mError; // Guarded by mLock
+};
+
+
+template <typename Func>
+void ThreadPool::parallelFor(uint32_t count, const Func& func)
+{
+    // A few chunks per worker so stealing can even out uneven chunks
+    const uint32_t numChunks = std::min(count, numWorkers() * 4);
+    TaskGroup tasks;
+    for (uint32_t chunk = 0; chunk < numChunks; ++chunk)
+    {
+        const uint32_t begin = (uint32_t)((uint64_t)count * chunk / numChunks);
+        const uint32_t end = (uint32_t)((uint64_t)count * (chunk + 1) / numChunks);
+        tasks.run([&func, begin, end]()
+        {
+            func(begin, end);
+        });
+    }
+    tasks.wait();
+}
+
+#endif
@@ -74,6 +74,13 @@ glm::vec3 Triangle::interpolateNormal(const glm::vec3& p, const glm::vec2& baryc
         + mB->normal * barycentrics.y
         + mA->normal * (1.f - (barycentrics.x + barycentrics.y));
 
+    // Vertices shared by faces without shading normals have none, the
+    // triangle is flat shaded
+    if (glm::dot(normal, normal) <= EPSILON)
+    {
+        return mNg;
+    }
+
     return glm::normalize(normal);
 }
 
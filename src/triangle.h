@@ -20,7 +20,12 @@ public:
     bool intersect(Ray& ray) const;
     const Material& material() const;
 
+    const Vertex& vertexA() const { return *mA; }
+    const Vertex& vertexB() const { return *mB; }
+    const Vertex& vertexC() const { return *mC; }
+
     const glm::vec3& normal() const;
+    // The geometric normal if the vertices have no normals
     glm::vec3 interpolateNormal(const glm::vec3& p, const glm::vec2& barycentrics) const;
     glm::vec2 uv(const glm::vec2& barycentrics) const;
     void positionPartials(const glm::vec3& N, glm::vec3& dPdU, glm::vec3& dPdV) const;
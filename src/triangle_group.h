@@ -0,0 +1,169 @@
+#ifndef __TRIANGLE_GROUP_H__
+#define __TRIANGLE_GROUP_H__
+
+#include <cstdint>
+
+#include "common.h"
+#include "ray.h"
+#include "triangle.h"
+#include "vector.h"
+#include "vertex.h"
+
+
+// Width triangles packed SoA so one ray is intersected with all of them at
+// once (Moller-Trumbore). The geometric normal is kept alongside vertex A and
+// the edges to B and C so back faces are decided exactly like
+// Triangle::intersect() does.
+template <uint32_t Width>
+struct alignas(sizeof(float) * Width) TriangleGroup
+{
+    using SimdType = SimdVector<Width>;
+
+    explicit TriangleGroup();
+
+    void set(uint32_t lane, const Triangle* triangle);
+
+    // Intersects the lanes set in laneMask and records the closest hit in the
+    // ray, returns false if none of them is hit.
+    bool intersect(Ray& ray, uint32_t laneMask) const;
+
+    float           a[3][Width];
+    float           edgeB[3][Width];
+    float           edgeC[3][Width];
+    float           normal[3][Width];
+    const Triangle* triangles[Width];
+};
+
+
+template <uint32_t Width>
+TriangleGroup<Width>::TriangleGroup()
+{
+    for (uint32_t lane = 0; lane < Width; ++lane)
+    {
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            a[axis][lane] = 0.f;
+            edgeB[axis][lane] = 0.f;
+            edgeC[axis][lane] = 0.f;
+            normal[axis][lane] = 0.f;
+        }
+        triangles[lane] = nullptr;
+    }
+}
+
+template <uint32_t Width>
+void TriangleGroup<Width>::set(uint32_t lane, const Triangle* triangle)
+{
+    TP_ASSERT(lane < Width);
+
+    const glm::vec3& A = triangle->vertexA().position;
+    const glm::vec3 B = triangle->vertexB().position - A;
+    const glm::vec3 C = triangle->vertexC().position - A;
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        a[axis][lane] = A[axis];
+        edgeB[axis][lane] = B[axis];
+        edgeC[axis][lane] = C[axis];
+        normal[axis][lane] = triangle->normal()[axis];
+    }
+    triangles[lane] = triangle;
+}
+
+template <uint32_t Width>
+bool TriangleGroup<Width>::intersect(Ray& ray, uint32_t laneMask) const
+{
+    using V = typename SimdType::Type;
+
+    const V dx = SimdType::set1(ray.dir().x);
+    const V dy = SimdType::set1(ray.dir().y);
+    const V dz = SimdType::set1(ray.dir().z);
+
+    // > EPSILON -> backface, otherwise within EPSILON -> parallel
+    const V denom = SimdType::add(SimdType::add(
+        SimdType::mul(dx, SimdType::load(normal[0])),
+        SimdType::mul(dy, SimdType::load(normal[1]))),
+        SimdType::mul(dz, SimdType::load(normal[2])));
+    uint32_t facing = SimdType::lessEqualMask(denom, SimdType::set1(-EPSILON));
+    const uint32_t backFacing = SimdType::lessMask(SimdType::set1(EPSILON), denom);
+    if (ray.shouldHitBackFaces())
+    {
+        facing |= backFacing;
+    }
+
+    laneMask &= facing;
+    if (!laneMask)
+    {
+        return false;
+    }
+
+    const V e1x = SimdType::load(edgeB[0]);
+    const V e1y = SimdType::load(edgeB[1]);
+    const V e1z = SimdType::load(edgeB[2]);
+    const V e2x = SimdType::load(edgeC[0]);
+    const V e2y = SimdType::load(edgeC[1]);
+    const V e2z = SimdType::load(edgeC[2]);
+
+    // P = D x E2
+    const V px = SimdType::sub(SimdType::mul(dy, e2z), SimdType::mul(dz, e2y));
+    const V py = SimdType::sub(SimdType::mul(dz, e2x), SimdType::mul(dx, e2z));
+    const V pz = SimdType::sub(SimdType::mul(dx, e2y), SimdType::mul(dy, e2x));
+
+    const V det = SimdType::add(SimdType::add(
+        SimdType::mul(e1x, px), SimdType::mul(e1y, py)), SimdType::mul(e1z, pz));
+    const V invDet = SimdType::div(SimdType::set1(1.f), det);
+
+    // T = O - A
+    const V tx = SimdType::sub(SimdType::set1(ray.origin().x), SimdType::load(a[0]));
+    const V ty = SimdType::sub(SimdType::set1(ray.origin().y), SimdType::load(a[1]));
+    const V tz = SimdType::sub(SimdType::set1(ray.origin().z), SimdType::load(a[2]));
+
+    const V u = SimdType::mul(SimdType::add(SimdType::add(
+        SimdType::mul(tx, px), SimdType::mul(ty, py)), SimdType::mul(tz, pz)), invDet);
+
+    // Q = T x E1
+    const V qx = SimdType::sub(SimdType::mul(ty, e1z), SimdType::mul(tz, e1y));
+    const V qy = SimdType::sub(SimdType::mul(tz, e1x), SimdType::mul(tx, e1z));
+    const V qz = SimdType::sub(SimdType::mul(tx, e1y), SimdType::mul(ty, e1x));
+
+    const V v = SimdType::mul(SimdType::add(SimdType::add(
+        SimdType::mul(dx, qx), SimdType::mul(dy, qy)), SimdType::mul(dz, qz)), invDet);
+    const V t = SimdType::mul(SimdType::add(SimdType::add(
+        SimdType::mul(e2x, qx), SimdType::mul(e2y, qy)), SimdType::mul(e2z, qz)), invDet);
+
+    const V zero = SimdType::set1(0.f);
+    laneMask &= SimdType::lessEqualMask(zero, u);
+    laneMask &= SimdType::lessEqualMask(zero, v);
+    laneMask &= SimdType::lessEqualMask(SimdType::add(u, v), SimdType::set1(1.f));
+    laneMask &= SimdType::lessEqualMask(zero, t);
+    laneMask &= SimdType::lessMask(SimdType::set1(ray.minT()), t);
+    laneMask &= SimdType::lessMask(t, SimdType::set1(ray.maxT()));
+    if (!laneMask)
+    {
+        return false;
+    }
+
+    alignas(sizeof(float) * Width) float ts[Width];
+    SimdType::store(ts, t);
+
+    uint32_t closest = (uint32_t)__builtin_ctz(laneMask);
+    for (laneMask &= laneMask - 1; laneMask; laneMask &= laneMask - 1)
+    {
+        const uint32_t lane = (uint32_t)__builtin_ctz(laneMask);
+        if (ts[lane] < ts[closest])
+        {
+            closest = lane;
+        }
+    }
+
+    alignas(sizeof(float) * Width) float us[Width];
+    alignas(sizeof(float) * Width) float vs[Width];
+    SimdType::store(us, u);
+    SimdType::store(vs, v);
+
+    // Barycentrics are the weights of C and B, see Triangle::interpolateNormal()
+    ray.hit(triangles[closest], ts[closest], glm::vec2(vs[closest], us[closest]),
+            ((backFacing >> closest) & 1) != 0);
+    return true;
+}
+
+#endif
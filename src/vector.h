@@ -9,5 +9,72 @@
 #ifndef trichoplax_Vector_h
 #define trichoplax_Vector_h
 
+#include <cstdint>
+#include <immintrin.h>
+
+
+// Thin wrappers over SSE and AVX so lane parallel code can be written once
+// for both widths. min() and max() return their second argument if either
+// one is NaN, so pass the value to keep second.
+template <uint32_t Width>
+struct SimdVector;
+
+template <>
+struct SimdVector<4>
+{
+    using Type = __m128;
+
+    static Type load(const float* p)            { return _mm_load_ps(p); }
+    static void store(float* p, Type v)         { _mm_store_ps(p, v); }
+    static Type set1(float v)                   { return _mm_set1_ps(v); }
+    static Type add(Type a, Type b)             { return _mm_add_ps(a, b); }
+    static Type sub(Type a, Type b)             { return _mm_sub_ps(a, b); }
+    static Type mul(Type a, Type b)             { return _mm_mul_ps(a, b); }
+    static Type div(Type a, Type b)             { return _mm_div_ps(a, b); }
+    static Type min(Type a, Type b)             { return _mm_min_ps(a, b); }
+    static Type max(Type a, Type b)             { return _mm_max_ps(a, b); }
+
+    // Bit i is set if a[i] <= b[i]
+    static uint32_t lessEqualMask(Type a, Type b)
+    {
+        return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(a, b));
+    }
+
+    // Bit i is set if a[i] < b[i]
+    static uint32_t lessMask(Type a, Type b)
+    {
+        return (uint32_t)_mm_movemask_ps(_mm_cmplt_ps(a, b));
+    }
+};
+
+#ifdef __AVX__
+template <>
+struct SimdVector<8>
+{
+    using Type = __m256;
+
+    static Type load(const float* p)            { return _mm256_load_ps(p); }
+    static void store(float* p, Type v)         { _mm256_store_ps(p, v); }
+    static Type set1(float v)                   { return _mm256_set1_ps(v); }
+    static Type add(Type a, Type b)             { return _mm256_add_ps(a, b); }
+    static Type sub(Type a, Type b)             { return _mm256_sub_ps(a, b); }
+    static Type mul(Type a, Type b)             { return _mm256_mul_ps(a, b); }
+    static Type div(Type a, Type b)             { return _mm256_div_ps(a, b); }
+    static Type min(Type a, Type b)             { return _mm256_min_ps(a, b); }
+    static Type max(Type a, Type b)             { return _mm256_max_ps(a, b); }
+
+    // Bit i is set if a[i] <= b[i]
+    static uint32_t lessEqualMask(Type a, Type b)
+    {
+        return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ));
+    }
+
+    // Bit i is set if a[i] < b[i]
+    static uint32_t lessMask(Type a, Type b)
+    {
+        return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+    }
+};
+#endif
 
 #endif
@@ -0,0 +1,177 @@
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include "wide_bvh.h"
+#include "aabbox.h"
+#include "common.h"
+#include "triangle.h"
+#include "ray.h"
+#include "timer.h"
+#include "stats.h"
+
+
+template <uint32_t Width>
+WideBVH<Width>::WideNode::WideNode()
+{
+    for (uint32_t slot = 0; slot < Width; ++slot)
+    {
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            planes[axis][slot] = std::numeric_limits<float>::infinity();
+            planes[axis + 3][slot] = -std::numeric_limits<float>::infinity();
+        }
+        children[slot] = 0;
+    }
+}
+
+template <uint32_t Width>
+void WideBVH<Width>::WideNode::setChild(uint32_t slot, const AABBox& bounds, uint32_t childRef)
+{
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        planes[axis][slot] = bounds.ll()[axis];
+        planes[axis + 3][slot] = bounds.ur()[axis];
+    }
+    children[slot] = childRef;
+}
+
+template <uint32_t Width>
+WideBVH<Width>::WideBVH()
+    : BVH()
+    , mWideNodes()
+    , mWideMaxDepth(0)
+    , mFilledSlots(0)
+{
+}
+
+template <uint32_t Width>
+WideBVH<Width>::~WideBVH()
+{
+}
+
+template <uint32_t Width>
+std::unique_ptr<IAccelerator::TraversalContext> WideBVH<Width>::allocateTraversalContext() const
+{
+    return std::make_unique<WideTraversalContext>(mWideMaxDepth);
+}
+
+template <uint32_t Width>
+bool WideBVH<Width>::traceClosest(Ray& ray, TraversalContext& ctx, Stats& threadStats) const
+{
+    return traverse<false>(ray, static_cast<WideTraversalContext&>(ctx).stack, threadStats);
+}
+
+template <uint32_t Width>
+bool WideBVH<Width>::traceVisibility(Ray& ray, TraversalContext& ctx, Stats& threadStats) const
+{
+    return traverse<true>(ray, static_cast<WideTraversalContext&>(ctx).stack, threadStats);
+}
+
+template <uint32_t Width>
+void WideBVH<Width>::build(uint32_t numThreads)
+{
+    if (mPrimVector.size() > MAX_LEAF_FIRST_PRIMITIVE)
+    {
+        throw std::runtime_error("Too many primitives for a wide BVH");
+    }
+
+    BVH::build(numThreads);
+
+    HighResTimer t;
+    t.start();
+
+    mWideNodes.clear();
+    mWideMaxDepth = 0;
+    mFilledSlots = 0;
+    collapse(0, 0);
+
+    // Only the wide nodes are traversed
+    NodeBuffer().swap(mNodes);
+
+    std::cout << "Wide BVH Stats:" << std::endl;
+    std::cout << std::left << std::setw(30) << "  Node width:" << Width << std::endl;
+    std::cout << std::left << std::setw(30) << "  Max depth:" << mWideMaxDepth << std::endl;
+    std::cout << std::left << std::setw(30) << "  Total nodes:" << mWideNodes.size() << std::endl;
+    std::cout << std::left << std::setw(30) << "  Average children per node:"
+        << (float)mFilledSlots / (float)mWideNodes.size() << std::endl;
+    std::cout << std::left << std::setw(30) << "  Collapse time:" << t.elapsedToString(t.elapsed()) << std::endl;
+}
+
+template <uint32_t Width>
+uint32_t WideBVH<Width>::collapse(uint32_t nodeIdx, uint32_t depth)
+{
+    const uint32_t wideNodeIdx = (uint32_t)mWideNodes.size();
+    mWideNodes.emplace_back();
+    mWideMaxDepth = std::max(depth, mWideMaxDepth);
+
+    // Pull up grandchildren in place of the child with the largest surface
+    // area, the one most likely to be hit, until the node is full.
+    uint32_t slots[Width];
+    uint32_t numSlots = 0;
+    if (mNodes[nodeIdx].isLeaf())
+    {
+        slots[numSlots++] = nodeIdx;
+    }
+    else
+    {
+        slots[numSlots++] = nodeIdx + 1;
+        slots[numSlots++] = mNodes[nodeIdx].rightChildIdx();
+    }
+
+    while (numSlots < Width)
+    {
+        int32_t largestSlot = -1;
+        float largestArea = -1.f;
+        for (uint32_t slot = 0; slot < numSlots; ++slot)
+        {
+            const Node& child = mNodes[slots[slot]];
+            if (!child.isLeaf() && child.bounds().surfaceArea() > largestArea)
+            {
+                largestArea = child.bounds().surfaceArea();
+                largestSlot = (int32_t)slot;
+            }
+        }
+
+        if (largestSlot < 0)
+        {
+            break;
+        }
+
+        const uint32_t openedIdx = slots[largestSlot];
+        slots[largestSlot] = openedIdx + 1;
+        slots[numSlots++] = mNodes[openedIdx].rightChildIdx();
+    }
+
+    for (uint32_t slot = 0; slot < numSlots; ++slot)
+    {
+        const Node& child = mNodes[slots[slot]];
+        if (child.isLeaf() && child.primitiveCount() == 0)
+        {
+            // Only the root of an empty scene
+            continue;
+        }
+
+        const uint32_t childRef = child.isLeaf() ? leafRef(child) : collapse(slots[slot], depth + 1);
+        mWideNodes[wideNodeIdx].setChild(slot, child.bounds(), childRef);
+        ++mFilledSlots;
+    }
+
+    return wideNodeIdx;
+}
+
+template <uint32_t Width>
+uint32_t WideBVH<Width>::leafRef(const Node& leaf) const
+{
+    TP_ASSERT(leaf.primitiveCount() > 0 && leaf.primitiveCount() <= LEAF_COUNT_MASK + 1);
+    TP_ASSERT(leaf.firstPrimitive() <= MAX_LEAF_FIRST_PRIMITIVE);
+
+    return LEAF_FLAG | (leaf.firstPrimitive() << LEAF_COUNT_BITS) | (leaf.primitiveCount() - 1);
+}
+
+template class WideBVH<4>;
+#ifdef __AVX__
+template class WideBVH<8>;
+#endif
@@ -0,0 +1,194 @@
+#ifndef __WIDE_BVH_H__
+#define __WIDE_BVH_H__
+
+#include <vector>
+#include <cstdint>
+
+#include "aligned_allocator.h"
+#include "common.h"
+#include "stats.h"
+#include "vector.h"
+#include "bvh.h"
+
+
+class Ray;
+
+
+// BVH with Width children per node, collapsed from the binary BVH. Child
+// bounds are stored SoA so one SIMD slab test checks all of a node's
+// children at once.
+template <uint32_t Width>
+class WideBVH : public BVH
+{
+private:
+    using SimdType = SimdVector<Width>;
+
+    // Children are either other nodes or leaves, leaf references pack the
+    // first primitive and the primitive count into one word.
+    enum ChildRef : uint32_t
+    {
+        LEAF_FLAG = 0x80000000,
+        LEAF_COUNT_BITS = 4,
+        LEAF_COUNT_MASK = (1 << LEAF_COUNT_BITS) - 1,
+        MAX_LEAF_FIRST_PRIMITIVE = (LEAF_FLAG >> LEAF_COUNT_BITS) - 1
+    };
+
+    struct alignas(sizeof(float) * Width) WideNode
+    {
+        explicit WideNode();
+
+        void setChild(uint32_t slot, const AABBox& bounds, uint32_t childRef);
+
+        // Lower x, y, z then upper x, y, z planes of every child. Unused
+        // slots have inverted infinite bounds so they never intersect.
+        float       planes[6][Width];
+        uint32_t    children[Width];
+    };
+    using WideNodeBuffer = std::vector<WideNode, AlignedAllocator<WideNode> >;
+
+    struct TraversalState
+    {
+        uint32_t childRef;
+        float minT;
+    };
+    using TraversalBuffer = std::vector<TraversalState, AlignedAllocator<TraversalState> >;
+
+    class WideTraversalContext : public TraversalContext
+    {
+    public:
+        explicit WideTraversalContext(uint32_t maxDepth)
+            : stack((Width - 1) * (maxDepth + 1) + 1) { }
+
+        TraversalBuffer stack;
+    };
+
+public:
+    explicit WideBVH();
+    ~WideBVH();
+
+    void build(uint32_t numThreads) override;
+    std::unique_ptr<TraversalContext> allocateTraversalContext() const override;
+
+protected:
+    bool traceClosest(Ray& ray, TraversalContext& ctx, Stats& threadStats) const override;
+    bool traceVisibility(Ray& ray, TraversalContext& ctx, Stats& threadStats) const override;
+
+private:
+    template <bool visibilityTest>
+    bool traverse(Ray& ray, TraversalBuffer& traversalStack, Stats& threadStats) const;
+
+    uint32_t collapse(uint32_t nodeIdx, uint32_t depth);
+    uint32_t leafRef(const Node& leaf) const;
+
+    static bool isLeafRef(uint32_t childRef) { return (childRef & LEAF_FLAG) != 0; }
+    static uint32_t leafFirstPrimitive(uint32_t childRef) { return (childRef & ~LEAF_FLAG) >> LEAF_COUNT_BITS; }
+    static uint32_t leafPrimitiveCount(uint32_t childRef) { return (childRef & LEAF_COUNT_MASK) + 1; }
+
+    WideNodeBuffer      mWideNodes;
+    uint32_t            mWideMaxDepth;
+    size_t              mFilledSlots;
+};
+
+
+template <uint32_t Width>
+template <bool visibilityTest>
+bool WideBVH<Width>::traverse(Ray& ray, TraversalBuffer& traversalStack, Stats& threadStats) const
+{
+    const glm::vec3 invDir = 1.f / ray.dir();
+    const glm::vec3 rayOrigin = ray.origin();
+
+    // Test against the near plane of every slab first, which is the lower
+    // one for positive directions.
+    uint32_t nearPlanes[3];
+    uint32_t farPlanes[3];
+    typename SimdType::Type origins[3];
+    typename SimdType::Type invDirs[3];
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        nearPlanes[axis] = invDir[axis] >= 0.f ? axis : axis + 3;
+        farPlanes[axis] = invDir[axis] >= 0.f ? axis + 3 : axis;
+        origins[axis] = SimdType::set1(rayOrigin[axis]);
+        invDirs[axis] = SimdType::set1(invDir[axis]);
+    }
+
+    bool hitPrimitive = false;
+    alignas(sizeof(float) * Width) float childMinTs[Width];
+    uint32_t traversalStackIdx = 0;
+
+    TraversalState& root = traversalStack[traversalStackIdx++];
+    root.childRef = 0;
+    root.minT = ray.minT();
+
+    while (traversalStackIdx > 0)
+    {
+        const TraversalState state = traversalStack[--traversalStackIdx];
+
+        // Culled by a hit closer than the child's box
+        if (state.minT > ray.maxT())
+        {
+            continue;
+        }
+
+        if (isLeafRef(state.childRef))
+        {
+            PrimitiveVector::const_iterator it = mPrimVector.begin() + leafFirstPrimitive(state.childRef);
+            PrimitiveVector::const_iterator end = it + leafPrimitiveCount(state.childRef);
+            for (; it != end; ++it)
+            {
+                threadStats.primitiveTests++;
+                if ((*it)->intersect(ray))
+                {
+                    if (visibilityTest)
+                    {
+                        return true;
+                    }
+
+                    hitPrimitive = true;
+                }
+            }
+            continue;
+        }
+
+        const WideNode& node = mWideNodes[state.childRef];
+        threadStats.boxTests++;
+
+        typename SimdType::Type minT = SimdType::set1(ray.minT());
+        typename SimdType::Type maxT = SimdType::set1(ray.maxT());
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            const typename SimdType::Type nearT = SimdType::mul(
+                SimdType::sub(SimdType::load(node.planes[nearPlanes[axis]]), origins[axis]), invDirs[axis]);
+            const typename SimdType::Type farT = SimdType::mul(
+                SimdType::sub(SimdType::load(node.planes[farPlanes[axis]]), origins[axis]), invDirs[axis]);
+
+            // Running t second so NaNs from rays on a slab plane are dropped
+            minT = SimdType::max(nearT, minT);
+            maxT = SimdType::min(farT, maxT);
+        }
+
+        uint32_t hitMask = SimdType::lessEqualMask(minT, maxT);
+        SimdType::store(childMinTs, minT);
+
+        // Push the hit children farthest first so the nearest is popped next
+        const uint32_t firstPushed = traversalStackIdx;
+        while (hitMask)
+        {
+            const uint32_t slot = (uint32_t)__builtin_ctz(hitMask);
+            hitMask &= hitMask - 1;
+
+            uint32_t idx = traversalStackIdx++;
+            while (idx > firstPushed && traversalStack[idx - 1].minT < childMinTs[slot])
+            {
+                traversalStack[idx] = traversalStack[idx - 1];
+                --idx;
+            }
+
+            traversalStack[idx].childRef = node.children[slot];
+            traversalStack[idx].minT = childMinTs[slot];
+        }
+    }
+
+    return hitPrimitive;
+}
+
+#endif